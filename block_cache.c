@@ -0,0 +1,175 @@
+#include "block_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BC_VALID 0x1u
+#define BC_REF   0x2u   // Usado desde la última pasada de la aguja
+#define BC_DIRTY 0x4u
+
+static uint32_t bc_hash(const BlockCache *bc, uint32_t block) {
+    return (block * 2654435761u) & (bc->nbuckets - 1);
+}
+
+int bc_init(BlockCache *bc, size_t block_bytes, size_t cap_bytes,
+            bc_io_fn io, void *ctx) {
+    memset(bc, 0, sizeof(*bc));
+    bc->block_bytes = block_bytes;
+    bc->io  = io;
+    bc->ctx = ctx;
+    uint32_t n = block_bytes ? (uint32_t)(cap_bytes / block_bytes) : 0;
+    if (n == 0) return 0;
+    bc->nbuckets = 1;
+    while (bc->nbuckets < 2 * n) bc->nbuckets <<= 1;
+    bc->data   = malloc(block_bytes * n);
+    bc->block  = malloc(sizeof(uint32_t) * n);
+    bc->state  = calloc(n, 1);
+    bc->pins   = calloc(n, sizeof(uint16_t));
+    bc->next   = malloc(sizeof(int32_t) * n);
+    bc->bucket = malloc(sizeof(int32_t) * bc->nbuckets);
+    if (!bc->data || !bc->block || !bc->state || !bc->pins || !bc->next ||
+        !bc->bucket) {
+        bc_destroy(bc);
+        return -1;
+    }
+    memset(bc->bucket, 0xff, sizeof(int32_t) * bc->nbuckets);
+    bc->nslots = n;
+    return 0;
+}
+
+void bc_destroy(BlockCache *bc) {
+    if (!bc) return;
+    free(bc->data);
+    free(bc->block);
+    free(bc->state);
+    free(bc->pins);
+    free(bc->next);
+    free(bc->bucket);
+    memset(bc, 0, sizeof(*bc));
+}
+
+static int32_t bc_find(const BlockCache *bc, uint32_t block) {
+    for (int32_t s = bc->bucket[bc_hash(bc, block)]; s >= 0; s = bc->next[s])
+        if (bc->block[s] == block) return s;
+    return -1;
+}
+
+static void bc_unlink(BlockCache *bc, int32_t slot) {
+    int32_t *p = &bc->bucket[bc_hash(bc, bc->block[slot])];
+    while (*p != slot) p = &bc->next[*p];
+    *p = bc->next[slot];
+    if (bc->state[slot] & BC_DIRTY) bc->ndirty--;
+    if (bc->pins[slot]) bc->npinned--;
+    bc->pins[slot]  = 0;
+    bc->state[slot] = 0;
+    bc->used--;
+}
+
+static int bc_write_back(BlockCache *bc, int32_t slot) {
+    if (bc->io(bc->ctx, bc->block[slot],
+               bc->data + (size_t)slot * bc->block_bytes, 1) < 0)
+        return -1;
+    bc->state[slot] &= ~BC_DIRTY;
+    bc->ndirty--;
+    bc->writebacks++;
+    return 0;
+}
+
+// Hueco libre o víctima del CLOCK (escrita si estaba sucia); los fijados
+// se saltan (bc_pin deja siempre al menos media caché libre de ellos)
+static int32_t bc_victim(BlockCache *bc) {
+    for (uint32_t scanned = 0; ; ++scanned) {
+        uint32_t s = bc->hand;
+        bc->hand = (bc->hand + 1) % bc->nslots;
+        if (!(bc->state[s] & BC_VALID)) return (int32_t)s;
+        if (bc->pins[s]) {
+            if (scanned >= 3 * bc->nslots) return -1;
+            continue;
+        }
+        if ((bc->state[s] & BC_REF) && scanned < 2 * bc->nslots) {
+            bc->state[s] &= ~BC_REF;
+            continue;
+        }
+        if ((bc->state[s] & BC_DIRTY) && bc_write_back(bc, (int32_t)s) < 0)
+            return -1;
+        bc_unlink(bc, (int32_t)s);
+        return (int32_t)s;
+    }
+}
+
+uint8_t *bc_get(BlockCache *bc, uint32_t block, int write, int whole) {
+    if (bc->nslots == 0) return NULL;
+    int32_t s = bc_find(bc, block);
+    if (s >= 0) {
+        bc->hits++;
+    } else {
+        bc->misses++;
+        s = bc_victim(bc);
+        if (s < 0) return NULL;
+        uint8_t *buf = bc->data + (size_t)s * bc->block_bytes;
+        if (!whole && bc->io(bc->ctx, block, buf, 0) < 0) return NULL;
+        bc->block[s] = block;
+        bc->state[s] = BC_VALID;
+        uint32_t h = bc_hash(bc, block);
+        bc->next[s] = bc->bucket[h];
+        bc->bucket[h] = s;
+        bc->used++;
+    }
+    bc->state[s] |= BC_REF;
+    if (write && !(bc->state[s] & BC_DIRTY)) {
+        bc->state[s] |= BC_DIRTY;
+        bc->ndirty++;
+    }
+    return bc->data + (size_t)s * bc->block_bytes;
+}
+
+const uint8_t *bc_pin(BlockCache *bc, uint32_t block) {
+    if (bc->nslots == 0) return NULL;
+    int32_t s = bc_find(bc, block);
+    if ((s < 0 || bc->pins[s] == 0) && bc->npinned >= bc->nslots / 2)
+        return NULL;
+    if (s >= 0 && bc->pins[s] == UINT16_MAX) return NULL;
+    uint8_t *buf = bc_get(bc, block, 0, 0);
+    if (!buf) return NULL;
+    s = (int32_t)((size_t)(buf - bc->data) / bc->block_bytes);
+    if (bc->pins[s]++ == 0) bc->npinned++;
+    return buf;
+}
+
+void bc_unpin(BlockCache *bc, uint32_t block) {
+    if (bc->nslots == 0) return;
+    int32_t s = bc_find(bc, block);
+    if (s >= 0 && bc->pins[s] > 0 && --bc->pins[s] == 0) bc->npinned--;
+}
+
+void bc_drop(BlockCache *bc, uint32_t block) {
+    if (bc->nslots == 0) return;
+    int32_t s = bc_find(bc, block);
+    if (s >= 0) bc_unlink(bc, s);
+}
+
+static int bc_cmp_key(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int bc_flush(BlockCache *bc) {
+    if (bc->ndirty == 0) return 0;
+    // En orden de bloque (clave bloque:hueco): cada segmento se visita una vez
+    uint64_t *keys = malloc(sizeof(uint64_t) * bc->ndirty);
+    uint32_t n = 0;
+    if (keys) {
+        for (uint32_t s = 0; s < bc->nslots; ++s)
+            if (bc->state[s] & BC_DIRTY) keys[n++] = (uint64_t)bc->block[s] << 32 | s;
+        qsort(keys, n, sizeof(uint64_t), bc_cmp_key);
+    }
+    int rc = 0;
+    if (keys) {
+        for (uint32_t k = 0; k < n && rc == 0; ++k)
+            rc = bc_write_back(bc, (int32_t)(uint32_t)keys[k]);
+    } else {
+        for (uint32_t s = 0; s < bc->nslots && rc == 0; ++s)
+            if (bc->state[s] & BC_DIRTY) rc = bc_write_back(bc, (int32_t)s);
+    }
+    free(keys);
+    return rc;
+}
@@ -0,0 +1,56 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Caché de bloques decodificados (bytes alineados), indexada por número
+// global de bloque. Expulsa con CLOCK y escribe los sucios a través de io
+// al expulsarlos o en bc_flush.
+
+// Lee (write = 0) o escribe (write = 1) el bloque entero en/desde buf
+typedef int (*bc_io_fn)(void *ctx, uint32_t block, uint8_t *buf, int write);
+
+typedef struct {
+    size_t    block_bytes;
+    uint32_t  nslots;           // 0 = caché desactivada
+    uint8_t  *data;             // nslots × block_bytes
+    uint32_t *block;            // Bloque de cada hueco
+    uint8_t  *state;            // BC_* por hueco
+    uint16_t *pins;             // Lectores que apuntan al hueco (no se expulsa)
+    int32_t  *next;             // Cadena de la cubeta
+    int32_t  *bucket;           // nbuckets cabezas (-1 vacía)
+    uint32_t  nbuckets;         // Potencia de 2
+    uint32_t  hand;             // Aguja del CLOCK
+    uint32_t  used;             // Huecos ocupados
+    uint32_t  ndirty;
+    uint32_t  npinned;          // Huecos con pins > 0
+    bc_io_fn  io;
+    void     *ctx;
+    unsigned long hits, misses, writebacks;
+} BlockCache;
+
+// Reserva huecos para cap_bytes / block_bytes bloques; 0 o -1 sin memoria
+int  bc_init(BlockCache *bc, size_t block_bytes, size_t cap_bytes,
+             bc_io_fn io, void *ctx);
+// Libera la caché sin escribir los sucios
+void bc_destroy(BlockCache *bc);
+
+// Contenido del bloque en la caché, cargándolo si falta (salvo que vaya a
+// sobrescribirse entero: whole). Con write queda marcado como sucio. El
+// puntero vale hasta la siguiente llamada; NULL si la E/S falla.
+uint8_t *bc_get(BlockCache *bc, uint32_t block, int write, int whole);
+
+// Como bc_get en lectura, pero el hueco no se expulsa hasta bc_unpin: el
+// puntero sigue valiendo tras otras llamadas. NULL si la E/S falla o si ya
+// hay media caché fijada.
+const uint8_t *bc_pin(BlockCache *bc, uint32_t block);
+void           bc_unpin(BlockCache *bc, uint32_t block);
+
+// Olvida el bloque sin escribirlo (se liberó)
+void bc_drop(BlockCache *bc, uint32_t block);
+
+// Escribe todos los sucios (en orden de bloque); 0 o -1
+int  bc_flush(BlockCache *bc);
+
+#endif
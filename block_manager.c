@@ -1,11 +1,77 @@
 #include "block_manager.h"
+#include <stdlib.h>
 #include <string.h>
 
+// Lee la palabra w del bitmap: el bloque w*64 queda en el bit más
+// significativo (el orden de los píxeles). Los bits posteriores al último
+// bloque se devuelven como ocupados.
+static uint64_t bm_load_word(const BlockManager *bm, int w) {
+    size_t bit     = (size_t)bm->offset_bit + (size_t)w * 64;
+    const uint8_t *p = bm->img->bits + bit / 8;
+    unsigned sh    = bit % 8;
+    int nvalid     = bm->block_count - w * 64;
+    if (nvalid > 64) nvalid = 64;
+    size_t need    = (sh + nvalid + 7) / 8;  // Bytes que tocan bloques válidos (≤ 9)
+
+    uint64_t hi = 0;
+    for (size_t i = 0; i < need && i < 8; ++i)
+        hi |= (uint64_t)p[i] << (56 - 8 * i);
+    uint64_t v = hi << sh;
+    if (need == 9) v |= p[8] >> (8 - sh);
+    if (nvalid < 64) v |= ~0ULL >> nvalid;
+    return v;
+}
+
+static void bm_set_full(BlockManager *bm, int w, int full) {
+    if (!bm->full) return;
+    if (full) bm->full[w / 64] |=  ((uint64_t)1 << (w % 64));
+    else      bm->full[w / 64] &= ~((uint64_t)1 << (w % 64));
+}
+
 void bm_init(BlockManager *bm, PBMImage *img, int offset_bit, int block_count) {
     if (!img || block_count <= 0 || offset_bit < 0) return;
     bm->img = img;
     bm->offset_bit = offset_bit;
     bm->block_count = block_count;
+    bm->words = (block_count + 63) / 64;
+    bm->hint  = 0;
+
+    // Si no hay memoria para el resumen, la búsqueda recorre todas las palabras
+    int summary_words = (bm->words + 63) / 64;
+    bm->full = calloc(summary_words, sizeof(uint64_t));
+    bm->free_count = 0;
+    for (int w = 0; w < bm->words; ++w) {
+        uint64_t word = bm_load_word(bm, w);
+        bm->free_count += 64 - __builtin_popcountll(word);
+        if (word == ~0ULL) bm_set_full(bm, w, 1);
+    }
+    // Las posiciones del resumen sin palabra detrás cuentan como llenas
+    for (int w = bm->words; bm->full && w < summary_words * 64; ++w)
+        bm_set_full(bm, w, 1);
+}
+
+void bm_destroy(BlockManager *bm) {
+    if (!bm) return;
+    free(bm->full);
+    bm->full = NULL;
+}
+
+// Primera palabra desde from que puede tener bloques libres, o -1
+static int bm_find_free_word(const BlockManager *bm, int from) {
+    if (from >= bm->words) return -1;
+    if (!bm->full) {
+        for (int w = from; w < bm->words; ++w)
+            if (bm_load_word(bm, w) != ~0ULL) return w;
+        return -1;
+    }
+    int summary_words = (bm->words + 63) / 64;
+    int sw = from / 64;
+    uint64_t m = ~bm->full[sw] & (~0ULL << (from % 64));
+    for (;;) {
+        if (m) return sw * 64 + __builtin_ctzll(m);
+        if (++sw >= summary_words) return -1;
+        m = ~bm->full[sw];
+    }
 }
 
 int bm_alloc(BlockManager *bm, int block_idx) {
@@ -13,7 +79,11 @@ int bm_alloc(BlockManager *bm, int block_idx) {
     int bitpos = bm->offset_bit + block_idx;
     int byte_offset = bitpos / 8;
     int bit_offset = 7 - (bitpos % 8);
+    if (!(bm->img->bits[byte_offset] & (1 << bit_offset))) bm->free_count--;
     bm->img->bits[byte_offset] |= (1 << bit_offset);
+    pbm_mark_dirty(bm->img, byte_offset, 1);
+    int w = block_idx / 64;
+    if (bm_load_word(bm, w) == ~0ULL) bm_set_full(bm, w, 1);
     return 0;
 }
 
@@ -22,7 +92,12 @@ int bm_free(BlockManager *bm, int block_idx) {
     int bitpos = bm->offset_bit + block_idx;
     int byte_offset = bitpos / 8;
     int bit_offset = 7 - (bitpos % 8);
+    if (bm->img->bits[byte_offset] & (1 << bit_offset)) bm->free_count++;
     bm->img->bits[byte_offset] &= ~(1 << bit_offset);
+    pbm_mark_dirty(bm->img, byte_offset, 1);
+    int w = block_idx / 64;
+    bm_set_full(bm, w, 0);
+    if (w < bm->hint) bm->hint = w;
     return 0;
 }
 
@@ -35,13 +110,82 @@ int bm_is_allocated(const BlockManager *bm, int block_idx) {
 }
 
 int bm_alloc_first(BlockManager *bm) {
-    for (int i = 0; i < bm->block_count; ++i) {
-        if (bm_is_allocated(bm, i) == 0) {
-            bm_alloc(bm, i);
-            return i;
+    // El resumen descarta de a 64 palabras llenas por comparación; dentro de
+    // la palabra elegida, el primer cero es el primer bloque libre
+    int w = bm_find_free_word(bm, bm->hint);
+    if (w < 0) {
+        bm->hint = bm->words;
+        return -1;
+    }
+    bm->hint = w;
+    uint64_t word = bm_load_word(bm, w);
+    int idx = w * 64 + __builtin_clzll(~word);
+    bm_alloc(bm, idx);
+    return idx;
+}
+
+// Candidato a tramo para bm_alloc_range; retorna 1 si es un ajuste exacto
+static int bm_consider_run(int want, int start, int len,
+                           int *best_start, int *best_len) {
+    if (len <= 0) return 0;
+    if (len >= want) {
+        if (*best_len < want || len < *best_len) {
+            *best_start = start;
+            *best_len   = len;
         }
+        return len == want;
     }
-    return -1;
+    if (*best_len < want && len > *best_len) {
+        *best_start = start;
+        *best_len   = len;
+    }
+    return 0;
+}
+
+int bm_alloc_range(BlockManager *bm, int want, int *got) {
+    if (!bm || want <= 0 || bm->free_count == 0) return -1;
+    int best_start = -1, best_len = 0;
+    int run_start  = 0,  run_len  = 0;
+    int exact = 0;
+
+    int w = bm_find_free_word(bm, bm->hint);
+    while (w >= 0 && w < bm->words && !exact) {
+        uint64_t word = bm_load_word(bm, w);
+        if (word == ~0ULL) {
+            // Palabra llena: cierra el tramo y salta las llenas con el resumen
+            exact = bm_consider_run(want, run_start, run_len, &best_start, &best_len);
+            run_len = 0;
+            w = bm_find_free_word(bm, w + 1);
+            continue;
+        }
+        // Recorre la palabra por tramos de ceros (libres) y unos (ocupados)
+        int b = 0;
+        while (b < 64 && !exact) {
+            uint64_t v = word << b;
+            if (v >> 63) {
+                int n = ~v ? __builtin_clzll(~v) : 64 - b;
+                if (n > 64 - b) n = 64 - b;
+                exact = bm_consider_run(want, run_start, run_len, &best_start, &best_len);
+                run_len = 0;
+                b += n;
+            } else {
+                int n = v ? __builtin_clzll(v) : 64 - b;
+                if (n > 64 - b) n = 64 - b;
+                if (run_len == 0) run_start = w * 64 + b;
+                run_len += n;
+                b += n;
+            }
+        }
+        w++;  // Un tramo abierto continúa en la palabra siguiente
+    }
+    if (!exact)
+        bm_consider_run(want, run_start, run_len, &best_start, &best_len);
+    if (best_start < 0) return -1;
+
+    int n = best_len < want ? best_len : want;
+    for (int i = 0; i < n; ++i) bm_alloc(bm, best_start + i);
+    if (got) *got = n;
+    return best_start;
 }
 
 uint32_t bm_checksum(const BlockManager *bm) {
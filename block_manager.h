@@ -11,11 +11,21 @@ typedef struct {
     PBMImage *img;
     int offset_bit;        // Bit donde inicia el bitmap (en la imagen)
     int block_count;       // Total de bloques gestionados
+    // Resumen en memoria (el formato en la imagen no cambia): el bit w de
+    // full indica que la palabra w del bitmap (bloques w*64..w*64+63) está llena
+    uint64_t *full;
+    int       words;       // Palabras de 64 bloques del bitmap
+    int       hint;        // Ninguna palabra anterior tiene bloques libres
+    uint32_t  free_count;  // Bloques libres (lo mantienen bm_alloc/bm_free)
 } BlockManager;
 
 // Inicializa el gestor (bitmap inicia en offset_bit, maneja block_count bloques)
+// y construye el resumen a partir del bitmap de la imagen
 void bm_init(BlockManager *bm, PBMImage *img, int offset_bit, int block_count);
 
+// Libera el resumen en memoria
+void bm_destroy(BlockManager *bm);
+
 // Marca el bloque como usado/libre
 int bm_alloc(BlockManager *bm, int block_idx);
 int bm_free(BlockManager *bm, int block_idx);
@@ -26,6 +36,11 @@ int bm_is_allocated(const BlockManager *bm, int block_idx);
 // Busca y reserva el primer bloque libre, retorna su índice o -1 si no hay espacio
 int bm_alloc_first(BlockManager *bm);
 
+// Reserva un tramo contiguo: el menor tramo libre con al menos want bloques
+// (best-fit) o, si no hay ninguno, el mayor. Retorna el primer bloque y deja
+// en *got cuántos se reservaron (≤ want), o -1 si no queda ningún bloque libre
+int bm_alloc_range(BlockManager *bm, int want, int *got);
+
 // Calcula checksum XOR de todo el bitmap de bloques
 uint32_t bm_checksum(const BlockManager *bm);
 
@@ -1,97 +1,697 @@
 #include "directory.h"
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 
-void dir_init(Directory *dir) {
-    memset(dir, 0, sizeof(*dir));
-    dir->max_entries = BWFS_MAX_FILES;
+#define DIR_MARK_SUM   0x1  // Pendiente de recalcular en dir_checksum
+#define DIR_MARK_SAVE  0x2  // Pendiente de guardar
+
+// Índices que recorren los lectores sin cerrojo: accesos atómicos relajados
+// (el orden lo dan la publicación de la vista y los contadores de secuencia)
+#define DIR_LD(x)    atomic_load_explicit(&(x), memory_order_relaxed)
+#define DIR_ST(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+static DirEntry *dir_at(const Directory *dir, uint32_t idx) {
+    return &dir->pages[idx >> BWFS_DIR_PAGE_SHIFT][idx & (BWFS_DIR_PAGE - 1)];
 }
 
-int dir_find(const Directory *dir, const char *name) {
-    for (int i = 0; i < (int)dir->max_entries; ++i) {
-        if (dir->entries[i].used &&
-            strncmp(dir->entries[i].name, name, BWFS_FILENAME_MAXLEN) == 0) {
-            return i;
+static int dir_is_orphan(const Directory *dir, uint32_t idx) {
+    return (int)dir_at(dir, idx)->parent - 1 == BWFS_DIR_ORPHAN;
+}
+
+// Lista de hermanos de una entrada (padres corruptos cuelgan de la raíz)
+static uint32_t dir_list_of(const Directory *dir, uint32_t idx) {
+    uint32_t p = dir_at(dir, idx)->parent;
+    return p <= dir->max_entries ? p : 0;
+}
+
+// FNV-1a del padre y de los mismos caracteres que compara dir_lookup
+static uint32_t dir_hash(int parent, const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (int k = 0; k < 4; ++k) {
+        h ^= (uint8_t)((uint32_t)parent >> (8 * k));
+        h *= 16777619u;
+    }
+    for (size_t i = 0; i < len && i < BWFS_FILENAME_MAXLEN && name[i]; ++i) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t dir_entry_hash(const Directory *dir, int idx) {
+    const DirEntry *e = dir_at(dir, idx);
+    return dir_hash((int)e->parent - 1, e->name, BWFS_FILENAME_MAXLEN) &
+           (dir->nbuckets - 1);
+}
+
+static void dir_index_add(Directory *dir, int idx) {
+    uint32_t b = dir_entry_hash(dir, idx);
+    DIR_ST(dir->next[idx], DIR_LD(dir->bucket[b]));
+    DIR_ST(dir->bucket[b], idx);
+}
+
+static void dir_index_del(Directory *dir, int idx) {
+    _Atomic int32_t *link = &dir->bucket[dir_entry_hash(dir, idx)];
+    int32_t i;
+    while ((i = DIR_LD(*link)) >= 0 && i != idx) link = &dir->next[i];
+    if (i == idx) DIR_ST(*link, DIR_LD(dir->next[idx]));
+}
+
+static void dir_link_child(Directory *dir, int idx) {
+    uint32_t p = dir_list_of(dir, idx);
+    int32_t first = DIR_LD(dir->first_child[p]);
+    dir->prev_sib[idx] = -1;
+    DIR_ST(dir->next_sib[idx], first);
+    if (first >= 0) dir->prev_sib[first] = idx;
+    DIR_ST(dir->first_child[p], idx);
+    if (p > 0) dir->nchild[p - 1]++;
+}
+
+static void dir_unlink_child(Directory *dir, int idx) {
+    uint32_t p = dir_list_of(dir, idx);
+    int32_t prev = dir->prev_sib[idx], next = DIR_LD(dir->next_sib[idx]);
+    if (prev >= 0) DIR_ST(dir->next_sib[prev], next);
+    else           DIR_ST(dir->first_child[p], next);
+    if (next >= 0) dir->prev_sib[next] = prev;
+    if (p > 0) dir->nchild[p - 1]--;
+}
+
+static void dir_set_free(Directory *dir, uint32_t idx, int is_free) {
+    if (is_free) {
+        dir->free_map[idx / 64] |= ((uint64_t)1 << (idx % 64));
+        if (idx / 64 < dir->free_hint) dir->free_hint = idx / 64;
+    } else {
+        dir->free_map[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+    }
+}
+
+// Primera entrada libre (la de menor índice), o -1
+static int dir_first_free(Directory *dir) {
+    uint32_t words = (dir->max_entries + 63) / 64;
+    for (uint32_t w = dir->free_hint; w < words; ++w) {
+        if (dir->free_map[w]) {
+            dir->free_hint = w;
+            return w * 64 + __builtin_ctzll(dir->free_map[w]);
         }
     }
+    dir->free_hint = words;
     return -1;
 }
 
-int dir_create(Directory *dir, const char *name) {
-    if (!name || name[0] == '\0') return -1;
-    if (dir_find(dir, name) >= 0) return -1;
-    for (int i = 0; i < (int)dir->max_entries; ++i) {
-        DirEntry *e = &dir->entries[i];
-        if (!e->used) {
-            memset(e, 0, sizeof(*e));
-            strncpy(e->name, name, BWFS_FILENAME_MAXLEN-1);
-            e->name[BWFS_FILENAME_MAXLEN-1] = '\0';
-            e->used    = 1;
-            e->is_dir  = 0;
-            return i;
+// Aporte de la entrada idx al checksum: sus bytes más su posición en la tabla
+static uint32_t dir_entry_sum(const Directory *dir, uint32_t idx) {
+    const uint8_t *bytes = (const uint8_t *)dir_at(dir, idx);
+    uint32_t base = idx * (uint32_t)sizeof(DirEntry), sum = 0;
+    for (size_t j = 0; j < sizeof(DirEntry); ++j)
+        sum ^= bytes[j] + (base + (uint32_t)j);
+    return sum;
+}
+
+static void dir_touch(Directory *dir, uint32_t idx) {
+    uint8_t m = dir->mark[idx];
+    if (!(m & DIR_MARK_SUM))  dir->sum_list[dir->n_sum++]   = idx;
+    if (!(m & DIR_MARK_SAVE)) dir->save_list[dir->n_save++] = idx;
+    dir->mark[idx] = m | DIR_MARK_SUM | DIR_MARK_SAVE;
+}
+
+static void dir_cache_reset(Directory *dir) {
+    memset(dir->dcache, 0, sizeof(dir->dcache));
+    dir->dc_clock   = 1;
+    dir->dc_pos_gen = 1;
+    dir->dc_neg_gen = 1;
+}
+
+static void dir_rehash(Directory *dir) {
+    for (uint32_t b = 0; b < dir->nbuckets; ++b) DIR_ST(dir->bucket[b], -1);
+    // En orden inverso para que cada cadena quede en orden de índice
+    for (int i = (int)dir->max_entries - 1; i >= 0; --i)
+        if (dir_at(dir, i)->used && !dir_is_orphan(dir, i)) dir_index_add(dir, i);
+}
+
+#define DIR_REALLOC(ptr, n) do {                                  \
+        void *p_ = realloc((ptr), (size_t)(n) * sizeof(*(ptr)));  \
+        if (!p_) return -1;                                       \
+        (ptr) = p_;                                               \
+    } while (0)
+
+// Los arreglos que recorren los lectores sin cerrojo no se liberan al
+// crecer: el anterior queda retirado (intacto) hasta dir_destroy. Cada
+// dir_grow retira a lo sumo DIR_GROW_RETIRES (cuatro índices, las páginas y
+// la vista) y reserva sitio antes de cambiar nada, así que retirar no falla.
+#define DIR_GROW_RETIRES 6
+
+static int dir_retire_reserve(Directory *dir, uint32_t n) {
+    if (dir->n_retired + n <= dir->retired_cap) return 0;
+    uint32_t cap = dir->retired_cap ? dir->retired_cap : 16;
+    while (cap < dir->n_retired + n) cap *= 2;
+    void **r = realloc(dir->retired, cap * sizeof(void *));
+    if (!r) return -1;
+    dir->retired     = r;
+    dir->retired_cap = cap;
+    return 0;
+}
+
+static int dir_retire(Directory *dir, void *p) {
+    if (!p) return 0;
+    if (dir_retire_reserve(dir, 1) < 0) return -1;
+    dir->retired[dir->n_retired++] = p;
+    return 0;
+}
+
+// Publica una vista con el estado actual (nv ya reservada); la anterior se
+// retira porque algún lector puede estar copiándola
+static void dir_publish(Directory *dir, DirView *nv) {
+    nv->pages       = dir->pages;
+    nv->max_entries = dir->max_entries;
+    nv->nbuckets    = dir->nbuckets;
+    nv->bucket      = dir->bucket;
+    nv->next        = dir->next;
+    nv->first_child = dir->first_child;
+    nv->next_sib    = dir->next_sib;
+    DirView *old = atomic_exchange_explicit(&dir->view, nv, memory_order_acq_rel);
+    dir_retire(dir, old);
+}
+
+#define DIR_REPLACE(dir, ptr, old_n, n) do {                              \
+        void *p_ = malloc((size_t)(n) * sizeof(*(ptr)));                  \
+        if (!p_) return -1;                                               \
+        if (ptr) memcpy(p_, (ptr), (size_t)(old_n) * sizeof(*(ptr)));     \
+        if (dir_retire((dir), (ptr)) < 0) { free(p_); return -1; }        \
+        (ptr) = p_;                                                       \
+    } while (0)
+
+static int dir_resize(Directory *dir, uint32_t max_entries) {
+    uint32_t old = dir->max_entries;
+
+    // Páginas nuevas (las existentes no se mueven)
+    uint32_t old_pages = (old + BWFS_DIR_PAGE - 1) >> BWFS_DIR_PAGE_SHIFT;
+    uint32_t new_pages = (max_entries + BWFS_DIR_PAGE - 1) >> BWFS_DIR_PAGE_SHIFT;
+    DIR_REPLACE(dir, dir->pages, old_pages, new_pages);
+    for (uint32_t pg = old_pages; pg < new_pages; ++pg) {
+        dir->pages[pg] = calloc(BWFS_DIR_PAGE, sizeof(DirEntry));
+        if (!dir->pages[pg]) {
+            // Deja las páginas ya creadas para un reintento
+            while (pg-- > old_pages) free(dir->pages[pg]);
+            return -1;
         }
     }
-    return -1;
+
+    uint32_t old_words = (old + 63) / 64, new_words = (max_entries + 63) / 64;
+    uint32_t nbuckets  = dir->nbuckets ? dir->nbuckets : 16;
+    while (nbuckets < 2 * max_entries) nbuckets *= 2;
+    DIR_REALLOC(dir->free_map,    new_words);
+    DIR_REPLACE(dir, dir->next,        old, max_entries);
+    DIR_REALLOC(dir->nchild,      max_entries);
+    DIR_REPLACE(dir, dir->first_child, old ? old + 1 : 0, max_entries + 1);
+    DIR_REPLACE(dir, dir->next_sib,    old, max_entries);
+    DIR_REALLOC(dir->prev_sib,    max_entries);
+    DIR_REALLOC(dir->contrib,     max_entries);
+    DIR_REALLOC(dir->mark,        max_entries);
+    DIR_REALLOC(dir->sum_list,    max_entries);
+    DIR_REALLOC(dir->save_list,   max_entries);
+    if (nbuckets != dir->nbuckets) DIR_REPLACE(dir, dir->bucket, 0, nbuckets);
+
+    memset(dir->free_map + old_words, 0, (new_words - old_words) * sizeof(uint64_t));
+    for (uint32_t i = old ? old + 1 : 0; i <= max_entries; ++i)
+        DIR_ST(dir->first_child[i], -1);
+    dir->max_entries = max_entries;
+    for (uint32_t i = old; i < max_entries; ++i) {
+        dir->nchild[i]  = 0;
+        dir->mark[i]    = 0;
+        dir->contrib[i] = dir_entry_sum(dir, i);
+        dir->sum       ^= dir->contrib[i];
+        dir_set_free(dir, i, 1);
+    }
+    dir->free_entries += max_entries - old;
+    if (nbuckets != dir->nbuckets) {
+        dir->nbuckets = nbuckets;
+        dir_rehash(dir);
+    }
+    return 0;
 }
 
-int dir_mkdir(Directory *dir, const char *name) {
-    if (!name || name[0] == '\0') return -1;
-    if (dir_find(dir, name) >= 0) return -1;
-    for (int i = 0; i < (int)dir->max_entries; ++i) {
-        DirEntry *e = &dir->entries[i];
-        if (!e->used) {
-            memset(e, 0, sizeof(*e));
-            strncpy(e->name, name, BWFS_FILENAME_MAXLEN-1);
-            e->name[BWFS_FILENAME_MAXLEN-1] = '\0';
-            e->used    = 1;
-            e->is_dir  = 1;
-            return i;
+int dir_grow(Directory *dir, uint32_t max_entries) {
+    if (max_entries <= dir->max_entries) return 0;
+    DirView *nv = malloc(sizeof(*nv));
+    if (!nv || dir_retire_reserve(dir, DIR_GROW_RETIRES) < 0) {
+        free(nv);
+        return -1;
+    }
+    // Aunque falle a medias, lo que quede es coherente y se publica
+    int rc = dir_resize(dir, max_entries);
+    dir_publish(dir, nv);
+    return rc;
+}
+
+int dir_init_size(Directory *dir, uint32_t max_entries) {
+    memset(dir, 0, sizeof(*dir));
+    dir_cache_reset(dir);
+    if (dir_grow(dir, max_entries) < 0) {
+        dir_destroy(dir);
+        return -1;
+    }
+    return 0;
+}
+
+int dir_init(Directory *dir) {
+    return dir_init_size(dir, BWFS_MAX_FILES);
+}
+
+void dir_destroy(Directory *dir) {
+    if (!dir) return;
+    uint32_t pages = (dir->max_entries + BWFS_DIR_PAGE - 1) >> BWFS_DIR_PAGE_SHIFT;
+    for (uint32_t pg = 0; dir->pages && pg < pages; ++pg) free(dir->pages[pg]);
+    free(dir->pages);
+    free(dir->free_map);
+    free(dir->bucket);
+    free(dir->next);
+    free(dir->nchild);
+    free(dir->first_child);
+    free(dir->next_sib);
+    free(dir->prev_sib);
+    free(dir->contrib);
+    free(dir->mark);
+    free(dir->sum_list);
+    free(dir->save_list);
+    free(atomic_load_explicit(&dir->view, memory_order_relaxed));
+    for (uint32_t k = 0; k < dir->n_retired; ++k) free(dir->retired[k]);
+    free(dir->retired);
+    memset(dir, 0, sizeof(*dir));
+}
+
+void dir_rebuild(Directory *dir) {
+    uint32_t n = dir->max_entries;
+    dir->free_entries = 0;
+    dir->free_hint    = 0;
+    dir->sum          = 0;
+    dir->n_sum        = 0;
+    dir->n_save       = 0;
+    memset(dir->free_map, 0, (n + 63) / 64 * sizeof(uint64_t));
+    memset(dir->nchild, 0, n * sizeof(uint32_t));
+    memset(dir->mark, 0, n);
+    for (uint32_t i = 0; i <= n; ++i) DIR_ST(dir->first_child[i], -1);
+    dir_rehash(dir);
+    for (int i = (int)n - 1; i >= 0; --i) {
+        if (dir_at(dir, i)->used) {
+            if (!dir_is_orphan(dir, i)) dir_link_child(dir, i);
+        } else {
+            dir_set_free(dir, i, 1);
+            dir->free_entries++;
         }
+        dir->contrib[i] = dir_entry_sum(dir, i);
+        dir->sum       ^= dir->contrib[i];
+    }
+    dir_cache_reset(dir);
+}
+
+void dir_view(const Directory *dir, DirView *v) {
+    const DirView *p = atomic_load_explicit(&((Directory *)dir)->view,
+                                            memory_order_acquire);
+    if (p) *v = *p;
+    else   memset(v, 0, sizeof(*v));
+}
+
+const DirEntry *dir_view_entry(const DirView *v, int idx) {
+    if (idx < 0 || (uint32_t)idx >= v->max_entries) return NULL;
+    return &v->pages[(uint32_t)idx >> BWFS_DIR_PAGE_SHIFT][idx & (BWFS_DIR_PAGE - 1)];
+}
+
+// Las entradas se copian y escriben por palabras con atómicos relajados: un
+// lector puede ver una mezcla de dos versiones (la descarta su contador de
+// secuencia), pero nunca hay una carrera de datos
+_Static_assert(sizeof(DirEntry) % sizeof(uint32_t) == 0 &&
+               _Alignof(DirEntry) >= _Alignof(uint32_t),
+               "DirEntry se copia por palabras de 32 bits");
+
+int dir_view_copy(const DirView *v, int idx, DirEntry *out) {
+    const DirEntry *e = dir_view_entry(v, idx);
+    if (!e) return -1;
+    const uint32_t *src = (const uint32_t *)e;
+    uint32_t       *dst = (uint32_t *)out;
+    for (size_t k = 0; k < sizeof(DirEntry) / sizeof(uint32_t); ++k)
+        dst[k] = __atomic_load_n(&src[k], __ATOMIC_RELAXED);
+    return 0;
+}
+
+void dir_entry_put(Directory *dir, int idx, const DirEntry *e) {
+    if (idx < 0 || idx >= (int)dir->max_entries) return;
+    const uint32_t *src = (const uint32_t *)e;
+    uint32_t       *dst = (uint32_t *)dir_at(dir, idx);
+    for (size_t k = 0; k < sizeof(DirEntry) / sizeof(uint32_t); ++k)
+        __atomic_store_n(&dst[k], src[k], __ATOMIC_RELAXED);
+    dir_touch(dir, idx);
+}
+
+// Hijo de parent cuyo nombre son los len caracteres de name. Una cadena
+// que un escritor está cambiando se corta a max_entries pasos
+static int dir_view_lookup_n(const DirView *v, int parent,
+                             const char *name, size_t len) {
+    if (len == 0 || len >= BWFS_FILENAME_MAXLEN || v->nbuckets == 0) return -1;
+    uint32_t b = dir_hash(parent, name, len) & (v->nbuckets - 1);
+    uint32_t steps = 0;
+    DirEntry e;
+    for (int i = DIR_LD(v->bucket[b]); i >= 0 && (uint32_t)i < v->max_entries &&
+                               steps++ < v->max_entries; i = DIR_LD(v->next[i])) {
+        dir_view_copy(v, i, &e);
+        if ((int)e.parent - 1 == parent &&
+            strncmp(e.name, name, len) == 0 && e.name[len] == '\0')
+            return i;
     }
     return -1;
 }
 
-int dir_remove(Directory *dir, const char *name) {
-    int idx = dir_find(dir, name);
+int dir_view_lookup(const DirView *v, int parent, const char *name) {
+    if (!name) return -1;
+    const char *nul = memchr(name, '\0', BWFS_FILENAME_MAXLEN);
+    return dir_view_lookup_n(v, parent, name,
+                             nul ? (size_t)(nul - name) : BWFS_FILENAME_MAXLEN);
+}
+
+int dir_lookup(const Directory *dir, int parent, const char *name) {
+    DirView v;
+    dir_view(dir, &v);
+    return dir_view_lookup(&v, parent, name);
+}
+
+int dir_parent(const Directory *dir, int idx) {
+    if (idx < 0 || idx >= (int)dir->max_entries) return BWFS_DIR_ROOT;
+    return (int)dir_at(dir, idx)->parent - 1;
+}
+
+int dir_first_child(const Directory *dir, int parent) {
+    if (parent < BWFS_DIR_ROOT || parent >= (int)dir->max_entries) return -1;
+    return DIR_LD(dir->first_child[parent + 1]);
+}
+
+int dir_next_sibling(const Directory *dir, int idx) {
+    if (idx < 0 || idx >= (int)dir->max_entries) return -1;
+    return DIR_LD(dir->next_sib[idx]);
+}
+
+int dir_view_first_child(const DirView *v, int parent) {
+    if (parent < BWFS_DIR_ROOT || parent >= (int)v->max_entries) return -1;
+    int i = DIR_LD(v->first_child[parent + 1]);
+    return (uint32_t)i < v->max_entries ? i : -1;
+}
+
+int dir_view_next_sibling(const DirView *v, int idx) {
+    if (idx < 0 || idx >= (int)v->max_entries) return -1;
+    int i = DIR_LD(v->next_sib[idx]);
+    return (uint32_t)i < v->max_entries ? i : -1;
+}
+
+// Escribe en out (si cabe) la forma canónica de los n primeros caracteres
+// de path y retorna su longitud completa
+static size_t dir_canon(const char *path, size_t n, char *out, size_t cap) {
+    size_t len = 0;
+    for (size_t i = 0; i < n; ) {
+        while (i < n && path[i] == '/') i++;
+        if (i == n) break;
+        if (len > 0) {
+            if (len < cap) out[len] = '/';
+            len++;
+        }
+        while (i < n && path[i] != '/') {
+            if (len < cap) out[len] = path[i];
+            len++, i++;
+        }
+    }
+    if (len < cap) out[len] = '\0';
+    return len;
+}
+
+// Recorre la ruta componente a componente (un sondeo del índice por nivel)
+static int dir_view_walk_n(const DirView *v, const char *path, size_t n) {
+    int cur = BWFS_DIR_ROOT;
+    for (size_t i = 0; i < n; ) {
+        while (i < n && path[i] == '/') i++;
+        if (i == n) break;
+        size_t start = i;
+        while (i < n && path[i] != '/') i++;
+        DirEntry e;
+        if (cur != BWFS_DIR_ROOT && (dir_view_copy(v, cur, &e) < 0 || !e.is_dir))
+            return -1;
+        cur = dir_view_lookup_n(v, cur, path + start, i - start);
+        if (cur < 0) return -1;
+    }
+    return cur;
+}
+
+int dir_view_walk(const DirView *v, const char *path) {
+    return path ? dir_view_walk_n(v, path, strlen(path)) : -1;
+}
+
+static int dir_walk(const Directory *dir, const char *path, size_t n) {
+    DirView v;
+    dir_view(dir, &v);
+    return dir_view_walk_n(&v, path, n);
+}
+
+static int dir_cache_valid(const Directory *dir, const DirCacheSlot *s,
+                           const char *key, size_t len) {
+    if (!s->gen || s->len != len || memcmp(s->path, key, len) != 0) return 0;
+    if (s->idx < 0) return s->gen >= dir->dc_neg_gen;
+    if (s->gen < dir->dc_pos_gen) return 0;
+    // La entrada pudo borrarse o renombrarse y su hueco reutilizarse
+    const DirEntry *e = dir_at(dir, s->idx);
+    const char *leaf  = strrchr(key, '/');
+    leaf = leaf ? leaf + 1 : key;
+    return e->used && (int)e->parent - 1 == s->parent &&
+           strncmp(e->name, leaf, BWFS_FILENAME_MAXLEN) == 0;
+}
+
+// Resuelve los n primeros caracteres de path: *out = índice o BWFS_DIR_ROOT.
+// Con la caché, una ruta ya vista cuesta un solo sondeo.
+static int dir_resolve(Directory *dir, const char *path, size_t n, int *out) {
+    char key[BWFS_DCACHE_PATHMAX];
+    size_t len = dir_canon(path, n, key, sizeof(key));
+    if (len == 0) {
+        *out = BWFS_DIR_ROOT;
+        return 0;
+    }
+    DirCacheSlot *slot = NULL;
+    if (len < sizeof(key)) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i) {
+            h ^= (uint8_t)key[i];
+            h *= 16777619u;
+        }
+        slot = &dir->dcache[h & (BWFS_DCACHE_SLOTS - 1)];
+        if (dir_cache_valid(dir, slot, key, len)) {
+            dir->dc_hits++;
+            *out = slot->idx;
+            return slot->idx < 0 ? -1 : 0;
+        }
+    }
+    dir->dc_misses++;
+    int idx = dir_walk(dir, path, n);
+    if (slot) {
+        slot->gen    = dir->dc_clock;
+        slot->idx    = idx;
+        slot->parent = idx >= 0 ? (int)dir_at(dir, idx)->parent - 1 : BWFS_DIR_ROOT;
+        slot->len    = (uint16_t)len;
+        memcpy(slot->path, key, len + 1);
+    }
+    *out = idx;
+    return idx < 0 ? -1 : 0;
+}
+
+int dir_find(Directory *dir, const char *path) {
+    if (!path) return -1;
+    int idx;
+    if (dir_resolve(dir, path, strlen(path), &idx) < 0) return -1;
+    return idx;  // La raíz (BWFS_DIR_ROOT) también es -1
+}
+
+// Separa path en su directorio padre (resuelto) y el último componente,
+// truncado a BWFS_FILENAME_MAXLEN-1 como siempre se han guardado los nombres
+static int dir_split(Directory *dir, const char *path, int *parent, char *name) {
+    if (!path) return -1;
+    size_t end = strlen(path);
+    while (end > 0 && path[end - 1] == '/') end--;
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') start--;
+    size_t len = end - start;
+    if (len == 0) return -1;
+    if ((len == 1 && path[start] == '.') ||
+        (len == 2 && path[start] == '.' && path[start + 1] == '.'))
+        return -1;
+    if (len > BWFS_FILENAME_MAXLEN - 1) len = BWFS_FILENAME_MAXLEN - 1;
+    memcpy(name, path + start, len);
+    name[len] = '\0';
+
+    if (dir_resolve(dir, path, start, parent) < 0) return -1;
+    if (*parent != BWFS_DIR_ROOT && !dir_at(dir, *parent)->is_dir) return -1;
+    return 0;
+}
+
+// Ocupa la primera entrada libre con path; común a dir_create y dir_mkdir
+static int dir_add(Directory *dir, const char *path, uint8_t is_dir) {
+    int parent;
+    char name[BWFS_FILENAME_MAXLEN] = {0};
+    if (dir_split(dir, path, &parent, name) < 0) return -1;
+    if (dir_lookup(dir, parent, name) >= 0) return -1;
+    int i = dir_first_free(dir);
+    if (i < 0) return -1;
+    DirEntry e = {0};
+    e.generation = (uint16_t)(dir_at(dir, i)->generation + 1);
+    strncpy(e.name, name, BWFS_FILENAME_MAXLEN);
+    e.used    = 1;
+    e.is_dir  = is_dir;
+    e.parent  = (uint32_t)(parent + 1);
+    dir_entry_put(dir, i, &e);
+    dir_set_free(dir, i, 0);
+    dir_index_add(dir, i);
+    dir_link_child(dir, i);
+    dir->nchild[i] = 0;
+    dir->free_entries--;
+    dir->dc_neg_gen = ++dir->dc_clock;
+    return i;
+}
+
+int dir_create(Directory *dir, const char *path) {
+    return dir_add(dir, path, 0);
+}
+
+int dir_mkdir(Directory *dir, const char *path) {
+    return dir_add(dir, path, 1);
+}
+
+// Saca path de los índices de nombres y de hijos; idx, -1 o -2 (con hijos)
+static int dir_detach(Directory *dir, const char *path) {
+    int idx = dir_find(dir, path);
     if (idx < 0) return -1;
-    memset(&dir->entries[idx], 0, sizeof(DirEntry));
+    if (dir_at(dir, idx)->is_dir) {
+        if (dir->nchild[idx] > 0) return -2;
+        dir->dc_pos_gen = ++dir->dc_clock;
+    }
+    dir_index_del(dir, idx);
+    dir_unlink_child(dir, idx);
+    return idx;
+}
+
+// Deja libre la entrada idx (conserva su generación)
+static void dir_free(Directory *dir, int idx) {
+    DirEntry e = {0};
+    e.generation = dir_at(dir, idx)->generation;
+    dir_entry_put(dir, idx, &e);
+    dir_set_free(dir, idx, 1);
+    dir->free_entries++;
+}
+
+int dir_remove(Directory *dir, const char *path) {
+    int idx = dir_detach(dir, path);
+    if (idx < 0) return idx;
+    dir_free(dir, idx);
     return 0;
 }
 
-int dir_rename(Directory *dir, const char *oldname, const char *newname) {
-    if (!oldname || !newname || newname[0] == '\0') return -1;
-    int idx_old = dir_find(dir, oldname);
+int dir_orphan(Directory *dir, const char *path) {
+    int idx = dir_detach(dir, path);
+    if (idx < 0) return idx;
+    DirEntry e = *dir_at(dir, idx);
+    e.parent = (uint32_t)(BWFS_DIR_ORPHAN + 1);
+    dir_entry_put(dir, idx, &e);
+    return idx;
+}
+
+int dir_release(Directory *dir, int idx) {
+    if (idx < 0 || (uint32_t)idx >= dir->max_entries ||
+        !dir_at(dir, idx)->used || !dir_is_orphan(dir, idx))
+        return -1;
+    dir_free(dir, idx);
+    return 0;
+}
+
+int dir_rename(Directory *dir, const char *oldpath, const char *newpath) {
+    int idx_old = dir_find(dir, oldpath);
     if (idx_old < 0) return -1;
-    if (dir_find(dir, newname) >= 0) return -1;
-    DirEntry *e = &dir->entries[idx_old];
-    strncpy(e->name, newname, BWFS_FILENAME_MAXLEN-1);
-    e->name[BWFS_FILENAME_MAXLEN-1] = '\0';
+    int parent;
+    char name[BWFS_FILENAME_MAXLEN] = {0};
+    if (dir_split(dir, newpath, &parent, name) < 0) return -1;
+    if (dir_lookup(dir, parent, name) >= 0) return -1;
+    DirEntry e = *dir_at(dir, idx_old);
+    // Un directorio no puede moverse dentro de sí mismo
+    uint32_t depth = 0;
+    for (int p = parent; p != BWFS_DIR_ROOT; p = dir_parent(dir, p))
+        if (p == idx_old || ++depth > dir->max_entries) return -1;
+
+    dir_index_del(dir, idx_old);
+    dir_unlink_child(dir, idx_old);
+    strncpy(e.name, name, BWFS_FILENAME_MAXLEN);
+    e.parent = (uint32_t)(parent + 1);
+    dir_entry_put(dir, idx_old, &e);
+    dir_link_child(dir, idx_old);
+    dir_index_add(dir, idx_old);
+
+    dir->dc_neg_gen = ++dir->dc_clock;
+    if (e.is_dir) dir->dc_pos_gen = dir->dc_clock;
     return idx_old;
 }
 
+size_t dir_serialized_size(const Directory *dir) {
+    return sizeof(uint32_t) + (size_t)dir->max_entries * sizeof(DirEntry);
+}
+
 void dir_serialize(const Directory *dir, uint8_t *out) {
-    memcpy(out, dir, sizeof(Directory));
+    memcpy(out, &dir->max_entries, sizeof(uint32_t));
+    out += sizeof(uint32_t);
+    for (uint32_t i = 0; i < dir->max_entries; ++i, out += sizeof(DirEntry))
+        memcpy(out, dir_at(dir, i), sizeof(DirEntry));
 }
 
-void dir_deserialize(Directory *dir, const uint8_t *in) {
-    memcpy(dir, in, sizeof(Directory));
-    dir->max_entries = BWFS_MAX_FILES;
+int dir_deserialize(Directory *dir, const uint8_t *in) {
+    uint32_t n;
+    memcpy(&n, in, sizeof(n));
+    in += sizeof(uint32_t);
+    if (dir_init_size(dir, n) < 0) return -1;
+    for (uint32_t i = 0; i < n; ++i, in += sizeof(DirEntry))
+        memcpy(dir_at(dir, i), in, sizeof(DirEntry));
+    dir_rebuild(dir);
+    return 0;
 }
 
-uint32_t dir_checksum(const Directory *dir) {
-    uint32_t sum = 0xCAFEBABE;
-    const uint8_t *bytes = (const uint8_t *)dir;
-    for (size_t i = 0; i < sizeof(Directory); ++i)
-        sum ^= bytes[i] + (uint32_t)i;
+uint32_t dir_checksum(Directory *dir) {
+    for (uint32_t k = 0; k < dir->n_sum; ++k) {
+        uint32_t i = dir->sum_list[k];
+        dir->sum       ^= dir->contrib[i];
+        dir->contrib[i] = dir_entry_sum(dir, i);
+        dir->sum       ^= dir->contrib[i];
+        dir->mark[i]   &= ~DIR_MARK_SUM;
+    }
+    dir->n_sum = 0;
+
+    // Mismo resultado que recorrer la tabla seguida de max_entries byte a byte
+    uint32_t sum = 0xCAFEBABE ^ dir->sum;
+    const uint8_t *bytes = (const uint8_t *)&dir->max_entries;
+    uint32_t base = dir->max_entries * (uint32_t)sizeof(DirEntry);
+    for (uint32_t j = 0; j < sizeof(dir->max_entries); ++j)
+        sum ^= bytes[j] + (base + j);
     return sum;
 }
 
+uint32_t dir_dirty_count(const Directory *dir) {
+    return dir->n_save;
+}
+
+const uint32_t *dir_dirty_list(const Directory *dir) {
+    return dir->save_list;
+}
+
+void dir_clear_dirty(Directory *dir) {
+    for (uint32_t k = 0; k < dir->n_save; ++k)
+        dir->mark[dir->save_list[k]] &= ~DIR_MARK_SAVE;
+    dir->n_save = 0;
+}
+
 const DirEntry *dir_entry(const Directory *dir, int idx) {
     if (idx < 0 || idx >= (int)dir->max_entries) return NULL;
-    return &dir->entries[idx];
+    return dir_at(dir, idx);
 }
 
 DirEntry *dir_entry_mut(Directory *dir, int idx) {
     if (idx < 0 || idx >= (int)dir->max_entries) return NULL;
-    return &dir->entries[idx];
+    dir_touch(dir, idx);
+    return dir_at(dir, idx);
 }
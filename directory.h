@@ -2,50 +2,188 @@
 #define DIRECTORY_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include "superblock.h"  // para BWFS_MAX_FILES, BWFS_FILENAME_MAXLEN, etc.
 
+#define BWFS_INLINE_EXTENTS 15   // Tramos guardados en la propia entrada
+
+#define BWFS_HOLE UINT32_MAX        // start de un tramo sin bloques (se lee a ceros)
+
+// Tramo de bloques globales contiguos (dentro de un mismo segmento), o un
+// hueco de len bloques lógicos si start == BWFS_HOLE
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} Extent;
+
 typedef struct {
-    char     name[BWFS_FILENAME_MAXLEN];
+    char     name[BWFS_FILENAME_MAXLEN];  // Componente (sin '/')
     uint32_t size;
     uint32_t checksum;
-    uint32_t blocks[BWFS_MAX_BLOCKS_PER_FILE];
-    uint32_t block_count;
+    Extent   ext[BWFS_INLINE_EXTENTS];    // Primeros tramos del archivo
+    uint32_t ext_count;         // Tramos totales; los que no caben van en ext_block
+    uint32_t ext_block;         // Primer bloque global de la lista de tramos extra
+    uint32_t block_count;       // Bloques de datos reservados (sin contar huecos)
     uint8_t  used;
     uint8_t  is_dir;            // 0 = archivo, 1 = directorio
+    uint16_t generation;        // Cambia cada vez que se reutiliza la entrada
+    uint32_t parent;            // Entrada padre + 1 (0 = raíz)
 } DirEntry;
 
+_Static_assert(sizeof(DirEntry) == 180, "DirEntry cambió de tamaño en la imagen");
+
+#define BWFS_DIR_ROOT        (-1)   // Índice de padre de la raíz (no tiene entrada)
+#define BWFS_DIR_ORPHAN      (-2)   // Padre de una entrada huérfana (ver dir_orphan)
+#define BWFS_DIR_PAGE_SHIFT  8      // Entradas por página en memoria: 256
+#define BWFS_DIR_PAGE        (1u << BWFS_DIR_PAGE_SHIFT)
+#define BWFS_DCACHE_SLOTS    512    // Caché de rutas (potencia de 2)
+#define BWFS_DCACHE_PATHMAX  128    // Las rutas más largas se resuelven sin caché
+
+// Ruta canónica (sin '/' inicial, final ni repetidos) -> entrada. Una
+// búsqueda negativa se guarda con idx = -1.
 typedef struct {
-    DirEntry entries[BWFS_MAX_FILES];
-    uint32_t max_entries;       // siempre igual a BWFS_MAX_FILES
+    uint64_t gen;               // Reloj al insertar (0 = vacía)
+    int32_t  idx;
+    int32_t  parent;            // Padre de idx al insertar (para validar)
+    uint16_t len;
+    char     path[BWFS_DCACHE_PATHMAX];
+} DirCacheSlot;
+
+typedef struct {
+    DirEntry **pages;           // Páginas de BWFS_DIR_PAGE entradas (direcciones estables)
+    uint32_t   max_entries;     // Capacidad actual (crece con dir_grow)
+
+    // Índices en memoria (ver dir_rebuild)
+    uint32_t   free_entries;    // Entradas libres
+    uint32_t   free_hint;       // Ninguna palabra anterior de free_map tiene libres
+    uint64_t  *free_map;        // Bit i: entrada i libre
+    uint32_t   nbuckets;        // Potencia de 2, al menos 2 × max_entries
+    _Atomic int32_t *bucket;    // Primera entrada de cada cubeta (-1 vacía)
+    _Atomic int32_t *next;      // Siguiente entrada de la misma cubeta
+    uint32_t  *nchild;          // Hijos de cada directorio
+    _Atomic int32_t *first_child; // Por padre + 1 (la raíz en la posición 0)
+    _Atomic int32_t *next_sib;
+    int32_t   *prev_sib;
+
+    // Checksum incremental y entradas modificadas desde el último guardado
+    uint32_t  *contrib;         // Aporte de cada entrada al checksum
+    uint32_t   sum;             // XOR de contrib[]
+    uint8_t   *mark;            // DIR_MARK_* por entrada
+    uint32_t  *sum_list,  n_sum;
+    uint32_t  *save_list, n_save;
+
+    // Caché de rutas. Las positivas caducan si se borra o mueve un
+    // directorio (dc_pos_gen); las negativas, si aparece un nombre (dc_neg_gen)
+    DirCacheSlot  dcache[BWFS_DCACHE_SLOTS];
+    uint64_t      dc_clock, dc_pos_gen, dc_neg_gen;
+    unsigned long dc_hits, dc_misses;
+
+    // Vista publicada para los lectores sin cerrojo (ver dir_view)
+    _Atomic(struct DirView *) view;
+
+    // Arreglos de índices y vistas sustituidos por dir_grow: se liberan en
+    // dir_destroy
+    void        **retired;
+    uint32_t      n_retired, retired_cap;
 } Directory;
 
-// Inicializa la tabla (pone todo a 0)
-void    dir_init(Directory *dir);
+// Punteros y tamaños que usan las consultas de sólo lectura. dir_grow
+// publica una vista nueva (inmutable) con un almacenamiento de liberación y
+// no libera lo que reemplaza, así que una vista tomada antes de crecer sigue
+// siendo legible (con datos quizá antiguos): sirve a lectores sin cerrojo
+// que validan después con un contador de secuencia. Los índices y las
+// entradas se leen con cargas atómicas relajadas (los escritores usan
+// almacenamientos atómicos), y todo índice leído se comprueba contra
+// max_entries.
+typedef struct DirView {
+    DirEntry *const       *pages;
+    uint32_t               max_entries;
+    uint32_t               nbuckets;
+    const _Atomic int32_t *bucket, *next;
+    const _Atomic int32_t *first_child, *next_sib;
+} DirView;
+
+// Inicializa una tabla vacía de BWFS_MAX_FILES (o max_entries) entradas;
+// 0 o -1 sin memoria
+int     dir_init(Directory *dir);
+int     dir_init_size(Directory *dir, uint32_t max_entries);
+void    dir_destroy(Directory *dir);
+
+// Amplía la tabla a max_entries entradas libres al final; 0 o -1
+int     dir_grow(Directory *dir, uint32_t max_entries);
+
+// Reconstruye índices, contadores, checksum y caché tras cargar las
+// entradas directamente (olvida las marcas de modificación)
+void    dir_rebuild(Directory *dir);
+
+// Vista del estado actual y consultas sobre ella (sin caché de rutas):
+// entrada idx (NULL fuera de rango), resolución de ruta (-1 si no existe) y
+// recorrido de hijos como dir_first_child / dir_next_sibling
+void            dir_view(const Directory *dir, DirView *v);
+const DirEntry *dir_view_entry(const DirView *v, int idx);
+// Copia la entrada idx de la vista con cargas atómicas (puede verse a medio
+// escribir: el llamador valida con su contador de secuencia); -1 fuera de rango
+int             dir_view_copy(const DirView *v, int idx, DirEntry *out);
+int             dir_view_walk(const DirView *v, const char *path);
+int             dir_view_lookup(const DirView *v, int parent, const char *name);
+int             dir_view_first_child(const DirView *v, int parent);
+int             dir_view_next_sibling(const DirView *v, int idx);
 
-// Busca por nombre (archivo o dir), retorna índice o -1
-int     dir_find(const Directory *dir, const char *name);
+// Busca el hijo name de parent (BWFS_DIR_ROOT = raíz), retorna índice o -1
+int     dir_lookup(const Directory *dir, int parent, const char *name);
 
-// Crea un archivo, retorna índice o -1
-int     dir_create(Directory *dir, const char *name);
+// Resuelve una ruta ("a/b/c", con o sin '/' inicial) usando la caché,
+// retorna índice o -1. La raíz no tiene entrada: "/" da -1.
+int     dir_find(Directory *dir, const char *path);
 
-// Crea un directorio de un nivel (usa is_dir=1), retorna índice o -1
-int     dir_mkdir(Directory *dir, const char *name);
+// Padre de una entrada (BWFS_DIR_ROOT si cuelga de la raíz)
+int     dir_parent(const Directory *dir, int idx);
 
-// Elimina archivo o directorio por nombre (no revisa si dir está vacío), retorna 0 o -1
-int     dir_remove(Directory *dir, const char *name);
+// Recorrido de los hijos de parent: primero y siguiente hermano, -1 al final
+int     dir_first_child(const Directory *dir, int parent);
+int     dir_next_sibling(const Directory *dir, int idx);
 
-// Renombra archivo o directorio, retorna índice o -1
-int     dir_rename(Directory *dir, const char *oldname, const char *newname);
+// Crea un archivo en la primera entrada libre; el padre debe existir y ser
+// directorio. Retorna índice o -1 (también si la tabla está llena)
+int     dir_create(Directory *dir, const char *path);
 
-// Serializa/Deserializa la tabla entera a un buffer de bytes
+// Crea un directorio (usa is_dir=1), retorna índice o -1
+int     dir_mkdir(Directory *dir, const char *path);
+
+// Elimina archivo o directorio; retorna 0, -1 si no existe o -2 si es un
+// directorio con hijos
+int     dir_remove(Directory *dir, const char *path);
+
+// Como dir_remove, pero la entrada sigue en uso, sin nombre (padre
+// BWFS_DIR_ORPHAN) y sin reutilizarse hasta dir_release: para archivos que
+// aún tienen referencias. Retorna el índice, -1 o -2 como dir_remove
+int     dir_orphan(Directory *dir, const char *path);
+// Libera una entrada huérfana; 0 o -1 si idx no lo es
+int     dir_release(Directory *dir, int idx);
+
+// Renombra o mueve archivo o directorio (no dentro de sí mismo), retorna índice o -1
+int     dir_rename(Directory *dir, const char *oldpath, const char *newpath);
+
+// Serializa/Deserializa la tabla: max_entries (uint32) seguido de las entradas
+size_t  dir_serialized_size(const Directory *dir);
 void    dir_serialize(const Directory *dir, uint8_t *out);
-void    dir_deserialize(Directory *dir, const uint8_t *in);
+int     dir_deserialize(Directory *dir, const uint8_t *in);
+
+// Checksum XOR de las entradas y max_entries; sólo recalcula las entradas
+// modificadas desde la llamada anterior
+uint32_t dir_checksum(Directory *dir);
 
-// Calcula checksum XOR de todos los bytes de la tabla
-uint32_t dir_checksum(const Directory *dir);
+// Entradas modificadas desde el último dir_clear_dirty (para guardarlas)
+uint32_t        dir_dirty_count(const Directory *dir);
+const uint32_t *dir_dirty_list(const Directory *dir);
+void            dir_clear_dirty(Directory *dir);
 
-// Acceso directo a las entradas
+// Acceso directo a las entradas; dir_entry_mut marca la entrada como
+// modificada y sólo sirve sin lectores sin cerrojo (carga, pruebas): con
+// ellos se escribe la entrada entera con dir_entry_put
 const DirEntry *dir_entry(const Directory *dir, int idx);
 DirEntry       *dir_entry_mut(Directory *dir, int idx);
+void            dir_entry_put(Directory *dir, int idx, const DirEntry *e);
 
 #endif // DIRECTORY_H
@@ -0,0 +1,105 @@
+#include "file_map.h"
+#include <stdlib.h>
+#include <string.h>
+
+void fm_init(FileMap *fm) {
+    memset(fm, 0, sizeof(*fm));
+}
+
+void fm_destroy(FileMap *fm) {
+    if (!fm) return;
+    free(fm->ext);
+    free(fm->end);
+    fm_init(fm);
+}
+
+// Asegura sitio para want tramos
+static int fm_reserve(FileMap *fm, uint32_t want) {
+    if (want > fm->cap) {
+        uint32_t cap = fm->cap ? fm->cap : 8;
+        while (cap < want) cap *= 2;
+        Extent   *ext = realloc(fm->ext, sizeof(Extent) * cap);
+        if (!ext) return -1;
+        fm->ext = ext;
+        uint64_t *end = realloc(fm->end, sizeof(uint64_t) * cap);
+        if (!end) return -1;
+        fm->end = end;
+        fm->cap = cap;
+    }
+    return 0;
+}
+
+int fm_push(FileMap *fm, uint32_t start, uint32_t len) {
+    if (start == BWFS_HOLE && fm->count > 0 &&
+        fm->ext[fm->count - 1].start == BWFS_HOLE) {
+        fm_extend_last(fm, len);
+        return 0;
+    }
+    if (fm_reserve(fm, fm->count + 1) < 0) return -1;
+    if (start == BWFS_HOLE) fm->holes += len;
+    fm->ext[fm->count] = (Extent){ start, len };
+    fm->end[fm->count] = fm_blocks(fm) + len;
+    fm->count++;
+    return 0;
+}
+
+int fm_splice(FileMap *fm, uint32_t i, uint32_t n, const Extent *with, uint32_t m) {
+    if (i + n > fm->count) return -1;
+    if (m > n && fm_reserve(fm, fm->count - n + m) < 0) return -1;
+    for (uint32_t k = i; k < i + n; ++k)
+        if (fm->ext[k].start == BWFS_HOLE) fm->holes -= fm->ext[k].len;
+    memmove(fm->ext + i + m, fm->ext + i + n, sizeof(Extent) * (fm->count - i - n));
+    memcpy(fm->ext + i, with, sizeof(Extent) * m);
+    fm->count = fm->count - n + m;
+    // Finales acumulados desde i
+    uint64_t end = i ? fm->end[i - 1] : 0;
+    for (uint32_t k = i; k < fm->count; ++k) {
+        end += fm->ext[k].len;
+        fm->end[k] = end;
+        if (k < i + m && fm->ext[k].start == BWFS_HOLE) fm->holes += fm->ext[k].len;
+    }
+    return 0;
+}
+
+void fm_extend_last(FileMap *fm, uint32_t n) {
+    if (fm->count == 0) return;
+    if (fm->ext[fm->count - 1].start == BWFS_HOLE) fm->holes += n;
+    fm->ext[fm->count - 1].len += n;
+    fm->end[fm->count - 1]     += n;
+}
+
+void fm_trim(FileMap *fm, uint64_t blocks) {
+    while (fm->count > 0 && fm->end[fm->count - 1] - fm->ext[fm->count - 1].len >= blocks) {
+        fm->count--;
+        if (fm->ext[fm->count].start == BWFS_HOLE) fm->holes -= fm->ext[fm->count].len;
+    }
+    if (fm->count > 0 && fm->end[fm->count - 1] > blocks) {
+        uint32_t cut = (uint32_t)(fm->end[fm->count - 1] - blocks);
+        if (fm->ext[fm->count - 1].start == BWFS_HOLE) fm->holes -= cut;
+        fm->ext[fm->count - 1].len -= cut;
+        fm->end[fm->count - 1]     -= cut;
+    }
+}
+
+uint64_t fm_blocks(const FileMap *fm) {
+    return fm->count ? fm->end[fm->count - 1] : 0;
+}
+
+uint64_t fm_allocated(const FileMap *fm) {
+    return fm_blocks(fm) - fm->holes;
+}
+
+int64_t fm_lookup(const FileMap *fm, uint64_t lblk, uint32_t *run) {
+    if (lblk >= fm_blocks(fm)) return -1;
+    // Primer tramo cuyo final supera lblk
+    uint32_t lo = 0, hi = fm->count - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (fm->end[mid] > lblk) hi = mid;
+        else lo = mid + 1;
+    }
+    uint64_t off = lblk - (fm->end[lo] - fm->ext[lo].len);
+    if (run) *run = (uint32_t)(fm->ext[lo].len - off);
+    if (fm->ext[lo].start == BWFS_HOLE) return FM_HOLE;
+    return (int64_t)fm->ext[lo].start + (int64_t)off;
+}
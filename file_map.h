@@ -0,0 +1,46 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stdint.h>
+#include "directory.h"
+
+// Lista de tramos de un archivo en memoria, con el final lógico acumulado de
+// cada tramo para traducir bloque lógico -> bloque global en O(log n)
+
+typedef struct {
+    uint32_t  count;
+    uint32_t  cap;
+    Extent   *ext;
+    uint64_t *end;      // end[i] = bloques lógicos hasta el tramo i inclusive
+    uint64_t  holes;    // Bloques lógicos en huecos (sin bloque reservado)
+} FileMap;
+
+#define FM_HOLE (-2)    // fm_lookup: el bloque lógico cae en un hueco
+
+void fm_init(FileMap *fm);
+void fm_destroy(FileMap *fm);
+
+// Añade un tramo al final (un hueco tras otro hueco lo alarga); 0 o -1 sin
+// memoria
+int  fm_push(FileMap *fm, uint32_t start, uint32_t len);
+
+// Sustituye los tramos [i, i+n) por los m de with; 0 o -1 sin memoria
+int  fm_splice(FileMap *fm, uint32_t i, uint32_t n, const Extent *with, uint32_t m);
+
+// Alarga el último tramo en n bloques (el llamador garantiza que siguen
+// siendo contiguos y del mismo segmento)
+void fm_extend_last(FileMap *fm, uint32_t n);
+
+// Recorta la lista a sus primeros blocks bloques lógicos
+void fm_trim(FileMap *fm, uint64_t blocks);
+
+// Bloques lógicos totales y, de ellos, los que tienen bloque reservado
+uint64_t fm_blocks(const FileMap *fm);
+uint64_t fm_allocated(const FileMap *fm);
+
+// Bloque global del bloque lógico lblk y, en *run, cuántos bloques contiguos
+// quedan desde él en su tramo; FM_HOLE si cae en un hueco y -1 si lblk está
+// fuera del archivo
+int64_t fm_lookup(const FileMap *fm, uint64_t lblk, uint32_t *run);
+
+#endif
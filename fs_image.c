@@ -8,10 +8,617 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
 
 
+static size_t seg_bytes(const PBMImage *img) {
+    return img->stride_bytes * img->height;
+}
+
+static void seg_path(const char *folder, int idx, char *path, size_t len) {
+    snprintf(path, len, "%s/image_%d.pbm", folder, idx);
+}
+
+static void seg_stage_path(const char *folder, int idx, char *path, size_t len) {
+    snprintf(path, len, "%s/image_%d.pbm" BWFS_STAGE_SUFFIX, folder, idx);
+}
+
+// Archivo que hoy contiene el segmento: la versión preparada si la hay
+static void seg_current_path(const FSImage *fs, int idx, char *path, size_t len) {
+    if (fs->seg_staged[idx]) seg_stage_path(fs->folder, idx, path, len);
+    else                     seg_path(fs->folder, idx, path, len);
+}
+
+static int fsync_dir(const char *folder) {
+    int fd = open(folder, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// Copia src a dst pasando por dst.tmp + fsync + rename
+static int copy_file_atomic(const char *src, const char *dst) {
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) { close(in); return -1; }
+
+    uint8_t buf[65536];
+    ssize_t n;
+    int rc = 0;
+    while (rc == 0 && (n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) { rc = -1; break; }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0) { rc = -1; break; }
+            off += w;
+        }
+    }
+    close(in);
+    if (rc == 0 && fsync(out) < 0) rc = -1;
+    if (close(out) < 0) rc = -1;
+    if (rc == 0 && rename(tmp, dst) < 0) rc = -1;
+    if (rc < 0) unlink(tmp);
+    return rc;
+}
+
+// ---- Escritura paralela de segmentos ----
+
+typedef struct {
+    int             idx;       // Segmento
+    const PBMImage *img;       // Contenido en memoria, o NULL para copiar src
+    char            src[1024];
+    char            dst[1024]; // image_N.pbm.new en la carpeta destino
+    int             rc;
+} SegTask;
+
+typedef struct {
+    SegTask        *tasks;
+    int             count;
+    int             next;
+    pthread_mutex_t lock;
+} SegPool;
+
+static void *seg_worker(void *arg) {
+    SegPool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count) break;
+
+        SegTask *t = &pool->tasks[i];
+        t->rc = t->img ? pbm_save_atomic(t->img, t->dst)
+                       : copy_file_atomic(t->src, t->dst);
+    }
+    return NULL;
+}
+
+// Ejecuta una tarea por segmento repartidas entre hasta BWFS_SAVE_THREADS
+// hilos (el llamador incluido). Retorna -1 si alguna falló.
+static int seg_run_tasks(SegTask *tasks, int count) {
+    SegPool pool = { tasks, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = count < BWFS_SAVE_THREADS ? count : BWFS_SAVE_THREADS;
+    if (cpus > 0 && nthreads > cpus) nthreads = (int)cpus;
+
+    pthread_t th[BWFS_SAVE_THREADS];
+    int started = 0;
+    while (started < nthreads - 1 &&
+           pthread_create(&th[started], NULL, seg_worker, &pool) == 0)
+        started++;
+    seg_worker(&pool);
+    for (int i = 0; i < started; ++i) pthread_join(th[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+
+    for (int i = 0; i < count; ++i) {
+        if (tasks[i].rc < 0) {
+            fprintf(stderr, "Error guardando %s\n", tasks[i].dst);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ---- Confirmación atómica ----
+
+// Renombra los segmentos preparados sobre los definitivos. image_0, que
+// lleva superbloque y directorio, se renombra al final. Retorna -1 si algún
+// renombrado falla (el marcador debe quedarse para reintentarlo).
+static int fs_promote(const char *folder, const int *segs, int count) {
+    char stage[1100], path[1024];
+    int has_zero = 0;
+    for (int k = 0; k < count; ++k) {
+        if (segs[k] == 0) { has_zero = 1; continue; }
+        seg_stage_path(folder, segs[k], stage, sizeof(stage));
+        seg_path(folder, segs[k], path, sizeof(path));
+        // Puede faltar si ya se promovió antes de una caída
+        if (rename(stage, path) < 0 && errno != ENOENT) return -1;
+    }
+    if (has_zero) {
+        seg_stage_path(folder, 0, stage, sizeof(stage));
+        seg_path(folder, 0, path, sizeof(path));
+        if (rename(stage, path) < 0 && errno != ENOENT) return -1;
+    }
+    return 0;
+}
+
+// Confirma los segmentos preparados: una vez que commit.pending existe la
+// confirmación es definitiva (fs_load la completa tras una caída); antes de
+// eso, lo preparado se descarta y queda la versión anterior completa.
+static int fs_commit(const char *folder, const int *segs, int count) {
+    char marker[1024], tmp[1100];
+    snprintf(marker, sizeof(marker), "%s/" BWFS_COMMIT_MARKER, folder);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", marker);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    for (int k = 0; k < count; ++k) fprintf(f, "%d\n", segs[k]);
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    if (fclose(f) != 0 || rename(tmp, marker) < 0 || fsync_dir(folder) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    if (fs_promote(folder, segs, count) < 0 || fsync_dir(folder) < 0) return -1;
+    unlink(marker);
+    return fsync_dir(folder);
+}
+
+// Completa una confirmación interrumpida y descarta lo preparado sin
+// confirmar. Retorna -1 si no pudo completarla: lo preparado y el marcador
+// se conservan y la carpeta no debe cargarse a medias.
+static int fs_recover(const char *folder) {
+    char marker[1024];
+    snprintf(marker, sizeof(marker), "%s/" BWFS_COMMIT_MARKER, folder);
+    FILE *f = fopen(marker, "r");
+    if (f) {
+        // El marcador lista tantos segmentos como tenga la carpeta
+        int *segs = NULL, count = 0, cap = 0, idx, rc = 0;
+        while (rc == 0 && fscanf(f, "%d", &idx) == 1) {
+            if (count == cap) {
+                int  c = cap ? 2 * cap : 64;
+                int *p = realloc(segs, (size_t)c * sizeof(*segs));
+                if (!p) { rc = -1; break; }
+                segs = p, cap = c;
+            }
+            segs[count++] = idx;
+        }
+        fclose(f);
+        if (rc == 0) rc = fs_promote(folder, segs, count);
+        free(segs);
+        if (rc < 0 || fsync_dir(folder) < 0) {
+            fprintf(stderr, "Error completando la confirmación en %s\n", folder);
+            return -1;
+        }
+        unlink(marker);
+        fsync_dir(folder);
+    }
+
+    DIR *d = opendir(folder);
+    if (!d) return 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        size_t len = strlen(name);
+        size_t sl  = strlen(BWFS_STAGE_SUFFIX);
+        int ours   = strncmp(name, "image_", 6) == 0 ||
+                     strncmp(name, BWFS_COMMIT_MARKER, strlen(BWFS_COMMIT_MARKER)) == 0;
+        int staged = len > sl && strcmp(name + len - sl, BWFS_STAGE_SUFFIX) == 0;
+        int tmp    = len > 4 && strcmp(name + len - 4, ".tmp") == 0;
+        if (ours && (staged || tmp)) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", folder, name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+static void fs_locks_init(FSImage *fs) {
+    pthread_rwlock_init(&fs->ns_lock, NULL);
+    pthread_mutex_init(&fs->meta_lock, NULL);
+    pthread_mutex_init(&fs->bc_lock, NULL);
+    pthread_mutex_init(&fs->seg_cache_lock, NULL);
+    for (int i = 0; i < BWFS_LOCK_STRIPES; ++i) {
+        pthread_rwlock_init(&fs->file_locks[i], NULL);
+        pthread_mutex_init(&fs->seg_locks[i], NULL);
+    }
+}
+
+static void fs_locks_destroy(FSImage *fs) {
+    pthread_rwlock_destroy(&fs->ns_lock);
+    pthread_mutex_destroy(&fs->meta_lock);
+    pthread_mutex_destroy(&fs->bc_lock);
+    pthread_mutex_destroy(&fs->seg_cache_lock);
+    for (int i = 0; i < BWFS_LOCK_STRIPES; ++i) {
+        pthread_rwlock_destroy(&fs->file_locks[i]);
+        pthread_mutex_destroy(&fs->seg_locks[i]);
+    }
+}
+
+static pthread_rwlock_t *fs_file_lock(FSImage *fs, int idx) {
+    return &fs->file_locks[(uint32_t)idx % BWFS_LOCK_STRIPES];
+}
+
+static pthread_mutex_t *fs_seg_lock(FSImage *fs, int seg) {
+    return &fs->seg_locks[(uint32_t)seg % BWFS_LOCK_STRIPES];
+}
+
+// dir_find actualiza la caché de rutas: con ns_lock, bajo meta_lock
+static int fs_find(FSImage *fs, const char *path) {
+    pthread_mutex_lock(&fs->meta_lock);
+    int idx = dir_find(&fs->dir, path);
+    pthread_mutex_unlock(&fs->meta_lock);
+    return idx;
+}
+
+// Contadores de secuencia. Cada uno tiene un solo escritor a la vez (lo
+// garantiza el cerrojo que este ya sostiene)
+#define FS_SEQ_TRIES 64     // Lecturas sin cerrojo antes de recurrir a ellos
+
+static atomic_uint *fs_entry_seq(FSImage *fs, int idx) {
+    return &fs->entry_seq[(uint32_t)idx % BWFS_LOCK_STRIPES];
+}
+
+static void fs_seq_begin(atomic_uint *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void fs_seq_end(atomic_uint *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+static unsigned fs_seq_read(atomic_uint *seq) {
+    return atomic_load_explicit(seq, memory_order_acquire);
+}
+
+// Distinto de 0 si hay que repetir lo leído desde fs_seq_read (start)
+static int fs_seq_retry(atomic_uint *seq, unsigned start) {
+    atomic_thread_fence(memory_order_acquire);
+    return (start & 1) || atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+// ns_lock en escritura; mientras se tiene, ns_seq es impar
+static void fs_ns_write_lock(FSImage *fs) {
+    pthread_rwlock_wrlock(&fs->ns_lock);
+    fs_seq_begin(&fs->ns_seq);
+}
+
+static void fs_ns_write_unlock(FSImage *fs) {
+    fs_seq_end(&fs->ns_seq);
+    pthread_rwlock_unlock(&fs->ns_lock);
+}
+
+// Agrega un segmento al final (img puede ser NULL: existe en disco sin cargar)
+static int fs_append_segment(FSImage *fs, PBMImage *img) {
+    pthread_mutex_lock(&fs->seg_cache_lock);
+    int rc = -1;
+    PBMImage **imgs = realloc(fs->images,
+                              sizeof(*fs->images) * (fs->image_count + 1));
+    if (!imgs) goto out;
+    fs->images = imgs;
+    uint64_t *stamps = realloc(fs->seg_stamp,
+                               sizeof(*fs->seg_stamp) * (fs->image_count + 1));
+    if (!stamps) goto out;
+    fs->seg_stamp = stamps;
+    uint8_t *staged = realloc(fs->seg_staged,
+                              sizeof(*fs->seg_staged) * (fs->image_count + 1));
+    if (!staged) goto out;
+    fs->seg_staged = staged;
+    uint32_t *refs = realloc(fs->seg_refs,
+                             sizeof(*fs->seg_refs) * (fs->image_count + 1));
+    if (!refs) goto out;
+    fs->seg_refs = refs;
+    PBMImage **flushing = realloc(fs->seg_flushing,
+                                  sizeof(*fs->seg_flushing) * (fs->image_count + 1));
+    if (!flushing) goto out;
+    fs->seg_flushing = flushing;
+    BlockManager *bms = realloc(fs->bms, sizeof(*fs->bms) * (fs->image_count + 1));
+    if (!bms) goto out;
+    fs->bms = bms;
+
+    memset(&fs->bms[fs->image_count], 0, sizeof(*fs->bms));
+    fs->images[fs->image_count]     = img;
+    fs->seg_stamp[fs->image_count]  = ++fs->seg_clock;
+    fs->seg_staged[fs->image_count] = 0;
+    fs->seg_refs[fs->image_count]   = 0;
+    fs->seg_flushing[fs->image_count] = NULL;
+    fs->image_count++;
+    if (img) fs->cache_bytes += seg_bytes(img);
+    rc = 0;
+out:
+    pthread_mutex_unlock(&fs->seg_cache_lock);
+    return rc;
+}
+
+// image_0 (superbloque y directorio) y la última (donde crece el sistema) no
+// se expulsan, ni los que tiene referenciados una lectura sin copia
+static int fs_segment_pinned(const FSImage *fs, int idx) {
+    return idx == 0 || idx == fs->image_count - 1 || fs->seg_refs[idx] > 0;
+}
+
+// Saca un segmento de memoria. Si tiene cambios se escribe como
+// image_N.pbm.new (no sustituye al definitivo hasta el próximo fs_save) sin
+// seg_cache_lock: mientras, queda en seg_flushing y fs_segment reutiliza esa
+// copia en vez de leer una vieja del disco. Con seg_cache_lock y el cerrojo
+// del segmento (que impide escribir en él); vuelve con los dos.
+static int fs_segment_release(FSImage *fs, int idx) {
+    PBMImage *img = fs->images[idx];
+    fs->cache_bytes -= seg_bytes(img);
+    fs->images[idx]  = NULL;
+    fs->bms[idx].img = NULL;
+    fs->seg_evictions++;
+    if (pbm_is_dirty(img)) {
+        char path[1024];
+        seg_stage_path(fs->folder, idx, path, sizeof(path));
+        fs->seg_flushing[idx] = img;
+        pthread_mutex_unlock(&fs->seg_cache_lock);
+        int rc = pbm_save_atomic(img, path);
+        pthread_mutex_lock(&fs->seg_cache_lock);
+        fs->seg_flushing[idx] = NULL;
+        if (rc == 0) {
+            pbm_clear_dirty(img);
+            fs->seg_staged[idx] = 1;
+            fs->seg_writebacks++;
+        }
+        if (fs->images[idx] == img) return rc;  // Otro hilo volvió a usarlo
+        if (rc < 0) {
+            // Sigue residente: sus cambios sólo están en memoria
+            fs->images[idx]   = img;
+            fs->cache_bytes  += seg_bytes(img);
+            fs->seg_evictions--;
+            return -1;
+        }
+    }
+    pbm_free(img);
+    return 0;
+}
+
+// Expulsa segmentos (el menos usado primero) hasta respetar el presupuesto.
+// Con seg_cache_lock, que se suelta mientras se escribe un segmento sucio;
+// se salta los segmentos cuyo cerrojo tiene otro hilo (o este mismo, si
+// comparten cerrojo con keep).
+static void fs_segment_evict(FSImage *fs, int keep) {
+    while (fs->cache_budget && fs->cache_bytes > fs->cache_budget) {
+        int victim = -1;
+        for (int i = 0; i < fs->image_count; ++i) {
+            if (!fs->images[i] || i == keep || fs_segment_pinned(fs, i)) continue;
+            // Sin carpeta no hay dónde escribir un segmento sucio
+            if (!fs->folder && pbm_is_dirty(fs->images[i])) continue;
+            if (pthread_mutex_trylock(fs_seg_lock(fs, i)) != 0) continue;
+            pthread_mutex_unlock(fs_seg_lock(fs, i));
+            if (victim < 0 || fs->seg_stamp[i] < fs->seg_stamp[victim])
+                victim = i;
+        }
+        if (victim < 0) break;
+        if (pthread_mutex_trylock(fs_seg_lock(fs, victim)) != 0) continue;
+        int rc = fs_segment_release(fs, victim);
+        pthread_mutex_unlock(fs_seg_lock(fs, victim));
+        if (rc < 0) break;
+    }
+}
+
+PBMImage *fs_segment(FSImage *fs, int idx) {
+    if (!fs) return NULL;
+    pthread_mutex_lock(&fs->seg_cache_lock);
+    PBMImage *img = NULL;
+    if (idx < 0 || idx >= fs->image_count) goto out;
+    img = fs->images[idx];
+    if (!img && fs->seg_flushing[idx]) {
+        // Expulsado y escribiéndose: esa copia es la vigente
+        img = fs->images[idx] = fs->seg_flushing[idx];
+        fs->cache_bytes += seg_bytes(img);
+    } else if (!img) {
+        if (!fs->folder) goto out;
+        char path[1024];
+        seg_current_path(fs, idx, path, sizeof(path));
+        img = pbm_load(path);
+        if (!img) goto out;
+        fs->images[idx] = img;
+        fs->cache_bytes += seg_bytes(img);
+        fs->seg_loads++;
+    }
+    fs->seg_stamp[idx] = ++fs->seg_clock;
+    fs_segment_evict(fs, idx);
+out:
+    pthread_mutex_unlock(&fs->seg_cache_lock);
+    return img;
+}
+
+BlockManager *fs_bm(FSImage *fs, int idx) {
+    PBMImage *img = fs_segment(fs, idx);
+    if (!img) return NULL;
+    BlockManager *bm = &fs->bms[idx];
+    if (bm->block_count == 0) {
+        bm_init(bm, img, fs->sb.bitmap_offset, fs->sb.block_count);
+        fs->free_blocks += bm->free_count;
+    } else
+        bm->img = img;  // El segmento pudo recargarse en otra dirección
+    return bm;
+}
+
+void fs_set_cache_budget(FSImage *fs, size_t bytes) {
+    pthread_mutex_lock(&fs->seg_cache_lock);
+    fs->cache_budget = bytes;
+    fs_segment_evict(fs, -1);
+    pthread_mutex_unlock(&fs->seg_cache_lock);
+}
+
+void fs_segment_stats(const FSImage *fs, FSSegmentStats *st) {
+    memset(st, 0, sizeof(*st));
+    st->segments       = fs->image_count;
+    for (int i = 0; i < fs->image_count; ++i)
+        if (fs->images[i]) st->resident++;
+    st->resident_bytes = fs->cache_bytes;
+    st->budget_bytes   = fs->cache_budget;
+    st->loads          = fs->seg_loads;
+    st->evictions      = fs->seg_evictions;
+    st->writebacks     = fs->seg_writebacks;
+}
+
+// Camino rápido: con regiones y bloques alineados a 64 bits y filas sin
+// relleno, cada bloque empieza en un byte del buffer y se copia con memcpy
+static void fs_update_layout(FSImage *fs) {
+    fs->aligned = (fs->sb.features & BWFS_FEAT_ALIGN64) &&
+                  fs->sb.width % 8 == 0 &&
+                  fs->sb.block_size % 8 == 0;
+}
+
+// Lee/escribe nbytes de un bloque que empieza en el bit bit_idx de img
+static int fs_block_read(const FSImage *fs, const PBMImage *img,
+                         size_t bit_idx, void *buf, size_t nbytes) {
+    if (fs->aligned && bit_idx % 8 == 0) {
+        if (bit_idx / 8 + nbytes > img->stride_bytes * img->height) return -1;
+        memcpy(buf, img->bits + bit_idx / 8, nbytes);
+        return 0;
+    }
+    return pbm_read_bits(img, bit_idx, buf, nbytes * 8);
+}
+
+static int fs_block_write(const FSImage *fs, PBMImage *img,
+                          size_t bit_idx, const void *buf, size_t nbytes) {
+    if (fs->aligned && bit_idx % 8 == 0) {
+        if (bit_idx / 8 + nbytes > img->stride_bytes * img->height) return -1;
+        memcpy(img->bits + bit_idx / 8, buf, nbytes);
+        pbm_mark_dirty(img, bit_idx / 8, nbytes);
+        return 0;
+    }
+    return pbm_write_bits(img, bit_idx, buf, nbytes * 8);
+}
+
+// E/S de la caché de bloques: el bloque global entero, decodificado
+static int fs_cache_io(void *ctx, uint32_t g, uint8_t *buf, int write) {
+    FSImage *fs = ctx;
+    int seg = (int)(g / fs->sb.block_count), rc = -1;
+    pthread_mutex_lock(fs_seg_lock(fs, seg));
+    PBMImage *img = fs_segment(fs, seg);
+    if (img) {
+        size_t bit = fs->sb.data_offset + (size_t)(g % fs->sb.block_count) * fs->sb.block_size;
+        rc = write ? fs_block_write(fs, img, bit, buf, fs->sb.block_size / 8)
+                   : fs_block_read(fs, img, bit, buf, fs->sb.block_size / 8);
+    }
+    pthread_mutex_unlock(fs_seg_lock(fs, seg));
+    return rc;
+}
+
+int fs_set_block_cache(FSImage *fs, size_t bytes) {
+    pthread_rwlock_wrlock(&fs->ns_lock);
+    pthread_mutex_lock(&fs->bc_lock);
+    int rc = bc_flush(&fs->bcache);
+    if (rc == 0) {
+        bc_destroy(&fs->bcache);
+        rc = bc_init(&fs->bcache, fs->sb.block_size / 8, bytes, fs_cache_io, fs);
+    }
+    pthread_mutex_unlock(&fs->bc_lock);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+int fs_flush(FSImage *fs) {
+    pthread_mutex_lock(&fs->bc_lock);
+    int rc = bc_flush(&fs->bcache);
+    pthread_mutex_unlock(&fs->bc_lock);
+    return rc;
+}
+
 FSImage *fs_create(int width, int height, int block_size) {
+    return fs_create_ex(width, height, block_size, NULL);
+}
+
+// Lee/escribe len bytes desde el byte off de un tramo de bloques contiguos
+// que empieza en el bloque global g (el tramo no cruza segmentos)
+static int fs_run_io(FSImage *fs, uint32_t g, size_t off,
+                     void *buf, size_t len, int write) {
+    size_t block_bytes = fs->sb.block_size / 8;
+    if (block_bytes == 0) return -1;
+    int packed = (size_t)fs->sb.block_size == block_bytes * 8;
+    uint8_t *p = buf;
+    while (len > 0) {
+        uint32_t blk = g + (uint32_t)(off / block_bytes);
+        size_t in = off % block_bytes;
+        size_t n  = packed ? len : block_bytes - in;
+        if (n > len) n = len;
+        int seg = (int)(blk / fs->sb.block_count), rc = -1;
+        pthread_mutex_lock(fs_seg_lock(fs, seg));
+        PBMImage *img = fs_segment(fs, seg);
+        if (img) {
+            size_t bit = fs->sb.data_offset +
+                         (size_t)(blk % fs->sb.block_count) * fs->sb.block_size + in * 8;
+            rc = write ? fs_block_write(fs, img, bit, p, n)
+                       : fs_block_read(fs, img, bit, p, n);
+        }
+        pthread_mutex_unlock(fs_seg_lock(fs, seg));
+        if (rc < 0) return -1;
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+// Lee/escribe las entradas [first, first+count) en su sitio de la imagen:
+// las sb.max_files primeras en image_0, el resto en los trozos del mapa
+static int fs_dir_io(FSImage *fs, uint32_t first, uint32_t count, int write) {
+    uint32_t c = 0, chunk_first = fs->sb.max_files;
+    while (count > 0) {
+        if (first >= fs->dir.max_entries) return -1;
+        DirEntry *e = &fs->dir.pages[first >> BWFS_DIR_PAGE_SHIFT]
+                                    [first & (BWFS_DIR_PAGE - 1)];
+        // Tramo contiguo en memoria (misma página) y en la imagen (mismo trozo)
+        uint32_t n = BWFS_DIR_PAGE - (first & (BWFS_DIR_PAGE - 1));
+        if (n > count) n = count;
+        int rc;
+        if (first < fs->sb.max_files) {
+            if (n > fs->sb.max_files - first) n = fs->sb.max_files - first;
+            PBMImage *img0 = fs_segment(fs, 0);
+            if (!img0) return -1;
+            size_t bit = fs->sb.dir_offset + (size_t)first * sizeof(DirEntry) * 8;
+            size_t nbits = (size_t)n * sizeof(DirEntry) * 8;
+            rc = write ? pbm_write_bits(img0, bit, e, nbits)
+                       : pbm_read_bits(img0, bit, e, nbits);
+        } else {
+            while (c < fs->sb.dir_chunks &&
+                   first >= chunk_first + fs->dir_map[c].entries)
+                chunk_first += fs->dir_map[c++].entries;
+            if (c >= fs->sb.dir_chunks) return -1;
+            uint32_t left = chunk_first + fs->dir_map[c].entries - first;
+            if (n > left) n = left;
+            rc = fs_run_io(fs, fs->dir_map[c].start,
+                           (size_t)(first - chunk_first) * sizeof(DirEntry),
+                           e, (size_t)n * sizeof(DirEntry), write);
+        }
+        if (rc < 0) return -1;
+        first += n;
+        count -= n;
+    }
+    return 0;
+}
+
+FSImage *fs_create_ex(int width, int height, int block_size,
+                      const FSCreateOptions *opts) {
+    uint32_t features = opts ? opts->features : 0;
+    uint32_t max_files = opts && opts->dir_entries ? opts->dir_entries : BWFS_MAX_FILES;
+    if (features & BWFS_FEAT_ALIGN_ROW) features |= BWFS_FEAT_ALIGN64;
+    if (width <= 0 || height <= 0 || block_size <= 0) return NULL;
+
+    // En modo alineado el bloque también ocupa un múltiplo de la alineación
+    size_t align = sb_align_bits(features, width);
+    block_size = (int)((block_size + align - 1) / align * align);
+
     FSImage *fs = calloc(1, sizeof(FSImage));
+    if (fs) fs_locks_init(fs);
     if (!fs) return NULL;
 
     // Crear la primera imagen
@@ -19,126 +626,184 @@ FSImage *fs_create(int width, int height, int block_size) {
     if (!first_img) { free(fs); return NULL; }
 
     // Inicializar el sistema de archivos con la primera imagen
-    fs->images = malloc(sizeof(PBMImage *));
-    fs->images[0] = first_img;
-    fs->image_count = 1;
+    fs->cache_budget = BWFS_DEFAULT_CACHE_BYTES;
+    if (fs_append_segment(fs, first_img) < 0) {
+        pbm_free(first_img);
+        fs_destroy(fs);
+        return NULL;
+    }
 
     // Calcular bits totales disponibles en la primera imagen
     size_t total_bits = (size_t)width * height;
 
     // Calcular bits necesarios para metadatos fijos
     size_t s_bits = sizeof(Superblock) * 8;  // Superbloque
-    size_t d_bits = BWFS_MAX_FILES * sizeof(DirEntry) * 8;  // Directorio
+    size_t d_bits = (size_t)max_files * sizeof(DirEntry) * 8;  // Directorio
 
     // Calcular bloques disponibles resolviendo la ecuación:
     // total_bits = s_bits + d_bits + block_count + (block_count * block_size)
     // => block_count * (block_size + 1) = total_bits - s_bits - d_bits
     if (total_bits <= s_bits + d_bits) {
-        pbm_free(first_img);
-        free(fs->images);
-        free(fs);
+        fs_destroy(fs);
         return NULL;
     }
 
     int block_count = (total_bits - s_bits - d_bits) / (block_size + 1);
-    if (block_count <= 0) {
-        pbm_free(first_img);
-        free(fs->images);
-        free(fs);
-        return NULL;
-    }
 
     // Inicializar superbloque con valores básicos
     sb_init(&fs->sb, width, height, block_size, block_count,
-            BWFS_MAX_FILES, BWFS_MAX_BLOCKS_PER_FILE);
+            max_files, BWFS_MAX_BLOCKS_PER_FILE);
     fs->sb.signature = BWFS_SIGNATURE;  // Establecer la firma
-
-    // Establecer offsets precisos
-    fs->sb.bitmap_offset = s_bits;
-    fs->sb.dir_offset = s_bits + block_count; // bitmap = 1 bit por bloque
-    fs->sb.data_offset = s_bits + block_count + d_bits;
+    fs->sb.features  = features;
+
+    // Establecer offsets precisos; el relleno de alineación puede dejar
+    // sin sitio a algunos bloques de la estimación
+    for (;;) {
+        sb_compute_layout(&fs->sb);
+        if (fs->sb.block_count == 0 ||
+            fs->sb.data_offset + (size_t)fs->sb.block_count * block_size <= total_bits)
+            break;
+        fs->sb.block_count--;
+    }
+    block_count = fs->sb.block_count;
+    if (block_count <= 0) {
+        fs_destroy(fs);
+        return NULL;
+    }
 
     // Recalcular checksum con offsets actualizados
+    fs->sb.checksum = 0;
     fs->sb.checksum = sb_checksum(&fs->sb);
+    fs_update_layout(fs);
+    fs_set_block_cache(fs, BWFS_DEFAULT_BLOCK_CACHE_BYTES);  // Sin memoria: sin caché
 
     // Inicializar bitmap y directorio
-    bm_init(&fs->bm, first_img, fs->sb.bitmap_offset, block_count);
-    dir_init(&fs->dir);
+    fs_bm(fs, 0);
+    if (dir_init_size(&fs->dir, max_files) < 0) {
+        fs_destroy(fs);
+        return NULL;
+    }
 
     // Guardar superbloque actualizado
     sb_save(&fs->sb, first_img);
+    fs->meta_dirty = 1;
 
     return fs;
 }
 
-void fs_add_image(FSImage *fs, int width, int height) {
+static void fs_add_image_locked(FSImage *fs, int width, int height) {
     // Crear una nueva imagen
     PBMImage *new_img = pbm_create(width, height);
     if (!new_img) return;
 
     // Añadir la nueva imagen a la lista
-    fs->images = realloc(fs->images, (fs->image_count + 1) * sizeof(PBMImage *));
-    fs->images[fs->image_count++] = new_img;
+    if (fs_append_segment(fs, new_img) < 0) {
+        pbm_free(new_img);
+        return;
+    }
+    fs_bm(fs, fs->image_count - 1);
 
     // Actualizar el superbloque y demás estructuras
     // (Por simplicidad, se asume que el superbloque se actualiza en fs_save)
 }
 
+void fs_add_image(FSImage *fs, int width, int height) {
+    fs_ns_write_lock(fs);
+    fs_add_image_locked(fs, width, height);
+    fs_ns_write_unlock(fs);
+}
+
+static void fs_release_orphan(FSImage *fs, int idx);
+
 FSImage *fs_load(const char *folder) {
     // 1) Crear y cargar image_0
     FSImage *fs = calloc(1, sizeof(*fs));
+    if (fs) fs_locks_init(fs);
     if (!fs) return NULL;
+    fs->cache_budget = BWFS_DEFAULT_CACHE_BYTES;
+    if (fs_recover(folder) < 0) { fs_destroy(fs); return NULL; }
     char path[1024];
-    snprintf(path, sizeof(path), "%s/image_0.pbm", folder);
+    seg_path(folder, 0, path, sizeof(path));
     PBMImage *img0 = pbm_load(path);
     if (!img0) { free(fs); return NULL; }
 
     // 2) Inicializar array de imágenes
-    fs->images      = malloc(sizeof(*fs->images));
-    fs->images[0]   = img0;
-    fs->image_count = 1;
+    if (fs_append_segment(fs, img0) < 0) {
+        pbm_free(img0);
+        fs_destroy(fs);
+        return NULL;
+    }
 
     // 3) Cargar superbloque
-    if (sb_load(&fs->sb, img0) < 0) {
-        free(fs);
+    int sb_rc = sb_load(&fs->sb, img0);
+    if (sb_rc < 0) {
+        if (sb_rc == -4)
+            fprintf(stderr, "%s: versión de formato %u no soportada (se espera %u); "
+                    "vuelva a crearlo con mkfs.bwfs\n",
+                    folder, fs->sb.version, BWFS_FORMAT_VERSION);
+        fs_destroy(fs);
         return NULL;
     }
+    fs_update_layout(fs);
+    fs_set_block_cache(fs, BWFS_DEFAULT_BLOCK_CACHE_BYTES);  // Sin memoria: sin caché
 
-    // 4) Deserializar sólo entries[] de directorio
-    size_t entry_count = BWFS_MAX_FILES;
-    size_t entry_size  = sizeof(DirEntry) * entry_count;
-    uint8_t *dir_bytes = calloc(1, entry_size);
-    if (!dir_bytes) { free(fs); return NULL; }
-    size_t d_bits = entry_size * 8;
-
-    for (size_t i = 0; i < d_bits; ++i) {
-        size_t bit_idx = fs->sb.dir_offset + i;
-        int x = bit_idx % img0->width;
-        int y = bit_idx / img0->width;
-        int v = pbm_get_pixel(img0, x, y);
-        dir_bytes[i/8] |= (uint8_t)((v & 1) << (7 - (i%8)));
+    // 4) Deserializar las entradas que viven en image_0
+    if (dir_init_size(&fs->dir, fs->sb.max_files) < 0 ||
+        fs_dir_io(fs, 0, fs->sb.max_files, 0) < 0) {
+        fs_destroy(fs);
+        return NULL;
     }
-    // Copiamos sólo entries[] y restablecemos max_entries
-    memcpy(fs->dir.entries, dir_bytes, entry_size);
-    fs->dir.max_entries = BWFS_MAX_FILES;
-    free(dir_bytes);
 
-    // 5) Cargar imágenes adicionales (image_1.pbm, image_2.pbm, …)
+    // 5) Registrar imágenes adicionales (image_1.pbm, image_2.pbm, …);
+    //    se cargan la primera vez que se accede a ellas
+    fs->folder = strdup(folder);
     for (int i = 1; ; ++i) {
-        snprintf(path, sizeof(path), "%s/image_%d.pbm", folder, i);
-        PBMImage *img = pbm_load(path);
-        if (!img) break;
-        fs->images = realloc(fs->images,
-                             sizeof(*fs->images) * (fs->image_count + 1));
-        fs->images[fs->image_count++] = img;
+        seg_path(folder, i, path, sizeof(path));
+        if (access(path, F_OK) != 0) break;
+        if (fs_append_segment(fs, NULL) < 0) {
+            fs_destroy(fs);
+            return NULL;
+        }
+    }
+
+    // 5b) Trozos de la tabla en otros segmentos, según el mapa de trozos
+    if (fs->sb.dir_chunks > 0) {
+        fs->dir_map = malloc(sizeof(DirChunk) * fs->sb.dir_chunks);
+        if (!fs->dir_map ||
+            fs_run_io(fs, fs->sb.dir_map_block, 0, fs->dir_map,
+                      sizeof(DirChunk) * fs->sb.dir_chunks, 0) < 0) {
+            fs_destroy(fs);
+            return NULL;
+        }
+        for (uint32_t c = 0; c < fs->sb.dir_chunks; ++c) {
+            uint32_t first = fs->dir.max_entries;
+            if (dir_grow(&fs->dir, first + fs->dir_map[c].entries) < 0 ||
+                fs_dir_io(fs, first, fs->dir_map[c].entries, 0) < 0) {
+                fs_destroy(fs);
+                return NULL;
+            }
+        }
+    }
+    dir_rebuild(&fs->dir);
+
+    // 6) Construir el gestor de cada segmento: una pasada por imagen deja
+    //    los contadores de libres al día; sólo quedan residentes las fijas
+    for (int i = 0; i < fs->image_count; ++i) {
+        if (!fs_bm(fs, i)) {
+            fs_destroy(fs);
+            return NULL;
+        }
+        pthread_mutex_lock(&fs->seg_cache_lock);
+        if (!fs_segment_pinned(fs, i)) fs_segment_release(fs, i);
+        pthread_mutex_unlock(&fs->seg_cache_lock);
     }
 
-    // 6) Inicializar bitmap sobre la última imagen
-    PBMImage *last = fs->images[fs->image_count-1];
-    bm_init(&fs->bm,
-            last,
-            fs->sb.bitmap_offset,
-            fs->sb.block_count);
+    // 7) Huérfanas de un montaje que no llegó a soltarlas: nadie las
+    //    referencia ya
+    for (uint32_t i = 0; i < fs->dir.max_entries; ++i)
+        if (dir_entry(&fs->dir, i)->used &&
+            dir_parent(&fs->dir, (int)i) == BWFS_DIR_ORPHAN)
+            fs_release_orphan(fs, (int)i);
 
     return fs;
 }
@@ -152,285 +817,1757 @@ void fs_update_checksums(FSImage *fs) {
     fs->sb.checksum = sb_checksum(&fs->sb);
 }
 
-int fs_save(FSImage *fs, const char *folder_path) {
-    // 1) Actualizar todos los checksums
-    fs_update_checksums(fs);
+static int fs_save_locked(FSImage *fs, const char *folder_path) {
+    // Si el destino es la carpeta de la que venimos, los segmentos limpios
+    // ya están al día en disco y se omiten
+    int incremental = fs->folder && strcmp(fs->folder, folder_path) == 0;
+    if (fs_flush(fs) < 0) return -1;
+
+    if (fs->meta_dirty || !incremental) {
+        // 1) Actualizar todos los checksums
+        fs_update_checksums(fs);
+
+        // 2) Guardar superbloque en la primera imagen
+        sb_save(&fs->sb, fs_segment(fs, 0));
+
+        // 3) Pintar las entradas de directorio: sólo las modificadas si el
+        //    destino ya tiene las demás
+        if (!incremental) {
+            if (fs_dir_io(fs, 0, fs->dir.max_entries, 1) < 0) return -1;
+        } else {
+            const uint32_t *list = dir_dirty_list(&fs->dir);
+            for (uint32_t k = 0; k < dir_dirty_count(&fs->dir); ++k)
+                if (fs_dir_io(fs, list[k], 1, 1) < 0) return -1;
+        }
+        dir_clear_dirty(&fs->dir);
+        fs->meta_dirty = 0;
+    }
 
-    // 2) Guardar superbloque en la primera imagen
-    sb_save(&fs->sb, fs->images[0]);
-
-    // 3) Serializar únicamente las entradas de directorio
-    size_t entry_count = BWFS_MAX_FILES;
-    size_t entry_size  = sizeof(DirEntry) * entry_count;
-    uint8_t *dir_bytes = calloc(1, entry_size);
-    if (!dir_bytes) return -1;
-    // Copiamos sólo entries[], no max_entries
-    memcpy(dir_bytes, fs->dir.entries, entry_size);
-
-    // 4) Pintar bits de directorio en image_0
-    size_t d_bits = entry_size * 8;
-    PBMImage *img0 = fs->images[0];
-    int dir_start = fs->sb.dir_offset;
-    for (size_t i = 0; i < d_bits; ++i) {
-        int x = (dir_start + i) % img0->width;
-        int y = (dir_start + i) / img0->width;
-        int bit = (dir_bytes[i/8] >> (7 - (i%8))) & 1;
-        pbm_set_pixel(img0, x, y, bit);
-    }
-    free(dir_bytes);
-
-    // 5) Guardar todas las imágenes en disco
+    // 4) Una tarea por segmento a escribir: los residentes con cambios o,
+    //    al guardar en otra carpeta, todos (copiando los no residentes)
+    SegTask *tasks = calloc(fs->image_count, sizeof(*tasks));
+    int     *segs  = malloc(sizeof(*segs) * fs->image_count);
+    if (!tasks || !segs) {
+        free(tasks);
+        free(segs);
+        return -1;
+    }
+    int ntasks = 0, nsegs = 0;
     for (int i = 0; i < fs->image_count; ++i) {
-        char path[1024];
-        snprintf(path, sizeof(path), "%s/image_%d.pbm", folder_path, i);
-        if (pbm_save(fs->images[i], path) != 0) {
-            fprintf(stderr, "Error guardando %s\n", path);
-            return -1;
+        PBMImage *img = fs->images[i];
+        if (!incremental || (img && pbm_is_dirty(img))) {
+            SegTask *t = &tasks[ntasks++];
+            t->idx = i;
+            t->img = img;
+            if (!img) seg_current_path(fs, i, t->src, sizeof(t->src));
+            seg_stage_path(folder_path, i, t->dst, sizeof(t->dst));
+            segs[nsegs++] = i;
+        } else if (fs->seg_staged[i]) {
+            segs[nsegs++] = i;  // Preparado al expulsarlo
         }
     }
+
+    // 5) Escribir en paralelo y confirmar todo junto
+    int rc = seg_run_tasks(tasks, ntasks);
+    if (rc == 0 && nsegs > 0) rc = fs_commit(folder_path, segs, nsegs);
+    if (rc == 0) {
+        memset(fs->seg_staged, 0, fs->image_count);
+        for (int k = 0; k < ntasks; ++k) {
+            PBMImage *img = (PBMImage *)tasks[k].img;
+            if (!img) continue;
+            char path[1024];
+            seg_path(folder_path, tasks[k].idx, path, sizeof(path));
+            pbm_clear_dirty(img);
+            // Suelta las páginas privadas: el archivo confirmado ya es idéntico
+            pbm_attach_file(img, path);
+        }
+    }
+    free(tasks);
+    free(segs);
+    if (rc < 0) return -1;
+
+    if (!incremental) {
+        free(fs->folder);
+        fs->folder = strdup(folder_path);
+    }
     return 0;
 }
 
+int fs_save(FSImage *fs, const char *folder_path) {
+    fs_ns_write_lock(fs);
+    int rc = fs_save_locked(fs, folder_path);
+    fs_ns_write_unlock(fs);
+    return rc;
+}
+
 void fs_destroy(FSImage *fs) {
     if (fs) {
         for (int i = 0; i < fs->image_count; ++i) {
             if (fs->images[i]) pbm_free(fs->images[i]);
+            bm_destroy(&fs->bms[i]);
         }
         free(fs->images);
+        free(fs->bms);
+        dir_destroy(&fs->dir);
+        free(fs->dir_map);
+        bc_destroy(&fs->bcache);
+        for (uint32_t i = 0; i < fs->fmaps_cap; ++i) {
+            fm_destroy(fs->fmaps[i]);
+            free(fs->fmaps[i]);
+        }
+        free(fs->fmaps);
+        free(fs->seg_stamp);
+        free(fs->seg_staged);
+        free(fs->seg_refs);
+        free(fs->seg_flushing);
+        free(fs->refs);
+        free(fs->folder);
+        fs_locks_destroy(fs);
         free(fs);
     }
 }
 
+// Libera el bloque global g en su segmento y ajusta el contador global
+static int fs_release_block(FSImage *fs, uint32_t g) {
+    int seg = (int)(g / fs->sb.block_count);
+    pthread_mutex_lock(&fs->bc_lock);
+    bc_drop(&fs->bcache, g);
+    pthread_mutex_unlock(&fs->bc_lock);
+    pthread_mutex_lock(fs_seg_lock(fs, seg));
+    BlockManager *bm = fs_bm(fs, seg);
+    int rc = -1;
+    if (bm) {
+        uint32_t before = bm->free_count;
+        rc = bm_free(bm, g % fs->sb.block_count);
+        fs->free_blocks += bm->free_count - before;
+    }
+    pthread_mutex_unlock(fs_seg_lock(fs, seg));
+    if (seg < fs->alloc_hint) fs->alloc_hint = seg;
+    return rc;
+}
+
+// Reserva hasta want bloques contiguos en cualquier segmento y retorna el
+// número global del primero (*got reservados), o -1 sin espacio. Elige por
+// los contadores de libres: el primer segmento donde caben los want, si no
+// el que más libres tiene; sólo crea una imagen cuando todos están llenos.
+static int fs_alloc_extent(FSImage *fs, int want, int *got) {
+    while (fs->alloc_hint < fs->image_count &&
+           fs->bms[fs->alloc_hint].free_count == 0)
+        fs->alloc_hint++;
+
+    int pick = -1;
+    uint32_t most = 0;
+    for (int i = fs->alloc_hint; i < fs->image_count; ++i) {
+        uint32_t f = fs->bms[i].free_count;
+        if (f >= (uint32_t)want) { pick = i; break; }
+        if (f > most) { most = f; pick = i; }
+    }
+    if (pick < 0) {
+        PBMImage *new_img = pbm_create(fs->sb.width, fs->sb.height);
+        if (!new_img) return -1;
+        if (fs_append_segment(fs, new_img) < 0) {
+            pbm_free(new_img);
+            return -1;
+        }
+        pick = fs->image_count - 1;
+    }
+
+    pthread_mutex_lock(fs_seg_lock(fs, pick));
+    BlockManager *bm = fs_bm(fs, pick);
+    int loc = bm ? bm_alloc_range(bm, want, got) : -1;
+    pthread_mutex_unlock(fs_seg_lock(fs, pick));
+    if (loc < 0) return -1;
+    fs->free_blocks -= *got;
+    return pick * (int)fs->sb.block_count + loc;
+}
+
+// Reserva n bloques contiguos dentro de un mismo segmento (para la tabla de
+// entradas y su mapa), creando una imagen si ningún segmento tiene un tramo así
+static int fs_alloc_contig(FSImage *fs, int n) {
+    if (n <= 0 || (uint32_t)n > fs->sb.block_count) return -1;
+    for (int i = fs->alloc_hint; i <= fs->image_count; ++i) {
+        if (i == fs->image_count) {
+            PBMImage *new_img = pbm_create(fs->sb.width, fs->sb.height);
+            if (!new_img) return -1;
+            if (fs_append_segment(fs, new_img) < 0) {
+                pbm_free(new_img);
+                return -1;
+            }
+        } else if (fs->bms[i].free_count < (uint32_t)n) {
+            continue;
+        }
+        pthread_mutex_lock(fs_seg_lock(fs, i));
+        BlockManager *bm = fs_bm(fs, i);
+        int got = 0;
+        int loc = bm ? bm_alloc_range(bm, n, &got) : -2;
+        if (loc >= 0 && got < n)
+            for (int k = 0; k < got; ++k) bm_free(bm, loc + k);  // Tramo corto: se deshace
+        pthread_mutex_unlock(fs_seg_lock(fs, i));
+        if (loc == -2) return -1;
+        if (loc < 0 || got < n) continue;
+        fs->free_blocks -= n;
+        return i * (int)fs->sb.block_count + loc;
+    }
+    return -1;
+}
+
+static void fs_release_run(FSImage *fs, uint32_t g, uint32_t n) {
+    for (uint32_t k = 0; k < n; ++k) fs_release_block(fs, g + k);
+}
+
+// Añade un trozo a la tabla de entradas (tantas entradas como ya tiene, con
+// tope de medio segmento) y lo registra en el mapa de trozos
+static int fs_dir_grow(FSImage *fs) {
+    size_t block_bytes = fs->sb.block_size / 8;
+    if (block_bytes == 0) return -1;
+    uint32_t cap = (uint32_t)((size_t)fs->sb.block_count * block_bytes / 2 /
+                              sizeof(DirEntry));
+    uint32_t entries = fs->dir.max_entries < cap ? fs->dir.max_entries : cap;
+    if (entries == 0) return -1;
+    uint32_t nblocks = (uint32_t)(((size_t)entries * sizeof(DirEntry) +
+                                   block_bytes - 1) / block_bytes);
+
+    // El mapa se reubica, al doble de lo necesario, cuando no cabe
+    uint32_t chunks = fs->sb.dir_chunks + 1;
+    DirChunk *map = realloc(fs->dir_map, sizeof(DirChunk) * chunks);
+    if (!map) return -1;
+    fs->dir_map = map;
+    size_t   map_bytes  = sizeof(DirChunk) * chunks;
+    uint32_t map_block  = fs->sb.dir_map_block;
+    uint32_t map_blocks = fs->sb.dir_map_blocks;
+    if (map_bytes > (size_t)map_blocks * block_bytes) {
+        map_blocks = (uint32_t)((2 * map_bytes + block_bytes - 1) / block_bytes);
+        int g = fs_alloc_contig(fs, (int)map_blocks);
+        if (g < 0) return -1;
+        map_block = (uint32_t)g;
+    }
+    int start = fs_alloc_contig(fs, (int)nblocks);
+    uint32_t first = fs->dir.max_entries;
+    if (start < 0 || dir_grow(&fs->dir, first + entries) < 0) {
+        if (start >= 0) fs_release_run(fs, start, nblocks);
+        if (map_block != fs->sb.dir_map_block) fs_release_run(fs, map_block, map_blocks);
+        return -1;
+    }
+
+    // Las entradas nuevas se pintan ya (a cero) para no heredar datos
+    // antiguos de esos bloques
+    map[chunks - 1] = (DirChunk){ (uint32_t)start, entries };
+    fs->sb.dir_chunks = chunks;
+    if (fs_dir_io(fs, first, entries, 1) < 0 ||
+        fs_run_io(fs, map_block, 0, map, map_bytes, 1) < 0)
+        return -1;
+    if (map_block != fs->sb.dir_map_block && fs->sb.dir_map_blocks)
+        fs_release_run(fs, fs->sb.dir_map_block, fs->sb.dir_map_blocks);
+    fs->sb.dir_map_block  = map_block;
+    fs->sb.dir_map_blocks = map_blocks;
+    fs->sb.dir_entries    = fs->dir.max_entries;
+    fs->meta_dirty = 1;
+    return 0;
+}
+
+static int fs_create_file_locked(FSImage *fs, const char *name) {
+    int idx = dir_create(&fs->dir, name);
+    // Tabla llena: se amplía con un trozo nuevo y se reintenta
+    if (idx < 0 && fs->dir.free_entries == 0 && fs_dir_grow(fs) == 0)
+        idx = dir_create(&fs->dir, name);
+    if (idx >= 0) {
+        fs->meta_dirty = 1;
+        fs_update_checksums(fs);
+    }
+    return idx;
+}
+
 int fs_create_file(FSImage *fs, const char *name) {
-    return dir_create(&fs->dir, name);
+    fs_ns_write_lock(fs);
+    int rc = fs_create_file_locked(fs, name);
+    fs_ns_write_unlock(fs);
+    return rc;
 }
 
-int fs_remove_file(FSImage *fs, const char *name) {
+int fs_mknod(FSImage *fs, const char *name) {
+    fs_ns_write_lock(fs);
+    int idx = fs_create_file_locked(fs, name);
+    // Mismos errores que fs_mkdir
+    if (idx < 0)
+        idx = dir_find(&fs->dir, name) >= 0 ? -EEXIST
+            : fs->dir.free_entries         ? -ENOENT : -ENOSPC;
+    fs_ns_write_unlock(fs);
+    return idx;
+}
+
+// Hueco de la caché de tramos para la entrada idx (la amplía si hace falta)
+static FileMap **fs_fmap_slot(FSImage *fs, int idx) {
+    if ((uint32_t)idx >= fs->fmaps_cap) {
+        uint32_t cap = fs->fmaps_cap ? fs->fmaps_cap : 64;
+        while (cap <= (uint32_t)idx) cap *= 2;
+        FileMap **m = realloc(fs->fmaps, sizeof(*m) * cap);
+        if (!m) return NULL;
+        memset(m + fs->fmaps_cap, 0, sizeof(*m) * (cap - fs->fmaps_cap));
+        fs->fmaps = m;
+        fs->fmaps_cap = cap;
+    }
+    return &fs->fmaps[idx];
+}
+
+static void fs_drop_file_map(FSImage *fs, int idx) {
+    if ((uint32_t)idx < fs->fmaps_cap && fs->fmaps[idx]) {
+        fm_destroy(fs->fmaps[idx]);
+        free(fs->fmaps[idx]);
+        fs->fmaps[idx] = NULL;
+    }
+}
+
+// Bloques que ocupa la lista de tramos extra (los que no caben en la entrada)
+static uint32_t fs_ext_blocks(const FSImage *fs, uint32_t ext_count) {
+    if (ext_count <= BWFS_INLINE_EXTENTS) return 0;
+    size_t bb = fs->sb.block_size / 8;
+    return (uint32_t)(((size_t)(ext_count - BWFS_INLINE_EXTENTS) * sizeof(Extent)
+                       + bb - 1) / bb);
+}
+
+// Tramos de la entrada idx: se leen de la entrada y de su lista extra la
+// primera vez y quedan en memoria hasta que el archivo cambia
+static FileMap *fs_file_map(FSImage *fs, int idx) {
+    FileMap **slot = fs_fmap_slot(fs, idx);
+    if (!slot) return NULL;
+    if (*slot) return *slot;
+
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    FileMap *fm = malloc(sizeof(*fm));
+    if (!e || !fm) {
+        free(fm);
+        return NULL;
+    }
+    fm_init(fm);
+    int rc = 0;
+    for (uint32_t i = 0; i < e->ext_count && i < BWFS_INLINE_EXTENTS && rc == 0; ++i)
+        rc = fm_push(fm, e->ext[i].start, e->ext[i].len);
+    if (rc == 0 && e->ext_count > BWFS_INLINE_EXTENTS) {
+        uint32_t extra = e->ext_count - BWFS_INLINE_EXTENTS;
+        Extent *tmp = malloc(sizeof(Extent) * extra);
+        rc = tmp ? fs_run_io(fs, e->ext_block, 0, tmp, sizeof(Extent) * extra, 0) : -1;
+        for (uint32_t i = 0; i < extra && rc == 0; ++i)
+            rc = fm_push(fm, tmp[i].start, tmp[i].len);
+        free(tmp);
+    }
+    if (rc < 0) {
+        fm_destroy(fm);
+        free(fm);
+        return NULL;
+    }
+    *slot = fm;
+    return fm;
+}
+
+// Libera los bloques de datos y la lista de tramos extra de la entrada idx
+static int fs_release_file(FSImage *fs, int idx) {
+    FileMap *fm = fs_file_map(fs, idx);
+    if (!fm) return -1;
+    for (uint32_t i = 0; i < fm->count; ++i)
+        if (fm->ext[i].start != BWFS_HOLE)
+            fs_release_run(fs, fm->ext[i].start, fm->ext[i].len);
+    DirEntry e = *dir_entry(&fs->dir, idx);
+    fs_release_run(fs, e.ext_block, fs_ext_blocks(fs, e.ext_count));
+    memset(e.ext, 0, sizeof(e.ext));
+    e.ext_count = e.ext_block = e.block_count = 0;
+    dir_entry_put(&fs->dir, idx, &e);
+    fs_drop_file_map(fs, idx);
+    return 0;
+}
+
+// Guarda en la entrada idx los tramos de fm desde el from-ésimo (los
+// anteriores no cambiaron) y deja fm como su lista en memoria. Los que no
+// caben en la entrada van en un tramo de bloques aparte, que sólo se reubica
+// cuando cambia de tamaño
+static int fs_store_file_map(FSImage *fs, int idx, FileMap *fm, uint32_t from) {
+    FileMap **slot = fs_fmap_slot(fs, idx);
+    if (!slot) return -1;
+    DirEntry e = *dir_entry(&fs->dir, idx);
+    uint32_t old_nb = fs_ext_blocks(fs, e.ext_count), old_block = e.ext_block;
+    uint32_t nb = fs_ext_blocks(fs, fm->count), block = old_block;
+    if (nb != old_nb) {
+        from  = 0;
+        block = 0;
+        if (nb) {
+            int g = fs_alloc_contig(fs, (int)nb);
+            if (g < 0) return -1;
+            block = (uint32_t)g;
+        }
+    }
+    uint32_t first = from > BWFS_INLINE_EXTENTS ? from : BWFS_INLINE_EXTENTS;
+    if (nb && fm->count > first &&
+        fs_run_io(fs, block, (size_t)(first - BWFS_INLINE_EXTENTS) * sizeof(Extent),
+                  fm->ext + first, sizeof(Extent) * (fm->count - first), 1) < 0) {
+        if (block != old_block) fs_release_run(fs, block, nb);
+        return -1;
+    }
+    if (nb != old_nb && old_nb) fs_release_run(fs, old_block, old_nb);
+
+    for (uint32_t i = from; i < BWFS_INLINE_EXTENTS; ++i)
+        e.ext[i] = i < fm->count ? fm->ext[i] : (Extent){ 0, 0 };
+    e.ext_count   = fm->count;
+    e.ext_block   = block;
+    e.block_count = (uint32_t)fm_allocated(fm);
+    dir_entry_put(&fs->dir, idx, &e);
+    if (*slot != fm) {
+        fs_drop_file_map(fs, idx);
+        *slot = fm;
+    }
+    return 0;
+}
+
+// Libera los bloques de fm desde el bloque lógico keep y recorta la lista
+static void fs_release_tail(FSImage *fs, FileMap *fm, uint64_t keep) {
+    for (uint32_t i = fm->count; i-- > 0; ) {
+        uint64_t first = fm->end[i] - fm->ext[i].len;
+        if (fm->end[i] <= keep) break;
+        uint32_t from = keep > first ? (uint32_t)(keep - first) : 0;
+        if (fm->ext[i].start != BWFS_HOLE)
+            fs_release_run(fs, fm->ext[i].start + from, fm->ext[i].len - from);
+    }
+    fm_trim(fm, keep);
+}
+
+// Añade n bloques al final de fm: primero alarga el último tramo con los
+// bloques libres que le siguen en su segmento, luego reserva tramos nuevos
+static int fs_grow_file(FSImage *fs, FileMap *fm, uint64_t n) {
+    uint32_t bc = fs->sb.block_count;
+    if (fm->count > 0 && fm->ext[fm->count - 1].start != BWFS_HOLE) {
+        const Extent *last = &fm->ext[fm->count - 1];
+        uint32_t next = last->start + last->len;
+        int      seg  = (int)(next / bc);
+        uint32_t k = 0;
+        if (next % bc) {
+            pthread_mutex_lock(fs_seg_lock(fs, seg));
+            BlockManager *bm = fs_bm(fs, seg);
+            while (bm && k < n && next % bc + k < bc &&
+                   bm_is_allocated(bm, (int)(next % bc + k)) == 0) {
+                bm_alloc(bm, (int)(next % bc + k));
+                k++;
+            }
+            pthread_mutex_unlock(fs_seg_lock(fs, seg));
+        }
+        fs->free_blocks -= k;
+        fm_extend_last(fm, k);
+        n -= k;
+    }
+    while (n > 0) {
+        int want = n > bc ? (int)bc : (int)n;
+        int got  = 0;
+        int g = fs_alloc_extent(fs, want, &got);
+        if (g < 0) return -1;
+        if (fm_push(fm, (uint32_t)g, (uint32_t)got) < 0) {
+            fs_release_run(fs, (uint32_t)g, (uint32_t)got);
+            return -1;
+        }
+        n -= (uint64_t)got;
+    }
+    return 0;
+}
+
+// Lee/escribe len bytes desde offset a través de los tramos de fm (que
+// deben cubrir el rango; para escribir, sin huecos)
+static int fs_file_io(FSImage *fs, const FileMap *fm, uint64_t offset,
+                      void *buf, size_t len, int write) {
+    size_t   block_bytes = fs->sb.block_size / 8;
+    int      packed      = (size_t)fs->sb.block_size == block_bytes * 8;
+    uint8_t *p           = buf;
+
+    // Con caché, bloque a bloque desde memoria (cargando los que falten)
+    while (fs->bcache.nslots && len > 0) {
+        size_t   in = (size_t)(offset % block_bytes);
+        int64_t  g  = fm_lookup(fm, offset / block_bytes, NULL);
+        size_t   n  = block_bytes - in < len ? block_bytes - in : len;
+        if (g == FM_HOLE && !write) {
+            memset(p, 0, n);    // Los huecos se leen como ceros
+            p += n; offset += n; len -= n;
+            continue;
+        }
+        if (g < 0) return -1;
+        pthread_mutex_lock(&fs->bc_lock);
+        uint8_t *blk = bc_get(&fs->bcache, (uint32_t)g, write,
+                               write && n == block_bytes);
+        if (blk) {
+            if (write) memcpy(blk + in, p, n);
+            else       memcpy(p, blk + in, n);
+        }
+        pthread_mutex_unlock(&fs->bc_lock);
+        if (!blk) {
+            printf("Error accessing block %lld\n", (long long)g);
+            return -1;
+        }
+        p += n; offset += n; len -= n;
+    }
+
+    while (len > 0) {
+        size_t   in = (size_t)(offset % block_bytes);
+        uint32_t run;
+        int64_t g = fm_lookup(fm, offset / block_bytes, &run);
+        if (g == FM_HOLE && !write) {
+            size_t n = run * block_bytes - in;
+            if (n > len) n = len;
+            memset(p, 0, n);
+            p += n; offset += n; len -= n;
+            continue;
+        }
+        if (g < 0) return -1;
+        int img_idx = (int)(g / fs->sb.block_count);
+        pthread_mutex_lock(fs_seg_lock(fs, img_idx));
+        PBMImage *img = fs_segment(fs, img_idx);
+        if (!img) {
+            pthread_mutex_unlock(fs_seg_lock(fs, img_idx));
+            printf("Cannot load image %d\n", img_idx);
+            return -1;
+        }
+        // Un tramo se copia de una vez si los bloques están empaquetados
+        if (!packed) run = 1;
+        size_t n = run * block_bytes - in;
+        if (n > len) n = len;
+        size_t bit = fs->sb.data_offset +
+                     (size_t)(g % fs->sb.block_count) * fs->sb.block_size + in * 8;
+        int rc = write ? fs_block_write(fs, img, bit, p, n)
+                       : fs_block_read(fs, img, bit, p, n);
+        pthread_mutex_unlock(fs_seg_lock(fs, img_idx));
+        if (rc < 0) {
+            printf("Error accessing block %lld\n", (long long)g);
+            return -1;
+        }
+        p += n; offset += n; len -= n;
+    }
+    return 0;
+}
+
+// Referencias externas a idx (con ns_lock tomado)
+static uint32_t fs_refs(FSImage *fs, int idx) {
+    pthread_mutex_lock(&fs->meta_lock);
+    uint32_t n = (uint32_t)idx < fs->refs_cap ? fs->refs[idx] : 0;
+    pthread_mutex_unlock(&fs->meta_lock);
+    return n;
+}
+
+// Borra name; si aún tiene referencias queda huérfana, con sus datos, hasta
+// que fs_unref suelte la última. 0, -ENOENT, -ENOTEMPTY o -EIO
+static int fs_remove_entry(FSImage *fs, const char *name) {
     int idx = dir_find(&fs->dir, name);
-    if (idx < 0) return -1;
+    if (idx < 0) return -ENOENT;
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    if (e->is_dir && dir_first_child(&fs->dir, idx) >= 0) return -ENOTEMPTY;
+    int rc;
+    if (fs_refs(fs, idx) > 0) {
+        rc = dir_orphan(&fs->dir, name);
+    } else {
+        // Sin los tramos no se pueden liberar sus bloques: no se borra
+        if (fs_release_file(fs, idx) < 0) return -EIO;
+        rc = dir_remove(&fs->dir, name);
+    }
+    if (rc < 0) return rc == -2 ? -ENOTEMPTY : -ENOENT;
+    fs->meta_dirty = 1;
+    fs_update_checksums(fs);
+    return 0;
+}
+
+// Libera la entrada huérfana idx (con ns_lock en escritura)
+static void fs_release_orphan(FSImage *fs, int idx) {
+    if (dir_parent(&fs->dir, idx) != BWFS_DIR_ORPHAN) return;
+    fs_release_file(fs, idx);
+    dir_release(&fs->dir, idx);
+    fs->meta_dirty = 1;
+    fs_update_checksums(fs);
+}
+
 
-    DirEntry *e = dir_entry_mut(&fs->dir, idx);
-    for (uint32_t i = 0; i < e->block_count; ++i)
-        bm_free(&fs->bm, e->blocks[i]);
+int fs_remove_file(FSImage *fs, const char *name) {
+    fs_ns_write_lock(fs);
+    int idx = dir_find(&fs->dir, name);
+    int rc  = idx < 0 ? -ENOENT
+            : dir_entry(&fs->dir, idx)->is_dir ? -EISDIR
+            : fs_remove_entry(fs, name);
+    fs_ns_write_unlock(fs);
+    return rc;
+}
 
-    return dir_remove(&fs->dir, name);
+// Tamaño máximo de archivo: el tope del superbloque, y size es de 32 bits
+static uint64_t fs_max_file_bytes(const FSImage *fs) {
+    uint64_t max_bytes = (uint64_t)fs->sb.max_blocks_per_file * (fs->sb.block_size / 8);
+    return max_bytes > UINT32_MAX ? UINT32_MAX : max_bytes;
 }
 
-ssize_t fs_write_file(FSImage *fs,
-                      const char *filename,
-                      const void *buf,
-                      size_t size)
+static ssize_t fs_write_file_locked(FSImage *fs,
+                                    const char *filename,
+                                    const void *buf,
+                                    size_t size)
 {
     const uint8_t *buffer = (const uint8_t *)buf;
 
     // 1) Busca la entrada en el directorio
     int idx = dir_find(&fs->dir, filename);
     if (idx < 0) return -1;
-    DirEntry *e = dir_entry_mut(&fs->dir, idx);
 
     // 2) Comprueba tamaño máximo permitido
-    size_t max_bytes = fs->sb.max_blocks_per_file * (fs->sb.block_size / 8);
-    if (size > max_bytes) return -1;
-
-    // 3) Libera bloques previos del archivo (si existían)
-    for (uint32_t i = 0; i < e->block_count; i++) {
-        int g = e->blocks[i];
-        int img = g / fs->sb.block_count;
-        uint32_t loc = g % fs->sb.block_count;
-        BlockManager bm_tmp;
-        bm_init(&bm_tmp,
-                fs->images[img],
-                fs->sb.bitmap_offset,
-                fs->sb.block_count);
-        bm_free(&bm_tmp, loc);
-    }
-    e->block_count = 0;
-
-    // 4) Escribe los datos, bloque a bloque, expandiendo imágenes si es necesario
-    size_t written     = 0;
+    if (size > fs_max_file_bytes(fs)) return -1;
+
+    // 3) Conserva los bloques que ya tenía (incluidos los preasignados) hasta
+    //    donde alcancen y libera los que sobran
+    FileMap *fm = fs_file_map(fs, idx);
+    if (!fm) return -2;
+    fs->meta_dirty = 1;
+    size_t   block_bytes = fs->sb.block_size / 8;
+    uint64_t need = (size + block_bytes - 1) / block_bytes;
+    // (un archivo con huecos se reescribe entero en bloques nuevos)
+    if (fm->holes) fs_release_tail(fs, fm, 0);
+    if (fm_blocks(fm) > need) fs_release_tail(fs, fm, need);
+    uint32_t from = fm->count ? fm->count - 1 : 0;  // Primer tramo que puede cambiar
+    size_t written = (size_t)fm_blocks(fm) * block_bytes;
+    if (written > size) written = size;
+    if (written && fs_file_io(fs, fm, 0, (void *)buffer, written, 1) < 0) goto fail;
+
+    // 4) Reserva tramos contiguos (best-fit) para el resto, expandiendo
+    //    imágenes si es necesario, y escribe cada uno antes de pedir el siguiente
+    while (written < size) {
+        size_t left = (size - written + block_bytes - 1) / block_bytes;
+        int got = 0;
+        int g = fs_alloc_extent(fs, left < fs->sb.block_count ? (int)left
+                                                              : (int)fs->sb.block_count, &got);
+        if (g < 0) goto fail;
+        if (fm_push(fm, (uint32_t)g, (uint32_t)got) < 0) {
+            fs_release_run(fs, (uint32_t)g, (uint32_t)got);
+            goto fail;
+        }
+        size_t n = (size_t)got * block_bytes;
+        if (n > size - written) n = size - written;
+        if (fs_file_io(fs, fm, written, (void *)(buffer + written), n, 1) < 0)
+            goto fail;
+        written += n;
+    }
+    if (fs_store_file_map(fs, idx, fm, from) < 0) goto fail;
+
+    // 5) Actualiza tamaño y checksum del archivo
+    DirEntry e = *dir_entry(&fs->dir, idx);
+    e.size = size;
+    uint32_t file_sum = 0;
+    for (size_t i = 0; i < size; i++) {
+        file_sum ^= buffer[i];
+    }
+    e.checksum = file_sum;
+    dir_entry_put(&fs->dir, idx, &e);
+
+    // 6) Actualiza checksum del directorio y superbloque
+    fs_update_checksums(fs);
+
+    return (ssize_t)size;
+
+fail:
+    // Sin espacio a mitad: el archivo queda vacío y los tramos, libres
+    fs_release_tail(fs, fm, 0);
+    fs_store_file_map(fs, idx, fm, 0);
+    e = *dir_entry(&fs->dir, idx);
+    e.size = e.checksum = 0;
+    dir_entry_put(&fs->dir, idx, &e);
+    fs_update_checksums(fs);
+    return -3;
+}
+
+ssize_t fs_write_file(FSImage *fs, const char *filename, const void *buf,
+                      size_t size) {
+    fs_ns_write_lock(fs);
+    ssize_t rc = fs_write_file_locked(fs, filename, buf, size);
+    fs_ns_write_unlock(fs);
+    return rc;
+}
+
+// Escribe ceros en [from, to) del archivo (deben estar cubiertos por fm);
+// los huecos ya se leen como ceros y se saltan
+static int fs_zero_range(FSImage *fs, const FileMap *fm, uint64_t from,
+                         uint64_t to) {
+    static const uint8_t zeros[4096];
     size_t block_bytes = fs->sb.block_size / 8;
+    while (from < to) {
+        uint32_t run;
+        uint64_t in = from % block_bytes;
+        int64_t  g  = fm_lookup(fm, from / block_bytes, &run);
+        if (g == -1) return -1;
+        uint64_t cap = (uint64_t)run * block_bytes - in;
+        if (g == FM_HOLE) {
+            from += cap;
+            continue;
+        }
+        size_t n = to - from < sizeof(zeros) ? (size_t)(to - from) : sizeof(zeros);
+        if (n > cap) n = (size_t)cap;
+        if (fs_file_io(fs, fm, from, (void *)zeros, n, 1) < 0) return -1;
+        from += n;
+    }
+    return 0;
+}
 
-    while (written < size) {
-        size_t to_write = (size - written < block_bytes)
-                            ? size - written
-                            : block_bytes;
-
-        // 4.1) Intenta asignar en la imagen actual
-        int loc = bm_alloc_first(&fs->bm);
-        if (loc < 0) {
-            // Crea y usa una nueva imagen
-            PBMImage *new_img = pbm_create(fs->sb.width, fs->sb.height);
-            fs->images = realloc(fs->images,
-                                 sizeof(*fs->images) * (fs->image_count + 1));
-            fs->images[fs->image_count] = new_img;
-            fs->image_count++;
-
-            bm_init(&fs->bm,
-                    new_img,
-                    fs->sb.bitmap_offset,
-                    fs->sb.block_count);
-            loc = bm_alloc_first(&fs->bm);
-            if (loc < 0) {
-                // Ya no queda espacio incluso tras expandir
-                return -3;
+// Tramo de bytes [from, to) de un archivo
+typedef struct {
+    uint64_t from, to;
+} FsRange;
+
+// Huecos de fm dentro de [first, last) (bloques lógicos), en bytes: lo que
+// fs_map_range les asigne se pone a cero después con fs_zero_holes, fuera
+// de meta_lock. *out queda en NULL si no hay ninguno.
+static int fs_holes(FSImage *fs, const FileMap *fm, uint64_t first,
+                    uint64_t last, FsRange **out, uint32_t *n) {
+    size_t bb = fs->sb.block_size / 8;
+    *out = NULL;
+    *n   = 0;
+    for (uint32_t i = 0, cap = 0; i < fm->count && fm->end[i] - fm->ext[i].len < last; ++i) {
+        if (fm->ext[i].start != BWFS_HOLE || fm->end[i] <= first) continue;
+        uint64_t hs = fm->end[i] - fm->ext[i].len, he = fm->end[i];
+        if (*n == cap) {
+            cap = cap ? 2 * cap : 8;
+            FsRange *r = realloc(*out, cap * sizeof(*r));
+            if (!r) {
+                free(*out);
+                *out = NULL;
+                return -1;
             }
+            *out = r;
         }
+        (*out)[(*n)++] = (FsRange){ (first > hs ? first : hs) * bb,
+                                    (last < he ? last : he) * bb };
+    }
+    return 0;
+}
+
+// Pone a cero lo que ahora tiene bloque en los huecos h, salvo [skip_from,
+// skip_to), que el llamador va a escribir. Con el cerrojo del archivo.
+static int fs_zero_holes(FSImage *fs, const FileMap *fm, const FsRange *h,
+                         uint32_t n, uint64_t skip_from, uint64_t skip_to) {
+    int rc = 0;
+    for (uint32_t k = 0; k < n; ++k) {
+        uint64_t a = h[k].from, b = h[k].to;
+        if (a < skip_from && fs_zero_range(fs, fm, a, b < skip_from ? b : skip_from) < 0)
+            rc = -1;
+        if (b > skip_to && fs_zero_range(fs, fm, a > skip_to ? a : skip_to, b) < 0)
+            rc = -1;
+    }
+    return rc;
+}
 
-        // 4.2) Guarda el índice global de bloque
-        int img_idx      = fs->image_count - 1;
-        int global_block = img_idx * (int)fs->sb.block_count + loc;
-        e->blocks[e->block_count++] = global_block;
+// Reserva bloques para la parte de [first, last) que cae en huecos de fm
+// (sin escribirlos: ver fs_holes). Intenta alargar el tramo de datos anterior antes de pedir tramos
+// nuevos, para que rellenar un hueco secuencialmente no fragmente la lista.
+// *from baja al primer tramo modificado. Si falla, fm sigue siendo coherente
+// con lo ya reservado.
+static int fs_fill_holes(FSImage *fs, FileMap *fm, uint64_t first,
+                         uint64_t last, uint32_t *from) {
+    uint32_t bc = fs->sb.block_count;
+    for (uint32_t i = 0; i < fm->count && fm->end[i] - fm->ext[i].len < last; ++i) {
+        if (fm->ext[i].start != BWFS_HOLE || fm->end[i] <= first) continue;
+        uint64_t hs = fm->end[i] - fm->ext[i].len, he = fm->end[i];
+        uint64_t a = first > hs ? first : hs, b = last < he ? last : he;
+
+        // Trozos que sustituyen al hueco (y quizá al tramo anterior)
+        Extent   piece[64];
+        uint32_t np = 0, at = i, n = 1;
+        int      rc = 0;
+        if (a > hs) {
+            piece[np++] = (Extent){ BWFS_HOLE, (uint32_t)(a - hs) };
+        } else if (i > 0 && fm->ext[i - 1].start != BWFS_HOLE) {
+            piece[np++] = fm->ext[i - 1];
+            at--; n++;
+        }
+        uint64_t done = a;
+        while (done < b) {
+            Extent *prev = np ? &piece[np - 1] : NULL;
+            uint32_t next = prev && prev->start != BWFS_HOLE ? prev->start + prev->len : 0;
+            if (next % bc) {
+                // Contiguos al anterior, mientras estén libres
+                uint32_t k = 0;
+                pthread_mutex_lock(fs_seg_lock(fs, (int)(next / bc)));
+                BlockManager *bm = fs_bm(fs, (int)(next / bc));
+                while (bm && done + k < b && next % bc + k < bc &&
+                       bm_is_allocated(bm, (int)(next % bc + k)) == 0) {
+                    bm_alloc(bm, (int)(next % bc + k));
+                    k++;
+                }
+                pthread_mutex_unlock(fs_seg_lock(fs, (int)(next / bc)));
+                fs->free_blocks -= k;
+                prev->len += k;
+                done += k;
+                if (done == b) break;
+            }
+            if (np + 2 > sizeof(piece) / sizeof(piece[0])) break;
+            uint64_t left = b - done;
+            int got = 0;
+            int g = fs_alloc_extent(fs, left < bc ? (int)left : (int)bc, &got);
+            if (g < 0) { rc = -1; break; }
+            piece[np++] = (Extent){ (uint32_t)g, (uint32_t)got };
+            done += (uint64_t)got;
+        }
+        if (he > done) piece[np++] = (Extent){ BWFS_HOLE, (uint32_t)(he - done) };
+        if (fm_splice(fm, at, n, piece, np) < 0) {
+            // Sin memoria: se devuelven los bloques que aún no constan
+            for (uint32_t k = 0; k < np; ++k) {
+                if (piece[k].start == BWFS_HOLE) continue;
+                uint32_t keep = (at < i && k == 0) ? fm->ext[at].len : 0;
+                fs_release_run(fs, piece[k].start + keep, piece[k].len - keep);
+            }
+            return -1;
+        }
+        if (at < *from) *from = at;
+        if (rc < 0) return -1;
+        i = at + np - 1;
+        if (done < b) --i;      // Quedó hueco por rellenar en este tramo
+    }
+    return 0;
+}
 
-        // 4.3) Pintar bits en la PBM correspondiente
-        PBMImage *img = fs->images[img_idx];
-        size_t data_off = fs->sb.data_offset;
-        for (size_t bit = 0; bit < to_write * 8; bit++) {
-            size_t bit_idx = data_off
-                           + (size_t)loc * fs->sb.block_size
-                           + bit;
-            int x = bit_idx % img->width;
-            int y = bit_idx / img->width;
-            size_t byte_i = written + (bit / 8);
-            int bit_i = 7 - (bit % 8);
-            int val = (buffer[byte_i] >> bit_i) & 1;
-            pbm_set_pixel(img, x, y, val);
+// Deja con bloque reservado [first, last) (bloques lógicos): lo que queda
+// más allá del final de fm se añade (con un hueco delante si first está más
+// lejos) y lo que cae en huecos se rellena. *from queda en el primer tramo
+// modificado (fm->count si ninguno). Si falla, se deshace el crecimiento.
+// Sólo cambia tramos y bitmaps (bajo meta_lock): no escribe datos.
+static int fs_map_range(FSImage *fs, FileMap *fm, uint64_t first,
+                        uint64_t last, uint32_t *from) {
+    uint64_t have = fm_blocks(fm);
+    *from = fm->count;
+    if (last > have) {
+        *from = fm->count ? fm->count - 1 : 0;
+        if ((first > have && fm_push(fm, BWFS_HOLE, (uint32_t)(first - have)) < 0) ||
+            fs_grow_file(fs, fm, last - (first > have ? first : have)) < 0) {
+            fs_release_tail(fs, fm, have);
+            return -1;
         }
+    }
+    if (first < have && fs_fill_holes(fs, fm, first, last < have ? last : have, from) < 0) {
+        if (last > have) fs_release_tail(fs, fm, have);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t fs_pwrite_locked(FSImage *fs, int idx, const void *buf,
+                                size_t count, off_t off);
 
-        written += to_write;
+ssize_t fs_pwrite(FSImage *fs, const char *name, const void *buf, size_t count,
+                  off_t offset)
+{
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = fs_find(fs, name);
+    ssize_t rc = -1;
+    if (idx >= 0) {
+        pthread_rwlock_wrlock(fs_file_lock(fs, idx));
+        rc = fs_pwrite_locked(fs, idx, buf, count, offset);
+        pthread_rwlock_unlock(fs_file_lock(fs, idx));
     }
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
 
-    // 5) Actualiza tamaño y checksum del archivo
-    e->size = size;
-    uint32_t file_sum = 0;
-    for (size_t i = 0; i < size; i++) {
-        file_sum ^= buffer[i];
+ssize_t fs_pwrite_entry(FSImage *fs, int idx, const void *buf, size_t count,
+                        off_t offset) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_wrlock(fs_file_lock(fs, idx));
+    ssize_t rc = fs_pwrite_locked(fs, idx, buf, count, offset);
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+// XOR de los bytes [offset, offset+len) del archivo (para el checksum)
+static int fs_xor_range(FSImage *fs, const FileMap *fm, uint64_t offset,
+                        size_t len, uint32_t *sum) {
+    uint8_t chunk[4096];
+    while (len > 0) {
+        size_t n = len < sizeof(chunk) ? len : sizeof(chunk);
+        if (fs_file_io(fs, fm, offset, chunk, n, 0) < 0) return -1;
+        for (size_t i = 0; i < n; i++) *sum ^= chunk[i];
+        offset += n;
+        len    -= n;
     }
-    e->checksum = file_sum;
+    return 0;
+}
 
-    // 6) Actualiza checksum del directorio y superbloque
+// Escribe en la entrada idx sobre [offset, offset+count): sólo toca los
+// bloques de ese rango, reserva bloques únicamente para lo que crece el
+// archivo o cae en un hueco (lo que queda entre el final anterior y offset
+// pasa a ser hueco) y ajusta el checksum con los bytes sustituidos. Con
+// ns_lock (lectura) y el cerrojo del archivo (escritura); tramos, bitmaps y
+// entrada cambian bajo meta_lock, y los datos se escriben sin él.
+static ssize_t fs_pwrite_locked(FSImage *fs, int idx, const void *buf,
+                                size_t count, off_t off) {
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    if (!e || !e->used || e->is_dir || off < 0) return -1;
+    if (count == 0) return 0;
+    uint64_t offset = (uint64_t)off, end = offset + count;
+    if (end > fs_max_file_bytes(fs)) return -1;
+    pthread_mutex_lock(&fs->meta_lock);
+    FileMap *fm = fs_file_map(fs, idx);
+    pthread_mutex_unlock(&fs->meta_lock);
+    if (!fm) return -2;
+
+    size_t   block_bytes = fs->sb.block_size / 8;
+    uint64_t size = e->size, have = fm_blocks(fm);
+    uint64_t need = (end + block_bytes - 1) / block_bytes;
+    uint32_t from;  // Primer tramo que cambia
+
+    // 1) Checksum: fuera los bytes sustituidos (el resto del archivo no se
+    //    lee), antes de reservar: lo que era hueco aún se lee como ceros
+    uint32_t sum = e->checksum;
+    if (offset < size &&
+        fs_xor_range(fs, fm, offset, (size_t)((end < size ? end : size) - offset), &sum) < 0)
+        return -2;
+
+    // 2) Bloques nuevos sólo para lo que crece el archivo o estaba en hueco;
+    //    los que sustituyen a huecos valen cero fuera de lo que se escribe
+    FsRange *holes;
+    uint32_t nholes;
+    if (fs_holes(fs, fm, offset / block_bytes, need < have ? need : have,
+                 &holes, &nholes) < 0)
+        return -2;
+    pthread_mutex_lock(&fs->meta_lock);
+    fs_seq_begin(fs_entry_seq(fs, idx));
+    int mapped = fs_map_range(fs, fm, offset / block_bytes, need, &from);
+    if (mapped < 0 && from < fm->count) fs_store_file_map(fs, idx, fm, from);
+    fs_seq_end(fs_entry_seq(fs, idx));
+    pthread_mutex_unlock(&fs->meta_lock);
+    int zeroed = fs_zero_holes(fs, fm, holes, nholes, offset, end);
+    free(holes);
+    if (mapped < 0) return -3;
+    if (zeroed < 0) goto fail;
+
+    // 3) Un hueco entre el final anterior y offset se rellena con ceros
+    if (fs_zero_range(fs, fm, size, offset) < 0) goto fail;
+
+    // 4) Datos nuevos
+    if (fs_file_io(fs, fm, offset, (void *)buf, count, 1) < 0) goto fail;
+    const uint8_t *p = buf;
+    for (size_t i = 0; i < count; i++) sum ^= p[i];
+
+    // 5) Metadatos: sólo los tramos añadidos, alargados o rellenados
+    pthread_mutex_lock(&fs->meta_lock);
+    fs_seq_begin(fs_entry_seq(fs, idx));
+    ssize_t rc = (ssize_t)count;
+    if (from < fm->count && fs_store_file_map(fs, idx, fm, from) < 0) {
+        fs_release_tail(fs, fm, have);
+        rc = -3;
+    } else {
+        DirEntry me = *dir_entry(&fs->dir, idx);
+        if (end > size) me.size = (uint32_t)end;
+        me.checksum = sum;
+        dir_entry_put(&fs->dir, idx, &me);
+        fs->meta_dirty = 1;
+        fs_update_checksums(fs);
+    }
+    fs_seq_end(fs_entry_seq(fs, idx));
+    pthread_mutex_unlock(&fs->meta_lock);
+    return rc;
+
+fail:
+    pthread_mutex_lock(&fs->meta_lock);
+    fs_seq_begin(fs_entry_seq(fs, idx));
+    if (need > have) fs_release_tail(fs, fm, have);
+    if (from < fm->count) fs_store_file_map(fs, idx, fm, from);
+    fs_seq_end(fs_entry_seq(fs, idx));
+    pthread_mutex_unlock(&fs->meta_lock);
+    return -2;
+}
+
+
+// Primer tramo de fm que cambia si se recorta o se alarga desde el bloque keep
+static uint32_t fs_first_changed(const FileMap *fm, uint64_t keep) {
+    uint32_t i = 0;
+    while (i < fm->count && fm->end[i] <= keep) i++;
+    return i == fm->count && i > 0 ? i - 1 : i;
+}
+
+// Fija el tamaño de la entrada idx: al encoger se liberan los bloques que
+// quedan fuera (también los preasignados) y lo que crece es un hueco.
+// El checksum se ajusta sólo con los bytes que salen. Con ns_lock (lectura)
+// y el cerrojo del archivo (escritura); como en fs_pwrite_locked, meta_lock
+// sólo cubre tramos, bitmaps y entrada.
+static int fs_truncate_locked(FSImage *fs, int idx, off_t length) {
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    if (!e || !e->used) return -ENOENT;
+    if (e->is_dir) return -EISDIR;
+    if (length < 0) return -EINVAL;
+    if ((uint64_t)length > fs_max_file_bytes(fs)) return -EFBIG;
+    pthread_mutex_lock(&fs->meta_lock);
+    FileMap *fm = fs_file_map(fs, idx);
+    pthread_mutex_unlock(&fs->meta_lock);
+    if (!fm) return -EIO;
+
+    size_t   block_bytes = fs->sb.block_size / 8;
+    uint64_t size = e->size, len = (uint64_t)length, have = fm_blocks(fm);
+    uint64_t need = (len + block_bytes - 1) / block_bytes;
+    uint32_t sum  = e->checksum;
+    if (len < size && fs_xor_range(fs, fm, len, (size_t)(size - len), &sum) < 0)
+        return -EIO;
+    // La cola del último bloque (o lo preasignado) deja de ser basura; lo
+    // que crece más allá es hueco y ya vale cero
+    uint64_t mapped = have * block_bytes;
+    if (len > size && size < mapped &&
+        fs_zero_range(fs, fm, size, len < mapped ? len : mapped) < 0)
+        return -EIO;
+
+    pthread_mutex_lock(&fs->meta_lock);
+    fs_seq_begin(fs_entry_seq(fs, idx));
+    int rc = 0;
+    uint32_t from = fs_first_changed(fm, need < have ? need : have);
+    if (need < have) {
+        fs_release_tail(fs, fm, need);
+    } else if (need > have && fm_push(fm, BWFS_HOLE, (uint32_t)(need - have)) < 0) {
+        rc = -ENOMEM;
+    }
+    if (rc == 0 && need != have && fs_store_file_map(fs, idx, fm, from) < 0) {
+        if (need > have) fs_release_tail(fs, fm, have);
+        rc = -ENOSPC;
+    }
+    if (rc == 0) {
+        DirEntry me = *dir_entry(&fs->dir, idx);
+        me.size     = (uint32_t)len;
+        me.checksum = sum;
+        dir_entry_put(&fs->dir, idx, &me);
+        fs->meta_dirty = 1;
+        fs_update_checksums(fs);
+    }
+    fs_seq_end(fs_entry_seq(fs, idx));
+    pthread_mutex_unlock(&fs->meta_lock);
+    return rc;
+}
+
+int fs_truncate_entry(FSImage *fs, int idx, off_t length) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_wrlock(fs_file_lock(fs, idx));
+    int rc = fs_truncate_locked(fs, idx, length);
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+int fs_truncate(FSImage *fs, const char *name, off_t length) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = fs_find(fs, name), rc = -ENOENT;
+    if (idx >= 0) {
+        pthread_rwlock_wrlock(fs_file_lock(fs, idx));
+        rc = fs_truncate_locked(fs, idx, length);
+        pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    }
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+// Reserva de una vez los bloques que cubren [offset, offset+length) (los
+// huecos del rango se rellenan) para que las escrituras posteriores en ese
+// rango no tengan que asignar. Sin keep_size el archivo crece hasta
+// offset+length (a ceros). Con los mismos cerrojos que fs_truncate_locked.
+static int fs_fallocate_locked(FSImage *fs, int idx, int keep_size, off_t offset,
+                               off_t length) {
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    if (!e || !e->used) return -ENOENT;
+    if (e->is_dir) return -EISDIR;
+    if (offset < 0 || length <= 0) return -EINVAL;
+    uint64_t end = (uint64_t)offset + (uint64_t)length;
+    if (end > fs_max_file_bytes(fs)) return -EFBIG;
+    pthread_mutex_lock(&fs->meta_lock);
+    FileMap *fm = fs_file_map(fs, idx);
+    pthread_mutex_unlock(&fs->meta_lock);
+    if (!fm) return -EIO;
+
+    size_t   block_bytes = fs->sb.block_size / 8;
+    uint64_t size = e->size, have = fm_blocks(fm);
+    uint64_t need = (end + block_bytes - 1) / block_bytes;
+    uint64_t first = (uint64_t)offset / block_bytes;
+    uint32_t from;
+    FsRange *holes;
+    uint32_t nholes;
+    if (fs_holes(fs, fm, first, need < have ? need : have, &holes, &nholes) < 0)
+        return -ENOMEM;
+
+    // 1) Tramos y bitmaps
+    pthread_mutex_lock(&fs->meta_lock);
+    fs_seq_begin(fs_entry_seq(fs, idx));
+    int rc = fs_map_range(fs, fm, first, need, &from);
+    if (from < fm->count) {
+        if (fs_store_file_map(fs, idx, fm, from) < 0) {
+            if (need > have) fs_release_tail(fs, fm, have);
+            rc = -1;
+        }
+        fs->meta_dirty = 1;
+        fs_update_checksums(fs);
+    }
+    fs_seq_end(fs_entry_seq(fs, idx));
+    pthread_mutex_unlock(&fs->meta_lock);
+
+    // 2) Ceros fuera de meta_lock: los huecos rellenados y lo que crece
+    int grow = !keep_size && end > size;
+    int zeroed = fs_zero_holes(fs, fm, holes, nholes,
+                               grow ? size : end, end);
+    free(holes);
+    if (rc < 0) return -ENOSPC;
+    if (zeroed < 0) return -EIO;
+    if (!grow) return 0;
+    if (fs_zero_range(fs, fm, size, end) < 0) return -EIO;
+
+    // 3) Nuevo tamaño
+    pthread_mutex_lock(&fs->meta_lock);
+    fs_seq_begin(fs_entry_seq(fs, idx));
+    DirEntry me = *dir_entry(&fs->dir, idx);
+    me.size = (uint32_t)end;
+    dir_entry_put(&fs->dir, idx, &me);
+    fs->meta_dirty = 1;
     fs_update_checksums(fs);
+    fs_seq_end(fs_entry_seq(fs, idx));
+    pthread_mutex_unlock(&fs->meta_lock);
+    return 0;
+}
 
-    return (ssize_t)written;
+int fs_fallocate_entry(FSImage *fs, int idx, int keep_size, off_t offset,
+                       off_t length) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_wrlock(fs_file_lock(fs, idx));
+    int rc = fs_fallocate_locked(fs, idx, keep_size, offset, length);
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
 }
 
+int fs_fallocate(FSImage *fs, const char *name, int keep_size, off_t offset,
+                 off_t length) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = fs_find(fs, name), rc = -ENOENT;
+    if (idx >= 0) {
+        pthread_rwlock_wrlock(fs_file_lock(fs, idx));
+        rc = fs_fallocate_locked(fs, idx, keep_size, offset, length);
+        pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    }
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+static ssize_t fs_pread_locked(FSImage *fs, int idx, void *buf, size_t count,
+                               off_t off);
 
 ssize_t fs_read_file(FSImage *fs,
                      const char *filename,
                      void *buf,
                      size_t size)
 {
-    // 1) Busca la entrada
-    int idx = dir_find(&fs->dir, filename);
+    return fs_pread(fs, filename, buf, size, 0);
+}
+
+ssize_t fs_pread(FSImage *fs, const char *name, void *buf, size_t count,
+                 off_t offset)
+{
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = fs_find(fs, name);
+    ssize_t rc = -1;
+    if (idx >= 0) {
+        pthread_rwlock_rdlock(fs_file_lock(fs, idx));
+        rc = fs_pread_locked(fs, idx, buf, count, offset);
+        pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    }
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+ssize_t fs_pread_entry(FSImage *fs, int idx, void *buf, size_t count,
+                       off_t off) {
+    if (idx < 0) return -1;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_rdlock(fs_file_lock(fs, idx));
+    ssize_t rc = fs_pread_locked(fs, idx, buf, count, off);
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+// Lee de la entrada idx (sin resolver ruta): traduce el offset al bloque
+// lógico que lo cubre y copia sólo los tramos que tocan [offset, offset+count).
+// El llamador sostiene el cerrojo del archivo (al menos en lectura).
+static ssize_t fs_pread_locked(FSImage *fs, int idx, void *buf, size_t count,
+                               off_t off) {
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    if (!e || !e->used || off < 0) return -1;
+    pthread_mutex_lock(&fs->meta_lock);
+    FileMap *fm = fs_file_map(fs, idx);
+    pthread_mutex_unlock(&fs->meta_lock);
+    if (!fm) return -2;
+    uint64_t offset = (uint64_t)off;
+
+    // 1) No leer más allá del final del archivo
+    if (offset >= e->size) return 0;
+    if (count > e->size - offset) count = (size_t)(e->size - offset);
+
+    // 2) Cada bloque lógico se traduce por búsqueda binaria en los tramos
+    if (fs_file_io(fs, fm, offset, buf, count, 0) < 0) {
+        printf("Read failed in file '%s'\n", e->name);
+        return -2;
+    }
+    return (ssize_t)count;
+}
+
+int fs_open(FSImage *fs, const char *name) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = fs_find(fs, name);
+    if (idx < 0) idx = -ENOENT;
+    else if (dir_entry(&fs->dir, idx)->is_dir) idx = -EISDIR;
+    else {
+        // Los tramos quedan en memoria para las E/S del descriptor
+        pthread_mutex_lock(&fs->meta_lock);
+        if (!fs_file_map(fs, idx)) idx = -EIO;
+        pthread_mutex_unlock(&fs->meta_lock);
+    }
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return idx;
+}
+
+static int fs_readahead_locked(FSImage *fs, int idx, off_t off, size_t count) {
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    if (!e || !e->used || e->is_dir || off < 0) return -1;
+    if (fs->bcache.nslots == 0 || (uint64_t)off >= e->size) return 0;
+    pthread_mutex_lock(&fs->meta_lock);
+    FileMap *fm = fs_file_map(fs, idx);
+    pthread_mutex_unlock(&fs->meta_lock);
+    if (!fm) return -1;
+
+    // Como mucho media caché, para no expulsar lo que se acaba de leer
+    size_t   block_bytes = fs->sb.block_size / 8;
+    uint64_t first = (uint64_t)off / block_bytes;
+    uint64_t last  = ((uint64_t)off + count < e->size ? (uint64_t)off + count
+                                                       : e->size) - 1;
+    last /= block_bytes;
+    uint32_t half = fs->bcache.nslots > 1 ? fs->bcache.nslots / 2 : 1;
+    if (last - first >= half) last = first + half - 1;
+    int loaded = 0;
+    for (uint64_t b = first; b <= last; ++b) {
+        int64_t g = fm_lookup(fm, b, NULL);
+        if (g == FM_HOLE) continue;
+        if (g < 0) return -1;
+        pthread_mutex_lock(&fs->bc_lock);
+        uint8_t *blk = bc_get(&fs->bcache, (uint32_t)g, 0, 0);
+        pthread_mutex_unlock(&fs->bc_lock);
+        if (!blk) return -1;
+        loaded++;
+    }
+    return loaded;
+}
+
+int fs_readahead(FSImage *fs, int idx, off_t off, size_t count) {
     if (idx < 0) return -1;
-    DirEntry *e = dir_entry_mut(&fs->dir, idx);
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_rdlock(fs_file_lock(fs, idx));
+    int rc = fs_readahead_locked(fs, idx, off, count);
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
 
-    // 2) No leer más de lo que pide el usuario
-    size_t to_read_total = (size < e->size) ? size : e->size;
-    uint8_t *buffer = (uint8_t *)buf;
-    memset(buffer, 0, to_read_total);
+// Trozos de ceros para los huecos de fs_pread_vec
+static const uint8_t fs_zeros[64 * 1024];
+
+static int fs_vec_push(FSReadVec *v, const void *data, size_t len) {
+    FSIoChunk *last = v->count ? &v->chunks[v->count - 1] : NULL;
+    if (last && data != fs_zeros &&
+        (const uint8_t *)last->data + last->len == (const uint8_t *)data) {
+        last->len += len;
+        return 0;
+    }
+    if (v->max_chunks && v->count >= v->max_chunks) return -1;
+    if (v->count == v->cap) {
+        int cap = v->cap ? v->cap * 2 : 16;
+        FSIoChunk *c = realloc(v->chunks, sizeof(*c) * (size_t)cap);
+        if (!c) return -1;
+        v->chunks = c;
+        v->cap    = cap;
+    }
+    v->chunks[v->count].data = data;
+    v->chunks[v->count].len  = len;
+    v->count++;
+    return 0;
+}
+
+// Apunta el bloque g (caché) o el segmento seg (sin caché) para soltarlo en
+// fs_pread_vec_release: los segmentos se guardan como -(seg + 1)
+static int fs_vec_pin(FSReadVec *v, int64_t key) {
+    if (v->npins == v->pins_cap) {
+        int cap = v->pins_cap ? v->pins_cap * 2 : 16;
+        int64_t *p = realloc(v->pins, sizeof(*p) * (size_t)cap);
+        if (!p) return -1;
+        v->pins     = p;
+        v->pins_cap = cap;
+    }
+    v->pins[v->npins++] = key;
+    return 0;
+}
+
+// Segmento seg residente y referenciado (no se expulsa hasta soltarlo)
+static PBMImage *fs_segment_ref(FSImage *fs, int seg) {
+    pthread_mutex_lock(fs_seg_lock(fs, seg));
+    PBMImage *img = fs_segment(fs, seg);
+    if (img) {
+        pthread_mutex_lock(&fs->seg_cache_lock);
+        fs->seg_refs[seg]++;
+        pthread_mutex_unlock(&fs->seg_cache_lock);
+    }
+    pthread_mutex_unlock(fs_seg_lock(fs, seg));
+    return img;
+}
+
+static void fs_vec_unpin(FSImage *fs, FSReadVec *v) {
+    for (int i = 0; i < v->npins; ++i) {
+        if (v->pins[i] >= 0) {
+            pthread_mutex_lock(&fs->bc_lock);
+            bc_unpin(&fs->bcache, (uint32_t)v->pins[i]);
+            pthread_mutex_unlock(&fs->bc_lock);
+        } else {
+            pthread_mutex_lock(&fs->seg_cache_lock);
+            fs->seg_refs[-(v->pins[i] + 1)]--;
+            pthread_mutex_unlock(&fs->seg_cache_lock);
+        }
+    }
+    v->npins = 0;
+}
 
-    // 3) Parámetros
+// Como fs_file_io en lectura, pero dejando en v punteros en vez de copiar
+static int fs_file_vec(FSImage *fs, const FileMap *fm, uint64_t offset,
+                       size_t len, FSReadVec *v) {
     size_t block_bytes = fs->sb.block_size / 8;
-    size_t read_bytes  = 0;
-
-    // 4) Recorre cada bloque asignado
-    for (uint32_t i = 0; i < e->block_count && read_bytes < to_read_total; i++) {
-        int g = e->blocks[i];
-        int img_idx = g / fs->sb.block_count;
-        uint32_t loc = g % fs->sb.block_count;
-
-        // Validación simple
-        if (img_idx < 0 || img_idx >= fs->image_count) {
-            printf("Invalid image index %d in file '%s'\n",
-                   img_idx, e->name);
-            return -2;
-        }
-
-        PBMImage *img = fs->images[img_idx];
-        size_t data_off = fs->sb.data_offset;
-        size_t this_read = (to_read_total - read_bytes < block_bytes)
-                             ? (to_read_total - read_bytes)
-                             : block_bytes;
-
-        // 5) Bit a bit desde la imagen PBM
-        for (size_t bit = 0; bit < this_read * 8; bit++) {
-            size_t bit_idx = data_off
-                           + (size_t)loc * fs->sb.block_size
-                           + bit;
-            int x = bit_idx % img->width;
-            int y = bit_idx / img->width;
-            int v = pbm_get_pixel(img, x, y);
-            if (v < 0) {
-                printf("Error reading bit at (%d,%d)\n", x, y);
-                return -2;
+    int    cached      = fs->bcache.nslots != 0;
+    int    last_seg    = -1;
+    // Sin caché sólo se puede apuntar a los bits con bloques alineados a byte
+    if (!cached && !fs->aligned) return -1;
+
+    while (len > 0) {
+        size_t   in = (size_t)(offset % block_bytes);
+        uint32_t run;
+        int64_t  g = fm_lookup(fm, offset / block_bytes, &run);
+        if (g == FM_HOLE) {
+            size_t n = run * block_bytes - in;
+            if (n > len) n = len;
+            if (n > sizeof(fs_zeros)) n = sizeof(fs_zeros);
+            if (fs_vec_push(v, fs_zeros, n) < 0) return -1;
+            offset += n; len -= n;
+            continue;
+        }
+        if (g < 0) return -1;
+        if (cached) {
+            size_t n = block_bytes - in < len ? block_bytes - in : len;
+            pthread_mutex_lock(&fs->bc_lock);
+            const uint8_t *blk = bc_pin(&fs->bcache, (uint32_t)g);
+            pthread_mutex_unlock(&fs->bc_lock);
+            if (!blk) return -1;
+            if (fs_vec_pin(v, g) < 0) {
+                pthread_mutex_lock(&fs->bc_lock);
+                bc_unpin(&fs->bcache, (uint32_t)g);
+                pthread_mutex_unlock(&fs->bc_lock);
+                return -1;
+            }
+            if (fs_vec_push(v, blk + in, n) < 0) return -1;
+            offset += n; len -= n;
+            continue;
+        }
+        // El tramo entero de una vez, sin salirse de su segmento
+        int      seg    = (int)(g / fs->sb.block_count);
+        uint32_t in_seg = (uint32_t)(g % fs->sb.block_count);
+        if (run > fs->sb.block_count - in_seg) run = fs->sb.block_count - in_seg;
+        PBMImage *img = NULL;
+        if (seg != last_seg) {
+            img = fs_segment_ref(fs, seg);
+            if (!img) return -1;
+            if (fs_vec_pin(v, -(int64_t)seg - 1) < 0) {
+                pthread_mutex_lock(&fs->seg_cache_lock);
+                fs->seg_refs[seg]--;
+                pthread_mutex_unlock(&fs->seg_cache_lock);
+                return -1;
             }
-            size_t byte_i = read_bytes + (bit / 8);
-            int bit_i = 7 - (bit % 8);
-            buffer[byte_i] |= (v << bit_i);
+            last_seg = seg;
+        } else {
+            pthread_mutex_lock(&fs->seg_cache_lock);
+            img = fs->images[seg];
+            pthread_mutex_unlock(&fs->seg_cache_lock);
         }
+        size_t n   = run * block_bytes - in;
+        if (n > len) n = len;
+        size_t bit = fs->sb.data_offset + (size_t)in_seg * fs->sb.block_size + in * 8;
+        if (bit % 8 || bit / 8 + n > img->stride_bytes * img->height) return -1;
+        if (fs_vec_push(v, img->bits + bit / 8, n) < 0) return -1;
+        offset += n; len -= n;
+    }
+    return 0;
+}
+
+// Vacía v conservando el límite de trozos del llamador
+static void fs_vec_reset(FSReadVec *v) {
+    int max_chunks = v->max_chunks;
+    free(v->chunks);
+    free(v->pins);
+    memset(v, 0, sizeof(*v));
+    v->max_chunks = max_chunks;
+    v->idx        = -1;
+}
 
-        read_bytes += this_read;
+ssize_t fs_pread_vec(FSImage *fs, int idx, size_t count, off_t off,
+                     FSReadVec *v) {
+    v->chunks = NULL;
+    v->pins   = NULL;
+    fs_vec_reset(v);
+    if (idx < 0 || off < 0) return -1;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_rdlock(fs_file_lock(fs, idx));
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    FileMap *fm = NULL;
+    if (e && e->used && !e->is_dir) {
+        pthread_mutex_lock(&fs->meta_lock);
+        fm = fs_file_map(fs, idx);
+        pthread_mutex_unlock(&fs->meta_lock);
     }
+    ssize_t rc = -1;
+    if (fm) {
+        uint64_t offset = (uint64_t)off;
+        if (offset >= e->size) count = 0;
+        else if (count > e->size - offset) count = (size_t)(e->size - offset);
+        if (fs_file_vec(fs, fm, offset, count, v) == 0) rc = (ssize_t)count;
+    }
+    if (rc >= 0) {
+        // Los cerrojos siguen tomados hasta fs_pread_vec_release
+        v->idx = idx;
+        v->len = (size_t)rc;
+        return rc;
+    }
+    fs_vec_unpin(fs, v);
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    fs_vec_reset(v);
+    return -1;
+}
 
-    return (ssize_t)read_bytes;
+void fs_pread_vec_release(FSImage *fs, FSReadVec *v) {
+    if (v->idx >= 0) {
+        fs_vec_unpin(fs, v);
+        pthread_rwlock_unlock(fs_file_lock(fs, v->idx));
+        pthread_rwlock_unlock(&fs->ns_lock);
+    }
+    fs_vec_reset(v);
 }
 
-int fs_mkdir(FSImage *fs, const char *dirname) {
+static off_t fs_seek_data_locked(FSImage *fs, int idx, off_t off, int hole) {
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    if (!e || !e->used) return -ENOENT;
+    if (off < 0 || (uint64_t)off >= e->size) return -ENXIO;
+    pthread_mutex_lock(&fs->meta_lock);
+    FileMap *fm = fs_file_map(fs, idx);
+    pthread_mutex_unlock(&fs->meta_lock);
+    if (!fm) return -EIO;
+
+    // Tramo a tramo desde el bloque de off; el final del archivo cuenta
+    // como hueco
+    size_t   block_bytes = fs->sb.block_size / 8;
+    uint64_t pos = (uint64_t)off;
+    for (uint64_t b = pos / block_bytes; b * block_bytes < e->size; ) {
+        uint32_t run = 0;
+        int64_t  g   = fm_lookup(fm, b, &run);
+        if ((g < 0) == (hole != 0)) {
+            uint64_t at = b * block_bytes > pos ? b * block_bytes : pos;
+            return (off_t)at;
+        }
+        if (g == -1) break;
+        b += run;
+    }
+    return hole ? (off_t)e->size : -ENXIO;
+}
+
+off_t fs_seek_data(FSImage *fs, int idx, off_t off, int hole) {
+    if (idx < 0) return -ENOENT;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_rdlock(fs_file_lock(fs, idx));
+    off_t rc = fs_seek_data_locked(fs, idx, off, hole);
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+static int fs_mkdir_locked(FSImage *fs, const char *dirname) {
     int rc = dir_mkdir(&fs->dir, dirname);
-    if (rc < 0) return -ENOSPC;
+    if (rc < 0 && fs->dir.free_entries == 0 && fs_dir_grow(fs) == 0)
+        rc = dir_mkdir(&fs->dir, dirname);
+    if (rc < 0) {
+        if (dir_find(&fs->dir, dirname) >= 0) return -EEXIST;
+        return fs->dir.free_entries ? -ENOENT : -ENOSPC;
+    }
+    fs->meta_dirty = 1;
     fs_update_checksums(fs);
     return 0;
 }
 
+int fs_mkdir(FSImage *fs, const char *dirname) {
+    fs_ns_write_lock(fs);
+    int rc = fs_mkdir_locked(fs, dirname);
+    fs_ns_write_unlock(fs);
+    return rc;
+}
+
+static int fs_rmdir_locked(FSImage *fs, const char *dirname) {
+    int idx = dir_find(&fs->dir, dirname);
+    if (idx < 0) return -ENOENT;
+    if (!dir_entry(&fs->dir, idx)->is_dir) return -ENOTDIR;
+    return fs_remove_entry(fs, dirname);
+}
+
 int fs_rmdir(FSImage *fs, const char *dirname) {
-    int rc = dir_remove(&fs->dir, dirname);
-    if (rc < 0) return -ENOENT;
-    fs_update_checksums(fs);
-    return 0;
+    fs_ns_write_lock(fs);
+    int rc = fs_rmdir_locked(fs, dirname);
+    fs_ns_write_unlock(fs);
+    return rc;
 }
 
-int fs_rename(FSImage *fs, const char *oldname, const char *newname) {
+static int fs_rename_locked(FSImage *fs, const char *oldname, const char *newname) {
     int rc = dir_rename(&fs->dir, oldname, newname);
-    if (rc < 0) return -EEXIST;
+    if (rc < 0) return dir_find(&fs->dir, oldname) < 0 ? -ENOENT : -EEXIST;
+    fs->meta_dirty = 1;
     fs_update_checksums(fs);
     return 0;
 }
 
+int fs_rename(FSImage *fs, const char *oldname, const char *newname) {
+    fs_ns_write_lock(fs);
+    int rc = fs_rename_locked(fs, oldname, newname);
+    fs_ns_write_unlock(fs);
+    return rc;
+}
+
+int fs_ref(FSImage *fs, int idx, uint16_t generation) {
+    if (idx < 0) return -ENOENT;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_mutex_lock(&fs->meta_lock);
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    int rc = (e && e->used && e->generation == generation) ? 0 : -ENOENT;
+    if (rc == 0 && (uint32_t)idx >= fs->refs_cap) {
+        uint32_t cap = fs->refs_cap ? fs->refs_cap : 64;
+        while (cap <= (uint32_t)idx) cap *= 2;
+        uint32_t *r = realloc(fs->refs, sizeof(*r) * cap);
+        if (!r) rc = -ENOMEM;
+        else {
+            memset(r + fs->refs_cap, 0, sizeof(*r) * (cap - fs->refs_cap));
+            fs->refs     = r;
+            fs->refs_cap = cap;
+        }
+    }
+    if (rc == 0) fs->refs[idx]++;
+    pthread_mutex_unlock(&fs->meta_lock);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+int fs_unref(FSImage *fs, int idx, uint64_t n) {
+    if (idx < 0) return -1;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_mutex_lock(&fs->meta_lock);
+    int rc = -1, last = 0;
+    if ((uint32_t)idx < fs->refs_cap && fs->refs[idx] >= n) {
+        fs->refs[idx] -= (uint32_t)n;
+        last = fs->refs[idx] == 0;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&fs->meta_lock);
+    last = last && dir_parent(&fs->dir, idx) == BWFS_DIR_ORPHAN;
+    pthread_rwlock_unlock(&fs->ns_lock);
+
+    // Última referencia de una huérfana: se libera (si nadie volvió a
+    // tomarla mientras no había cerrojo)
+    if (last) {
+        fs_ns_write_lock(fs);
+        if (fs_refs(fs, idx) == 0) fs_release_orphan(fs, idx);
+        fs_ns_write_unlock(fs);
+    }
+    return rc;
+}
+
 int fs_access(FSImage *fs, const char *name, int mask) {
     (void)mask;
-    return (dir_find(&fs->dir, name) >= 0) ? 0 : -ENOENT;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = fs_find(fs, name);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return idx >= 0 ? 0 : -ENOENT;
+}
+
+// Lecturas sin cerrojo: se toma una vista del directorio con ns_seq par y se
+// valida antes de usarla (dir_grow no libera lo que la vista apunta); los
+// datos leídos valen si ns_seq no cambió. Tras FS_SEQ_TRIES choques con
+// escritores se recurre a los cerrojos.
+static int fs_view(FSImage *fs, DirView *v, unsigned *ns) {
+    *ns = fs_seq_read(&fs->ns_seq);
+    if (*ns & 1) return -1;
+    dir_view(&fs->dir, v);
+    return fs_seq_retry(&fs->ns_seq, *ns) ? -1 : 0;
+}
+
+// Copia la entrada idx de la vista validando su grupo de entry_seq;
+// -1 si choca demasiadas veces con un escritor
+static int fs_copy_entry(FSImage *fs, const DirView *v, int idx, DirEntry *out) {
+    atomic_uint *es = fs_entry_seq(fs, idx);
+    for (int t = 0; dir_view_entry(v, idx) && t < FS_SEQ_TRIES; ++t) {
+        unsigned s = fs_seq_read(es);
+        if (s & 1) continue;
+        dir_view_copy(v, idx, out);
+        if (!fs_seq_retry(es, s)) return 0;
+    }
+    return -1;
+}
+
+int fs_lookup(FSImage *fs, const char *path) {
+    DirView  v;
+    unsigned ns;
+    for (int t = 0; t < FS_SEQ_TRIES; ++t) {
+        if (fs_view(fs, &v, &ns) < 0) continue;
+        int idx = dir_view_walk(&v, path);
+        if (!fs_seq_retry(&fs->ns_seq, ns)) return idx >= 0 ? idx : -ENOENT;
+    }
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = fs_find(fs, path);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return idx >= 0 ? idx : -ENOENT;
+}
+
+int fs_lookup_at(FSImage *fs, int parent, const char *name) {
+    DirView  v;
+    unsigned ns;
+    for (int t = 0; t < FS_SEQ_TRIES; ++t) {
+        if (fs_view(fs, &v, &ns) < 0) continue;
+        int idx = dir_view_lookup(&v, parent, name);
+        if (!fs_seq_retry(&fs->ns_seq, ns)) return idx >= 0 ? idx : -ENOENT;
+    }
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int idx = dir_lookup(&fs->dir, parent, name);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return idx >= 0 ? idx : -ENOENT;
+}
+
+int fs_stat(FSImage *fs, int idx, DirEntry *out) {
+    if (idx < 0) return -ENOENT;
+    DirView  v;
+    unsigned ns;
+    for (int t = 0; t < FS_SEQ_TRIES; ++t) {
+        if (fs_view(fs, &v, &ns) < 0) continue;
+        if (!dir_view_entry(&v, idx)) {
+            if (fs_seq_retry(&fs->ns_seq, ns)) continue;
+            return -ENOENT;
+        }
+        if (fs_copy_entry(fs, &v, idx, out) < 0) break;
+        if (!fs_seq_retry(&fs->ns_seq, ns)) return out->used ? 0 : -ENOENT;
+    }
+
+    // Con cerrojos: tamaño y tramos sólo cambian con el del archivo en escritura
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_rwlock_rdlock(fs_file_lock(fs, idx));
+    dir_view(&fs->dir, &v);
+    int rc = (dir_view_copy(&v, idx, out) == 0 && out->used) ? 0 : -ENOENT;
+    pthread_rwlock_unlock(fs_file_lock(fs, idx));
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return rc;
+}
+
+// Sin cerrojo, los hijos (y sus índices en idxs) se copian a un arreglo y
+// fill sólo los ve una vez validada la lista completa
+static DirEntry *fs_list_fast(FSImage *fs, int parent, uint32_t *count,
+                              int **idxs) {
+    DirEntry *ents = NULL;
+    int      *ids  = NULL;
+    uint32_t  cap  = 0;
+    DirView   v;
+    unsigned  ns;
+    for (int t = 0; t < FS_SEQ_TRIES; ++t) {
+        if (fs_view(fs, &v, &ns) < 0) continue;
+        uint32_t n = 0, steps = 0;
+        int i;
+        for (i = dir_view_first_child(&v, parent); i >= 0 && steps++ < v.max_entries;
+             i = dir_view_next_sibling(&v, i)) {
+            if (n == cap) {
+                uint32_t c = cap ? 2 * cap : 32;
+                DirEntry *p = realloc(ents, c * sizeof(DirEntry));
+                if (p) ents = p;
+                int *q = p ? realloc(ids, c * sizeof(int)) : NULL;
+                if (!q) break;
+                ids = q, cap = c;
+            }
+            if (fs_copy_entry(fs, &v, i, &ents[n]) < 0) break;
+            ids[n++] = i;
+        }
+        if (fs_seq_retry(&fs->ns_seq, ns)) continue;
+        if (i >= 0) break;  // Sin memoria o choques con un escritor
+        if (!ents) ents = malloc(sizeof(DirEntry));
+        if (!ents) break;
+        *count = n;
+        *idxs  = ids;
+        return ents;
+    }
+    free(ents);
+    free(ids);
+    return NULL;
+}
+
+int fs_list_dir(FSImage *fs, int parent,
+                int (*fill)(void *ctx, int idx, const DirEntry *e), void *ctx) {
+    uint32_t  n;
+    int      *ids  = NULL;
+    DirEntry *ents = fs_list_fast(fs, parent, &n, &ids);
+    if (ents) {
+        for (uint32_t k = 0; k < n && fill(ctx, ids[k], &ents[k]) == 0; ++k) {}
+        free(ents);
+        free(ids);
+        return 0;
+    }
+    // Los tamaños pueden cambiar bajo el cerrojo de cada archivo: se copian
+    DirView  v;
+    DirEntry e;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    dir_view(&fs->dir, &v);
+    for (int i = dir_first_child(&fs->dir, parent); i >= 0;
+         i = dir_next_sibling(&fs->dir, i)) {
+        dir_view_copy(&v, i, &e);
+        if (fill(ctx, i, &e) != 0) break;
+    }
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return 0;
+}
+
+int fs_path(FSImage *fs, int idx, char *buf, size_t size) {
+    if (size == 0) return -ENAMETOOLONG;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    // De la hoja a la raíz, escribiendo desde el final de buf
+    size_t pos = size - 1;
+    int    rc  = 0, depth = 0;
+    buf[pos] = '\0';
+    for (int i = idx; i != BWFS_DIR_ROOT && rc == 0; i = dir_parent(&fs->dir, i)) {
+        const DirEntry *e = dir_entry(&fs->dir, i);
+        size_t len = e ? strnlen(e->name, BWFS_FILENAME_MAXLEN) : 0;
+        if (!e || !e->used || ++depth > (int)fs->dir.max_entries) rc = -ENOENT;
+        else if (len + (i != idx) > pos) rc = -ENAMETOOLONG;
+        else {
+            if (i != idx) buf[--pos] = '/';
+            pos -= len;
+            memcpy(buf + pos, e->name, len);
+        }
+    }
+    pthread_rwlock_unlock(&fs->ns_lock);
+    if (rc == 0) memmove(buf, buf + pos, size - pos);
+    return rc;
 }
 
 int fs_statfs(FSImage *fs, struct statvfs *st) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    pthread_mutex_lock(&fs->meta_lock);
     size_t bsz = fs->sb.block_size / 8;
     st->f_bsize   = bsz;
     st->f_frsize  = bsz;
     st->f_blocks  = fs->image_count * fs->sb.block_count;
-    // cuenta libres
-    uint32_t freeb = 0;
-    for (int i = 0; i < fs->image_count; i++) {
-        BlockManager bm_t;
-        bm_init(&bm_t,
-                fs->images[i],
-                fs->sb.bitmap_offset,
-                fs->sb.block_count);
-        for (uint32_t b = 0; b < fs->sb.block_count; b++)
-            if (!bm_is_allocated(&bm_t, b)) freeb++;
-    }
-    st->f_bfree  = freeb;
-    st->f_bavail = freeb;
-    st->f_files  = BWFS_MAX_FILES;
-    // ficheros libres en el directorio
-    int used = 0;
-    for (uint32_t i = 0; i < fs->dir.max_entries; i++)
-        if (fs->dir.entries[i].used) used++;
-    st->f_ffree  = BWFS_MAX_FILES - used;
+    // Contadores mantenidos por el asignador y el directorio
+    st->f_bfree  = fs->free_blocks;
+    st->f_bavail = fs->free_blocks;
+    // La tabla de entradas crece sobre bloques libres: cuentan como inodos
+    st->f_ffree  = fs->dir.free_entries + fs->free_blocks * bsz / sizeof(DirEntry);
+    st->f_files  = fs->dir.max_entries - fs->dir.free_entries + st->f_ffree;
     st->f_favail = st->f_ffree;
     st->f_namemax = BWFS_FILENAME_MAXLEN;
+    pthread_mutex_unlock(&fs->meta_lock);
+    pthread_rwlock_unlock(&fs->ns_lock);
     return 0;
 }
 
-int fs_check_integrity(FSImage *fs) {
+static int fs_check_integrity_locked(FSImage *fs) {
     // 1. Verificar superbloque
     uint32_t stored_sb_checksum = fs->sb.checksum;
     Superblock tmp_sb = fs->sb;
@@ -450,44 +2587,111 @@ int fs_check_integrity(FSImage *fs) {
         return -2;
     }
 
-    // 3. Contar bloques asignados en todas las imágenes
+    // 3. Contar bloques asignados en todas las imágenes y contrastar con
+    //    los contadores de libres
     uint32_t allocated_blocks = 0;
+    uint64_t free_total = 0;
     for (int img = 0; img < fs->image_count; img++) {
-        BlockManager bm_tmp;
-        bm_init(&bm_tmp,
-                fs->images[img],
-                fs->sb.bitmap_offset,
-                fs->sb.block_count);
+        BlockManager *bm = fs_bm(fs, img);
+        if (!bm) {
+            printf("Cannot load image %d\n", img);
+            return -4;
+        }
+        uint32_t seg_allocated = 0;
         for (uint32_t b = 0; b < fs->sb.block_count; b++) {
-            if (bm_is_allocated(&bm_tmp, b) == 1) {
-                allocated_blocks++;
+            if (bm_is_allocated(bm, b) == 1) {
+                seg_allocated++;
             }
         }
+        if (bm->free_count != fs->sb.block_count - seg_allocated) {
+            printf("Free counter mismatch in image %d: counter=%u, bitmap=%u\n",
+                   img, bm->free_count, fs->sb.block_count - seg_allocated);
+            return -5;
+        }
+        allocated_blocks += seg_allocated;
+        free_total       += bm->free_count;
+    }
+    if (free_total != fs->free_blocks) {
+        printf("Global free counter mismatch: counter=%llu, segments=%llu\n",
+               (unsigned long long)fs->free_blocks,
+               (unsigned long long)free_total);
+        return -5;
+    }
+    uint32_t free_entries = 0;
+    for (uint32_t i = 0; i < fs->dir.max_entries; i++)
+        if (!dir_entry(&fs->dir, i)->used) free_entries++;
+    if (free_entries != fs->dir.free_entries) {
+        printf("Free entry counter mismatch: counter=%u, table=%u\n",
+               fs->dir.free_entries, free_entries);
+        return -6;
     }
 
     // 4. Verificar cada archivo
     int total_blocks = fs->image_count * fs->sb.block_count;
-    for (int i = 0; i < BWFS_MAX_FILES; i++) {
-        DirEntry *e = &fs->dir.entries[i];
+    for (int i = 0; i < (int)fs->dir.max_entries; i++) {
+        const DirEntry *e = dir_entry(&fs->dir, i);
         if (!e->used) continue;
+        // Las huérfanas (borradas y aún abiertas) no tienen nombre
+        int orphan = dir_parent(&fs->dir, i) == BWFS_DIR_ORPHAN;
+
+        // El padre debe ser un directorio en uso, sin ciclos hasta la raíz
+        int depth = 0;
+        for (int p = orphan ? BWFS_DIR_ROOT : dir_parent(&fs->dir, i);
+             p != BWFS_DIR_ROOT;
+             p = dir_parent(&fs->dir, p)) {
+            const DirEntry *pe = dir_entry(&fs->dir, p);
+            if (!pe || !pe->used || !pe->is_dir || ++depth > (int)fs->dir.max_entries) {
+                printf("Broken parent link for '%s'\n", e->name);
+                return -8;
+            }
+        }
 
-        // 4a) Verificar que todos los bloques globales son válidos y estén marcados
-        for (uint32_t j = 0; j < e->block_count; j++) {
-            int g = e->blocks[j];
-            if (g < 0 || g >= total_blocks) {
-                printf("Invalid global block %d in file '%s'\n",
-                       g, e->name);
+        // El índice de nombres debe llevar a esta misma entrada
+        if (!orphan && dir_lookup(&fs->dir, dir_parent(&fs->dir, i), e->name) != i) {
+            printf("Name index mismatch for '%s'\n", e->name);
+            return -7;
+        }
+
+        // 4a) Verificar que los tramos son válidos (dentro de un segmento) y
+        //     que todos sus bloques están marcados
+        FileMap *fm = fs_file_map(fs, i);
+        if (!fm) {
+            printf("Cannot read extent list of '%s'\n", e->name);
+            return -4;
+        }
+        if (fm_allocated(fm) != e->block_count) {
+            printf("Extent list of '%s' covers %llu blocks, entry says %u\n",
+                   e->name, (unsigned long long)fm_allocated(fm), e->block_count);
+            return -10 - i;
+        }
+        for (uint32_t j = 0; j < fm->count; j++) {
+            uint64_t g = fm->ext[j].start, len = fm->ext[j].len;
+            if (g == BWFS_HOLE && len > 0) continue;
+            if (len == 0 || g + len > (uint64_t)total_blocks ||
+                g / fs->sb.block_count != (g + len - 1) / fs->sb.block_count) {
+                printf("Invalid extent %llu+%llu in file '%s'\n",
+                       (unsigned long long)g, (unsigned long long)len, e->name);
                 return -10 - i;
             }
-            int img = g / fs->sb.block_count;
-            int loc = g % fs->sb.block_count;
-            BlockManager bm_tmp;
-            bm_init(&bm_tmp,
-                    fs->images[img],
-                    fs->sb.bitmap_offset,
-                    fs->sb.block_count);
-            if (bm_is_allocated(&bm_tmp, loc) != 1) {
-                printf("Block %d not allocated for file '%s'\n",
+            BlockManager *bm = fs_bm(fs, (int)(g / fs->sb.block_count));
+            if (!bm) {
+                printf("Cannot load image %d\n", (int)(g / fs->sb.block_count));
+                return -4;
+            }
+            for (uint64_t k = 0; k < len; k++) {
+                if (bm_is_allocated(bm, (int)((g + k) % fs->sb.block_count)) != 1) {
+                    printf("Block %llu not allocated for file '%s'\n",
+                           (unsigned long long)(g + k), e->name);
+                    return -20 - i;
+                }
+            }
+        }
+        for (uint32_t k = 0; k < fs_ext_blocks(fs, e->ext_count); k++) {
+            uint32_t g = e->ext_block + k;
+            if (g >= (uint32_t)total_blocks ||
+                bm_is_allocated(fs_bm(fs, g / fs->sb.block_count),
+                                g % fs->sb.block_count) != 1) {
+                printf("Extent list block %u not allocated for file '%s'\n",
                        g, e->name);
                 return -20 - i;
             }
@@ -496,7 +2700,7 @@ int fs_check_integrity(FSImage *fs) {
         // 4b) Leer y verificar checksum del contenido
         uint8_t *buf = malloc(e->size);
         if (!buf) return -30;
-        ssize_t rd = fs_read_file(fs, e->name, buf, e->size);
+        ssize_t rd = fs_pread_locked(fs, i, buf, e->size, 0);
         if (rd < 0) {
             printf("Read failed for '%s': %zd\n", e->name, rd);
             free(buf);
@@ -514,13 +2718,28 @@ int fs_check_integrity(FSImage *fs) {
         }
     }
 
-    // 5. Verificar que el número de bloques marcados coincide con la suma de e->block_count
+    // 5. Verificar que el número de bloques marcados coincide con la suma de
+    //    e->block_count y las listas de tramos extra, más los trozos de la
+    //    tabla de entradas y su mapa
     uint32_t files_blocks = 0;
-    for (int i = 0; i < BWFS_MAX_FILES; i++) {
-        if (fs->dir.entries[i].used) {
-            files_blocks += fs->dir.entries[i].block_count;
+    for (uint32_t i = 0; i < fs->dir.max_entries; i++) {
+        const DirEntry *e = dir_entry(&fs->dir, i);
+        if (e->used) files_blocks += e->block_count + fs_ext_blocks(fs, e->ext_count);
+    }
+    for (uint32_t c = 0; c < fs->sb.dir_chunks; c++) {
+        uint32_t n = (uint32_t)(((size_t)fs->dir_map[c].entries * sizeof(DirEntry) +
+                                 fs->sb.block_size / 8 - 1) / (fs->sb.block_size / 8));
+        for (uint32_t k = 0; k < n; k++) {
+            uint32_t g = fs->dir_map[c].start + k;
+            if (bm_is_allocated(fs_bm(fs, g / fs->sb.block_count),
+                                g % fs->sb.block_count) != 1) {
+                printf("Directory chunk block %u not allocated\n", g);
+                return -9;
+            }
         }
+        files_blocks += n;
     }
+    files_blocks += fs->sb.dir_map_blocks;
     if (allocated_blocks != files_blocks) {
         printf("Block count mismatch: bitmap=%u, files=%u\n",
                allocated_blocks, files_blocks);
@@ -528,4 +2747,11 @@ int fs_check_integrity(FSImage *fs) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int fs_check_integrity(FSImage *fs) {
+    fs_ns_write_lock(fs);
+    int rc = fs_check_integrity_locked(fs);
+    fs_ns_write_unlock(fs);
+    return rc;
+}
@@ -3,35 +3,235 @@
 
 #include <sys/types.h>
 #include <sys/statvfs.h>    // para struct statvfs
+#include <pthread.h>
+#include <stdatomic.h>
 #include "pbm_manager.h"
 #include "superblock.h"
 #include "block_manager.h"
+#include "block_cache.h"
 #include "directory.h"
+#include "file_map.h"
 
 #define BWFS_SIGNATURE 0x12345678  // Firma de la imagen inicial
 
+// Segmentos preparados (image_N.pbm.new) y marcador de confirmación en curso
+#define BWFS_STAGE_SUFFIX  ".new"
+#define BWFS_COMMIT_MARKER "commit.pending"
+// Máximo de hilos que escriben segmentos en paralelo en fs_save
+#define BWFS_SAVE_THREADS  8
+
+// Presupuesto por defecto de la caché de segmentos (bytes de payload residentes)
+#define BWFS_DEFAULT_CACHE_BYTES ((size_t)64 << 20)
+// Memoria por defecto de la caché de bloques decodificados
+#define BWFS_DEFAULT_BLOCK_CACHE_BYTES ((size_t)8 << 20)
+// Cerrojos de archivo y de segmento: se reparten por índice módulo este número
+#define BWFS_LOCK_STRIPES 64
+
+// Estado de la caché de segmentos
+typedef struct {
+    int           segments;        // Segmentos totales del FS
+    int           resident;        // Segmentos cargados en memoria
+    size_t        resident_bytes;
+    size_t        budget_bytes;    // 0 = sin límite
+    unsigned long loads;           // Cargas bajo demanda
+    unsigned long evictions;
+    unsigned long writebacks;      // Expulsiones que tuvieron que escribir
+} FSSegmentStats;
+
+// Parámetros de formato para fs_create_ex
+typedef struct {
+    uint32_t features;      // BWFS_FEAT_* (ALIGN_ROW implica ALIGN64)
+    uint32_t dir_entries;   // Entradas de la tabla en image_0 (0 = BWFS_MAX_FILES)
+} FSCreateOptions;
+
+// Trozo de la tabla de entradas fuera de image_0 (elemento del mapa de trozos)
 typedef struct {
-    PBMImage   **images;    // Lista de imágenes PBM
+    uint32_t start;         // Primer bloque global (tramo contiguo en un segmento)
+    uint32_t entries;
+} DirChunk;
+
+typedef struct {
+    PBMImage   **images;    // Lista de imágenes PBM (NULL = no residente, usar fs_segment)
     int          image_count;
     Superblock  sb;
-    BlockManager bm;
+    BlockManager *bms;      // Gestor por segmento; su resumen sobrevive a la expulsión
+    uint64_t     free_blocks; // Suma de bms[i].free_count (se reconstruye al montar)
+    int          alloc_hint;  // Ningún segmento anterior tiene bloques libres
     Directory    dir;
+    DirChunk    *dir_map;    // sb.dir_chunks trozos, en orden de índice de entrada
+    FileMap    **fmaps;      // Tramos de cada entrada ya consultada (NULL = sin cargar)
+    uint32_t     fmaps_cap;
+    uint32_t    *refs;       // Referencias externas por entrada (ver fs_ref)
+    uint32_t     refs_cap;
+    char        *folder;     // Carpeta de la última carga/guardado (NULL si nunca)
+    int          meta_dirty; // Superbloque o directorio cambiaron desde el último guardado
+    int          aligned;    // Los bloques se copian con memcpy (ver fs_update_layout)
+
+    // Caché LRU de segmentos: image_0 y la última quedan fijas
+    size_t        cache_budget;
+    size_t        cache_bytes;
+    uint64_t     *seg_stamp;  // Último uso de cada segmento
+    uint8_t      *seg_staged; // Versión sin confirmar en image_N.pbm.new (expulsado con cambios)
+    uint32_t     *seg_refs;   // Lecturas sin copia que apuntan a sus bits (no se expulsa)
+    PBMImage    **seg_flushing; // Expulsado con cambios, escribiéndose sin seg_cache_lock
+    uint64_t      seg_clock;
+    unsigned long seg_loads, seg_evictions, seg_writebacks;
+
+    // Bloques de datos decodificados; los sucios llegan a las imágenes al
+    // expulsarlos o en fs_flush (fs_save lo llama)
+    BlockCache    bcache;
+
+    // Concurrencia. Se toman siempre en este orden:
+    //  ns_lock:    espacio de nombres; en escritura para crear, borrar,
+    //              renombrar, fs_save y fsck; en lectura para todo lo demás
+    //  file_locks: datos y tamaño de cada archivo (lectura: pread; escritura:
+    //              pwrite, truncate, fallocate)
+    //  meta_lock:  entradas, mapas de tramos, bitmaps, contadores de libres
+    //              y caché de rutas
+    //  bc_lock:    caché de bloques
+    //  seg_locks:  contenido de cada segmento; mientras se tiene, no se expulsa
+    //  seg_cache_lock: lista de segmentos y contabilidad de la caché LRU
+    pthread_rwlock_t ns_lock;
+    pthread_rwlock_t file_locks[BWFS_LOCK_STRIPES];
+    pthread_mutex_t  meta_lock;
+    pthread_mutex_t  bc_lock;
+    pthread_mutex_t  seg_locks[BWFS_LOCK_STRIPES];
+    pthread_mutex_t  seg_cache_lock;
+
+    // Contadores de secuencia para fs_stat, fs_lookup y fs_list_dir sin
+    // cerrojos: impares mientras un escritor cambia lo que protegen y se
+    // reintenta la lectura si cambian durante ella.
+    //  ns_seq:    todo el directorio (se incrementa con ns_lock en escritura)
+    //  entry_seq: entradas del grupo idx % BWFS_LOCK_STRIPES (sus escritores
+    //             ya se excluyen por el cerrojo de archivo del mismo grupo)
+    atomic_uint      ns_seq;
+    atomic_uint      entry_seq[BWFS_LOCK_STRIPES];
 } FSImage;
 
 // Creación, carga y destrucción
 FSImage *fs_create(int width, int height, int block_size);
+// Como fs_create con opciones de formato (block_size se redondea a la alineación)
+FSImage *fs_create_ex(int width, int height, int block_size,
+                      const FSCreateOptions *opts);
 FSImage *fs_load(const char *folder_path);
 void     fs_destroy(FSImage *fs);
 
-// Persistencia
+// Caché de segmentos: carga bajo demanda y expulsa por LRU bajo el presupuesto.
+// El puntero devuelto es válido hasta la siguiente llamada a fs_segment, o
+// mientras se tenga el cerrojo del segmento (los demás hilos no lo expulsan).
+PBMImage *fs_segment(FSImage *fs, int idx);
+void      fs_set_cache_budget(FSImage *fs, size_t bytes);
+void      fs_segment_stats(const FSImage *fs, FSSegmentStats *st);
+// Gestor de bloques del segmento idx (lo carga si hace falta). Mismo
+// periodo de validez que fs_segment.
+BlockManager *fs_bm(FSImage *fs, int idx);
+
+// Caché de bloques: fs_set_block_cache escribe los sucios y la redimensiona
+// (0 = sin caché); fs_flush vuelca los sucios a las imágenes
+int fs_set_block_cache(FSImage *fs, size_t bytes);
+int fs_flush(FSImage *fs);
+
+// Persistencia. fs_save escribe en paralelo cada segmento modificado a
+// image_N.pbm.new (con fsync) y los confirma juntos mediante commit.pending;
+// fs_load completa o descarta una confirmación interrumpida.
 int  fs_save(   FSImage *fs, const char *folder_path);
 void fs_update_checksums(FSImage *fs);
 
+// Todas las operaciones públicas que siguen toman sus cerrojos y pueden
+// llamarse desde varios hilos a la vez (salvo creación, carga y destrucción).
+
+// Consulta concurrente del espacio de nombres: fs_lookup resuelve una ruta
+// y fs_lookup_at un nombre dentro de parent (-ENOENT), fs_stat copia la
+// entrada idx y fs_list_dir llama a fill con cada hijo de parent
+// (BWFS_DIR_ROOT = raíz) hasta que devuelva distinto de 0.
+// No toman cerrojos salvo que choquen repetidamente con un escritor; fill se
+// llama con copias de las entradas, después de validarlas.
+int     fs_lookup(   FSImage *fs, const char *path);
+int     fs_lookup_at(FSImage *fs, int parent, const char *name);
+int     fs_stat(     FSImage *fs, int idx, DirEntry *out);
+int     fs_list_dir( FSImage *fs, int parent,
+                     int (*fill)(void *ctx, int idx, const DirEntry *e), void *ctx);
+// Ruta de idx ("a/b/c"; BWFS_DIR_ROOT da ""), para las operaciones que
+// resuelven por nombre. 0, -ENOENT o -ENAMETOOLONG si no cabe en size
+int     fs_path(     FSImage *fs, int idx, char *buf, size_t size);
+// Referencias externas a una entrada (búsquedas que recuerda el kernel,
+// descriptores abiertos). Mientras tenga alguna, borrarla la deja huérfana:
+// sin nombre pero con sus datos y sin reutilizar su posición; soltar la
+// última la libera. fs_ref comprueba que idx sigue siendo la entrada de esa
+// generación (0, -ENOENT o -ENOMEM); fs_unref devuelve 0 o -1 si idx no
+// tenía n referencias.
+int     fs_ref(      FSImage *fs, int idx, uint16_t generation);
+int     fs_unref(    FSImage *fs, int idx, uint64_t n);
+
 // Operaciones de archivo
 int     fs_create_file(FSImage *fs, const char *name);
+// Como fs_create_file, pero con la causa del fallo: -EEXIST, -ENOENT (falta
+// el padre o no es directorio) o -ENOSPC (tabla llena)
+int     fs_mknod(      FSImage *fs, const char *name);
+// 0, -ENOENT, -EISDIR (usar fs_rmdir) o -EIO si no se pueden leer sus tramos
 int     fs_remove_file(FSImage *fs, const char *name);
 ssize_t fs_read_file(  FSImage *fs, const char *name, void *buf, size_t count);
 ssize_t fs_write_file( FSImage *fs, const char *name, const void *buf, size_t count);
+// Lee hasta count bytes desde offset decodificando sólo los bloques que los
+// cubren; 0 al final del archivo, <0 si no existe o hay un error
+ssize_t fs_pread(      FSImage *fs, const char *name, void *buf, size_t count,
+                       off_t offset);
+// Escribe count bytes en offset reescribiendo sólo los bloques afectados; el
+// archivo crece si hace falta (un hueco previo queda a ceros)
+ssize_t fs_pwrite(     FSImage *fs, const char *name, const void *buf, size_t count,
+                       off_t offset);
+
+// Descriptores: fs_open resuelve el nombre una vez y devuelve el índice de
+// la entrada (-ENOENT, -EISDIR); las *_entry trabajan sobre ese índice sin
+// tocar la tabla de nombres. fs_readahead carga en la caché de bloques los
+// que cubren [offset, offset+count) y devuelve cuántos.
+int     fs_open(        FSImage *fs, const char *name);
+ssize_t fs_pread_entry( FSImage *fs, int idx, void *buf, size_t count, off_t offset);
+ssize_t fs_pwrite_entry(FSImage *fs, int idx, const void *buf, size_t count,
+                        off_t offset);
+int     fs_readahead(   FSImage *fs, int idx, off_t offset, size_t count);
+
+// Lectura sin copia: trozos que apuntan a bloques fijados en la caché, a los
+// bits del segmento (formato alineado sin caché) o a ceros (huecos)
+typedef struct {
+    const void *data;
+    size_t      len;
+} FSIoChunk;
+
+typedef struct {
+    int        max_chunks;   // Lo fija el llamador (0 = sin límite)
+    FSIoChunk *chunks;
+    int        count, cap;
+    size_t     len;          // Suma de los trozos
+    int64_t   *pins;         // Bloques fijados (>= 0) y segmentos (-(seg + 1))
+    int        npins, pins_cap;
+    int        idx;          // Entrada bloqueada en lectura (-1 = ninguna)
+} FSReadVec;
+
+// Como fs_pread_entry, pero deja en v los trozos en vez de copiarlos: el
+// archivo queda bloqueado en lectura y los bloques fijados hasta
+// fs_pread_vec_release. -1 si no se puede (error, más de max_chunks trozos
+// o la caché no admite más bloques fijados): el llamador copia con
+// fs_pread_entry. Hay que llamar a fs_pread_vec_release desde el mismo hilo.
+ssize_t fs_pread_vec(FSImage *fs, int idx, size_t count, off_t offset,
+                     FSReadVec *v);
+void    fs_pread_vec_release(FSImage *fs, FSReadVec *v);
+// Archivos dispersos: primer offset >= offset con datos (hole = 0) o en un
+// hueco (hole = 1; el final del archivo lo es). -ENXIO si offset no está
+// dentro del archivo o no quedan datos.
+off_t   fs_seek_data(   FSImage *fs, int idx, off_t offset, int hole);
+
+// Tamaño y preasignación (0 o -errno). fs_truncate libera los bloques más
+// allá del nuevo final; lo que crece queda como hueco (se lee a ceros).
+// fs_fallocate reserva (a ceros) sólo los bloques de [offset, offset+length):
+// si offset queda más allá del final, lo de en medio queda como hueco. Sin
+// keep_size alarga el archivo hasta offset+length.
+int     fs_truncate(        FSImage *fs, const char *name, off_t length);
+int     fs_truncate_entry(  FSImage *fs, int idx, off_t length);
+int     fs_fallocate(       FSImage *fs, const char *name, int keep_size,
+                            off_t offset, off_t length);
+int     fs_fallocate_entry( FSImage *fs, int idx, int keep_size,
+                            off_t offset, off_t length);
 
 // Integridad
 int     fs_check_integrity(FSImage *fs);
@@ -1,4 +1,5 @@
 // fsck.bwfs.c
+#define _XOPEN_SOURCE 700   // pthread_rwlock_t (fs_image.h)
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -25,6 +26,15 @@ int main(int argc, char *argv[]) {
 
     // Verificar la integridad
     int rc = fs_check_integrity(fs);
+
+    FSSegmentStats st;
+    fs_segment_stats(fs, &st);
+    printf("Segmentos: %d (residentes %d, %zu bytes; cargas %lu, expulsiones %lu)\n",
+           st.segments, st.resident, st.resident_bytes, st.loads, st.evictions);
+    printf("Bloques libres: %llu de %llu; entradas libres: %u de %u\n",
+           (unsigned long long)fs->free_blocks,
+           (unsigned long long)fs->image_count * fs->sb.block_count,
+           fs->dir.free_entries, fs->dir.max_entries);
     if (rc == 0) {
         printf("BWFS consistente.\n");
         fs_destroy(fs);
@@ -1,4 +1,5 @@
 // mkfs.bwfs.c
+#define _XOPEN_SOURCE 700   // pthread_rwlock_t (fs_image.h)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +10,16 @@
 
 static void usage(const char *prog) {
     fprintf(stderr,
-        "Usage: %s [-w width] [-h height] [-b block_bits] folder\n"
+        "Usage: %s [-w width] [-h height] [-b block_bits] [-n entries] [-a] [-r] folder\n"
         "  -w width        Image width in pixels (1-1000). Default 1000.\n"
         "  -h height       Image height in pixels (1-1000). Default 1000.\n"
-        "  -b block_bits   Block size in bits (≤ width*height). Default 1024.\n",
-        prog);
+        "  -b block_bits   Block size in bits (≤ width*height). Default 1024.\n"
+        "  -n entries      Inline directory entries in image_0. Default %d;\n"
+        "                  the table grows into data blocks when full.\n"
+        "  -a              Aligned layout: regions and blocks on 64-bit boundaries\n"
+        "                  (width must be a multiple of 8); enables memcpy I/O.\n"
+        "  -r              Like -a, also aligning regions and blocks to image rows.\n",
+        prog, BWFS_MAX_FILES);
     exit(1);
 }
 
@@ -21,9 +27,10 @@ int main(int argc, char *argv[]) {
     int width      = 1000;
     int height     = 1000;
     size_t bbits   = 1024;
+    FSCreateOptions opts = { 0 };
     int opt;
 
-    while ((opt = getopt(argc, argv, "w:h:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "w:h:b:n:ar")) != -1) {
         switch (opt) {
         case 'w':
             width = atoi(optarg);
@@ -34,6 +41,16 @@ int main(int argc, char *argv[]) {
         case 'b':
             bbits = (size_t)atoi(optarg);
             break;
+        case 'n':
+            opts.dir_entries = (uint32_t)atoi(optarg);
+            if (opts.dir_entries == 0) usage(argv[0]);
+            break;
+        case 'a':
+            opts.features |= BWFS_FEAT_ALIGN64;
+            break;
+        case 'r':
+            opts.features |= BWFS_FEAT_ALIGN64 | BWFS_FEAT_ALIGN_ROW;
+            break;
         default:
             usage(argv[0]);
         }
@@ -52,6 +69,11 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (opts.features && width % 8 != 0) {
+        fprintf(stderr, "Error: aligned layout requires a width multiple of 8\n");
+        return 1;
+    }
+
     // Crear directorio
     if (mkdir(folder, 0755) < 0) {
         perror("mkdir");
@@ -59,7 +81,7 @@ int main(int argc, char *argv[]) {
     }
 
     // Crear y guardar el FS
-    FSImage *fs = fs_create(width, height, bbits);
+    FSImage *fs = fs_create_ex(width, height, bbits, &opts);
     if (!fs) {
         fprintf(stderr, "Error: no se pudo crear el BWFS\n");
         return 1;
@@ -69,9 +91,12 @@ int main(int argc, char *argv[]) {
         fs_destroy(fs);
         return 1;
     }
+    // El modo alineado puede haber redondeado el tamaño de bloque
+    bbits = fs->sb.block_size;
     fs_destroy(fs);
 
-    printf("BWFS creado en '%s' (ancho=%d, alto=%d, block_bits=%zu)\n",
-           folder, width, height, bbits);
+    printf("BWFS creado en '%s' (ancho=%d, alto=%d, block_bits=%zu%s)\n",
+           folder, width, height, bbits,
+           opts.features ? ", alineado" : "");
     return 0;
 }
@@ -1,273 +1,809 @@
 // mount.bwfs.c
 #define FUSE_USE_VERSION 31
 #define _XOPEN_SOURCE 700
+#define _GNU_SOURCE      // SEEK_DATA / SEEK_HOLE
 
-#include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <linux/falloc.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "fs_image.h"
 
 static FSImage   *fs           = NULL;
 static const char *fs_folder   = NULL;
 
-// Helper: strip leading '/' and copy into buf (maxlen includes NUL)
-static void strip_slash(const char *path, char *buf, size_t maxlen) {
-    if (path[0]=='/') {
-        strncpy(buf, path+1, maxlen-1);
+// Lectura anticipada: la ventana se dobla con cada lectura secuencial
+#define BWFS_RA_MIN (64 * 1024)
+#define BWFS_RA_MAX (1024 * 1024)
+// Trozos de una respuesta de lectura sin copia (writev admite 1024 con la
+// cabecera); con más se copia a un buffer
+#define BWFS_READ_CHUNKS 1023
+
+// Inodos: la entrada idx es el inodo idx + BWFS_INO_BASE; la raíz, que no
+// tiene entrada, es FUSE_ROOT_ID. Al reutilizar una entrada cambia su
+// generation, así que el par (inodo, generación) no se repite.
+#define BWFS_INO_BASE 2
+
+// Ajustes del montaje que el kernel no recibe tal cual (-o opción=valor).
+// Los tiempos de caché son largos porque todos los cambios pasan por este
+// montaje: el kernel puede guardar nombres (también los que no existen) y
+// atributos sin preguntar cada vez.
+typedef struct {
+    char  *folder;           // Primer argumento que no es opción
+    long   cache_mb;         // -c / cache_mb=: caché de segmentos (-1 = por omisión)
+    double entry_timeout;
+    double negative_timeout;
+    double attr_timeout;
+    int    kernel_cache;     // Conservar la caché de páginas entre aperturas
+    int    auto_cache;       // Ídem, invalidándola si cambian tamaño o mtime
+    int    writeback;        // Caché de escritura diferida del kernel
+} BwfsOptions;
+
+static BwfsOptions opts = { NULL, -1, 10.0, 10.0, 10.0, 0, 0, 0 };
+
+// Opciones de conexión de libfuse (max_write, max_readahead, max_background,
+// writeback_cache...): se aplican en init sobre los valores por omisión
+static struct fuse_conn_info_opts *conn_opts = NULL;
+
+// Por omisión: peticiones de escritura de hasta 1 MiB (libfuse y el kernel
+// lo recortan a lo que admitan) y hasta 64 peticiones en segundo plano
+#define BWFS_MAX_WRITE      (1024 * 1024)
+#define BWFS_MAX_BACKGROUND 64
+
+static int ino_idx(fuse_ino_t ino) {
+    return ino == FUSE_ROOT_ID ? BWFS_DIR_ROOT : (int)(ino - BWFS_INO_BASE);
+}
+
+static fuse_ino_t idx_ino(int idx) {
+    return idx == BWFS_DIR_ROOT ? FUSE_ROOT_ID : (fuse_ino_t)idx + BWFS_INO_BASE;
+}
+
+// Descriptor abierto (en fi->fh): las E/S siguientes no pasan por la tabla
+// de nombres. Cada descriptor es una referencia a la entrada (fs_ref), así
+// que aunque se borre su posición no se reutiliza hasta soltarlo
+typedef struct {
+    int    idx;       // Entrada del archivo
+    // Estado de la lectura anticipada: con ASYNC_READ y el bucle multihilo
+    // pueden llegar a la vez varias lecturas del mismo descriptor
+    pthread_mutex_t ra_lock;
+    off_t  next;      // Offset que continuaría una lectura secuencial
+    off_t  ra_end;    // Hasta dónde se ha cargado por adelantado
+    size_t ra;        // Ventana actual (0 = acceso aleatorio)
+} BwfsHandle;
+
+static BwfsHandle *handle_of(const struct fuse_file_info *fi) {
+    return fi ? (BwfsHandle *)(uintptr_t)fi->fh : NULL;
+}
+
+static int handle_new(int idx, uint16_t generation, struct fuse_file_info *fi) {
+    BwfsHandle *h = calloc(1, sizeof(*h));
+    if (!h) return -ENOMEM;
+    int rc = fs_ref(fs, idx, generation);
+    if (rc < 0) {
+        free(h);
+        return rc;
+    }
+    h->idx = idx;
+    pthread_mutex_init(&h->ra_lock, NULL);
+    fi->fh = (uint64_t)(uintptr_t)h;
+    return 0;
+}
+
+static void handle_free(struct fuse_file_info *fi) {
+    BwfsHandle *h = handle_of(fi);
+    if (h) {
+        fs_unref(fs, h->idx, 1);
+        pthread_mutex_destroy(&h->ra_lock);
+    }
+    free(h);
+    fi->fh = 0;
+}
+
+// Atributos de idx a partir de su entrada (e == NULL para la raíz)
+static void fill_stat(int idx, const DirEntry *e, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = idx_ino(idx);
+    if (e == NULL || e->is_dir) {
+        st->st_mode  = S_IFDIR | 0755;
+        st->st_nlink = 2;
     } else {
-        strncpy(buf, path,   maxlen-1);
+        st->st_mode   = S_IFREG | 0644;
+        st->st_nlink  = 1;
+        st->st_size   = e->size;
+        st->st_blocks = (blkcnt_t)e->block_count * (fs->sb.block_size / 8) / 512;
     }
-    buf[maxlen-1] = '\0';
 }
 
-// Translate path to DirEntry*, NULL for root
-static int resolve_path(const char *path, DirEntry **out) {
-    if (strcmp(path, "/")==0) {
-        *out = NULL;
+// Atributos del inodo; fs_stat no toma cerrojos
+static int stat_ino(fuse_ino_t ino, struct stat *st, DirEntry *out) {
+    int idx = ino_idx(ino);
+    if (idx == BWFS_DIR_ROOT) {
+        fill_stat(idx, NULL, st);
         return 0;
     }
-    char name[BWFS_FILENAME_MAXLEN+1];
-    strip_slash(path, name, sizeof(name));
-    int idx = dir_find(&fs->dir, name);
-    if (idx < 0) return -ENOENT;
-    *out = dir_entry_mut(&fs->dir, idx);
+    int rc = fs_stat(fs, idx, out);
+    if (rc == 0) fill_stat(idx, out, st);
+    return rc;
+}
+
+static int fill_entry(int idx, struct fuse_entry_param *ep) {
+    DirEntry e;
+    memset(ep, 0, sizeof(*ep));
+    int rc = fs_stat(fs, idx, &e);
+    if (rc < 0) return rc;
+    ep->ino           = idx_ino(idx);
+    ep->generation    = e.generation;
+    ep->attr_timeout  = opts.attr_timeout;
+    ep->entry_timeout = opts.entry_timeout;
+    fill_stat(idx, &e, &ep->attr);
     return 0;
 }
 
+// Entrada que se va a responder: el kernel la cuenta como una búsqueda más
+// hasta que la olvide (forget), y mientras tanto la entrada no se reutiliza
+static int ref_entry(int idx, struct fuse_entry_param *ep) {
+    int rc = fill_entry(idx, ep);
+    return rc < 0 ? rc : fs_ref(fs, idx, (uint16_t)ep->generation);
+}
+
+static void reply_entry(fuse_req_t req, int idx, struct fuse_entry_param *ep) {
+    if (fuse_reply_entry(req, ep) != 0) fs_unref(fs, idx, 1);
+}
+
+// Ruta "padre/nombre": el núcleo resuelve por ruta las operaciones que
+// cambian el espacio de nombres
+static int child_path(fuse_ino_t parent, const char *name, char *buf, size_t size) {
+    // El directorio recortaría el nombre y el kernel lo guardaría entero
+    if (strlen(name) >= BWFS_FILENAME_MAXLEN) return -ENAMETOOLONG;
+    int rc = fs_path(fs, ino_idx(parent), buf, size);
+    if (rc < 0) return rc;
+    size_t len = strlen(buf);
+    int n = snprintf(buf + len, size - len, "%s%s", len ? "/" : "", name);
+    return (n < 0 || (size_t)n >= size - len) ? -ENAMETOOLONG : 0;
+}
+
+// Responde con la entrada de name en parent, recién creada o encontrada
+static void reply_child(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param ep;
+    int idx = fs_lookup_at(fs, ino_idx(parent), name);
+    int rc  = idx < 0 ? idx : ref_entry(idx, &ep);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else        reply_entry(req, idx, &ep);
+}
+
+// lookup
+static void bwfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param ep;
+    if (strlen(name) >= BWFS_FILENAME_MAXLEN) {
+        fuse_reply_err(req, ENAMETOOLONG);  // Si no, casaría con el recortado
+        return;
+    }
+    int idx = fs_lookup_at(fs, ino_idx(parent), name);
+    if (idx == -ENOENT) {
+        // Entrada negativa: el kernel también recuerda que no existe
+        memset(&ep, 0, sizeof(ep));
+        ep.entry_timeout = opts.negative_timeout;
+        fuse_reply_entry(req, &ep);
+        return;
+    }
+    int rc = idx < 0 ? idx : ref_entry(idx, &ep);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else        reply_entry(req, idx, &ep);
+}
+
+// forget: el kernel suelta nlookup búsquedas; un archivo borrado se libera
+// con la última
+static void forget_one(fuse_ino_t ino, uint64_t nlookup) {
+    if (ino != FUSE_ROOT_ID) fs_unref(fs, ino_idx(ino), nlookup);
+}
+
+static void bwfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    forget_one(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void bwfs_forget_multi(fuse_req_t req, size_t count,
+                              struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; ++i)
+        forget_one(forgets[i].ino, forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
 // getattr
-static int bwfs_getattr(const char *path, struct stat *st,
-                        struct fuse_file_info *fi)
+static void bwfs_getattr(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi)
 {
     (void)fi;
-    memset(st, 0, sizeof(*st));
-    DirEntry *e;
-    int rc = resolve_path(path, &e);
-    if (rc<0) return rc;
+    struct stat st;
+    DirEntry e;
+    int rc = stat_ino(ino, &st, &e);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else        fuse_reply_attr(req, &st, opts.attr_timeout);
+}
 
-    if (e==NULL) {
-        // root
-        st->st_mode  = S_IFDIR | 0755;
-        st->st_nlink = 2;
-    } else if (e->is_dir) {
-        st->st_mode  = S_IFDIR | 0755;
-        st->st_nlink = 2;
-    } else {
-        st->st_mode  = S_IFREG | 0644;
-        st->st_nlink = 1;
-        st->st_size  = e->size;
+// setattr: sólo el tamaño se guarda (truncate / ftruncate); modo, dueño y
+// tiempos no existen en la imagen y se ignoran. Con writeback el kernel lleva
+// mtime/ctime y los manda tras escribir: se aceptan sin error.
+static void bwfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                         int to_set, struct fuse_file_info *fi)
+{
+    int idx = ino_idx(ino);
+    to_set &= ~(FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_CTIME);
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        BwfsHandle *h = handle_of(fi);
+        int rc = idx == BWFS_DIR_ROOT ? -EISDIR
+                                      : fs_truncate_entry(fs, h ? h->idx : idx, attr->st_size);
+        if (rc < 0) {
+            fuse_reply_err(req, -rc);
+            return;
+        }
+    }
+    bwfs_getattr(req, ino, fi);
+}
+
+// Entradas de un directorio, copiadas en opendir (en fi->fh) para que
+// readdir pueda continuar por offset sin volver a recorrer la tabla
+typedef struct {
+    int      idx;           // El propio directorio
+    int      parent;        // Su padre (BWFS_DIR_ROOT para la raíz)
+    uint32_t n, cap;
+    int      failed;        // Sin memoria: la lista está incompleta
+    int      *idxs;
+    DirEntry *ents;
+} BwfsDirList;
+
+static int dirlist_add(void *ctx, int idx, const DirEntry *e) {
+    BwfsDirList *l = ctx;
+    if (l->n == l->cap) {
+        uint32_t cap = l->cap ? 2 * l->cap : 32;
+        int      *idxs = realloc(l->idxs, cap * sizeof(int));
+        if (idxs) l->idxs = idxs;
+        DirEntry *ents = idxs ? realloc(l->ents, cap * sizeof(DirEntry)) : NULL;
+        if (!ents) {
+            l->failed = 1;
+            return -1;
+        }
+        l->ents = ents;
+        l->cap  = cap;
     }
+    l->idxs[l->n] = idx;
+    l->ents[l->n] = *e;
+    l->n++;
     return 0;
 }
 
-// readdir
-static int bwfs_readdir(const char *path, void *buf,
-                        fuse_fill_dir_t filler,
-                        off_t offset,
-                        struct fuse_file_info *fi,
-                        enum fuse_readdir_flags flags)
+static void dirlist_free(BwfsDirList *l) {
+    if (!l) return;
+    free(l->idxs);
+    free(l->ents);
+    free(l);
+}
+
+// opendir
+static void bwfs_opendir(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi)
 {
-    (void)offset; (void)fi; (void)flags;
-    DirEntry *d;
-    int rc = resolve_path(path, &d);
-    if (rc<0) return rc;
-    if (d && !d->is_dir) return -ENOTDIR;
-
-    filler(buf, ".",  NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
-    for (uint32_t i = 0; i < fs->dir.max_entries; i++) {
-        DirEntry *e = &fs->dir.entries[i];
-        if (!e->used) continue;
-        if (d==NULL && e->is_dir) {
-            filler(buf, e->name, NULL, 0, 0);
-        } else if (d==NULL && !e->is_dir) {
-            filler(buf, e->name, NULL, 0, 0);
-        } else if (d!=NULL) {
-            // single-level: children of root only
-            // nothing
+    struct stat st;
+    DirEntry e;
+    int rc = stat_ino(ino, &st, &e);
+    if (rc == 0 && !S_ISDIR(st.st_mode)) rc = -ENOTDIR;
+    BwfsDirList *l = rc == 0 ? calloc(1, sizeof(*l)) : NULL;
+    if (rc == 0 && !l) rc = -ENOMEM;
+    if (rc == 0) {
+        l->idx    = ino_idx(ino);
+        l->parent = l->idx == BWFS_DIR_ROOT ? BWFS_DIR_ROOT : (int)e.parent - 1;
+        fs_list_dir(fs, l->idx, dirlist_add, l);
+        if (!l->failed) {
+            fi->fh = (uint64_t)(uintptr_t)l;
+            fuse_reply_open(req, fi);
+            return;
         }
+        rc = -ENOMEM;
     }
-    return 0;
+    dirlist_free(l);
+    fuse_reply_err(req, -rc);
+}
+
+// readdir / readdirplus: posición 0 ".", 1 ".." y luego los hijos
+static void dir_reply(fuse_req_t req, size_t size, off_t off,
+                      struct fuse_file_info *fi, int plus)
+{
+    BwfsDirList *l = (BwfsDirList *)(uintptr_t)fi->fh;
+    char *buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t pos = 0;
+    for (off_t k = off; k < (off_t)l->n + 2; ++k) {
+        struct fuse_entry_param ep;
+        const char *name;
+        int ref = -1;
+        memset(&ep, 0, sizeof(ep));
+        if (k < 2) {
+            name = k == 0 ? "." : "..";
+            int idx = k == 0 ? l->idx : l->parent;
+            ep.attr.st_ino  = idx_ino(idx);
+            ep.attr.st_mode = S_IFDIR;
+        } else {
+            int idx = l->idxs[k - 2];
+            name = l->ents[k - 2].name;
+            ep.ino           = idx_ino(idx);
+            ep.generation    = l->ents[k - 2].generation;
+            ep.attr_timeout  = opts.attr_timeout;
+            ep.entry_timeout = opts.entry_timeout;
+            fill_stat(idx, &l->ents[k - 2], &ep.attr);
+            // readdirplus cuenta como búsqueda; sin inodo (ya borrada) el
+            // kernel la trata como una entrada de readdir
+            if (plus && fs_ref(fs, idx, (uint16_t)ep.generation) == 0) ref = idx;
+            else if (plus) ep.ino = 0;
+        }
+        size_t len = plus
+            ? fuse_add_direntry_plus(req, buf + pos, size - pos, name, &ep, k + 1)
+            : fuse_add_direntry(req, buf + pos, size - pos, name, &ep.attr, k + 1);
+        if (len > size - pos) {
+            if (ref >= 0) fs_unref(fs, ref, 1);
+            break;
+        }
+        pos += len;
+    }
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+
+static void bwfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi)
+{
+    (void)ino;
+    dir_reply(req, size, off, fi, 0);
+}
+
+static void bwfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t off, struct fuse_file_info *fi)
+{
+    (void)ino;
+    dir_reply(req, size, off, fi, 1);
+}
+
+// releasedir
+static void bwfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi)
+{
+    (void)ino;
+    dirlist_free((BwfsDirList *)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
 }
 
 // create
-static int bwfs_create(const char *path, mode_t mode,
-                       struct fuse_file_info *fi)
+static void bwfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode, struct fuse_file_info *fi)
 {
-    (void)mode; (void)fi;
-    char name[BWFS_FILENAME_MAXLEN+1];
-    strip_slash(path, name, sizeof(name));
-    int rc = fs_create_file(fs, name);
-    return rc<0 ? -EEXIST : 0;
+    (void)mode;
+    char path[PATH_MAX];
+    struct fuse_entry_param ep;
+    int rc = child_path(parent, name, path, sizeof(path));
+    int idx = rc < 0 ? rc : fs_mknod(fs, path);
+    if (rc == 0 && idx < 0) rc = idx;
+    if (rc == 0) rc = ref_entry(idx, &ep);
+    if (rc == 0 && (rc = handle_new(idx, (uint16_t)ep.generation, fi)) < 0)
+        fs_unref(fs, idx, 1);
+    fi->keep_cache = opts.kernel_cache || opts.auto_cache;
+    if (rc < 0) {
+        fuse_reply_err(req, -rc);
+    } else if (fuse_reply_create(req, &ep, fi) != 0) {
+        // Interrumpida: el kernel no recibió ni la entrada ni el descriptor
+        fs_unref(fs, idx, 1);
+        handle_free(fi);
+    }
 }
 
 // open
-static int bwfs_open(const char *path, struct fuse_file_info *fi) {
-    (void)fi;//No se esta usando de momento
-    DirEntry *e;
-    int rc = resolve_path(path, &e);
-    return rc;
+static void bwfs_open(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+    struct stat st;
+    DirEntry e;
+    int rc = stat_ino(ino, &st, &e);
+    if (rc == 0 && S_ISDIR(st.st_mode)) rc = -EISDIR;
+    if (rc == 0) rc = handle_new(ino_idx(ino), e.generation, fi);
+    fi->keep_cache = opts.kernel_cache || opts.auto_cache;
+    if (rc < 0)                            fuse_reply_err(req, -rc);
+    else if (fuse_reply_open(req, fi) != 0) handle_free(fi);
 }
 
-// read
-static int bwfs_read(const char *path, char *buf, size_t size,
-                     off_t offset, struct fuse_file_info *fi)
+// release: un archivo borrado se libera con su último descriptor
+static void bwfs_release(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi)
 {
-    (void)fi;
-    DirEntry *e;
-    int rc = resolve_path(path, &e);
-    if (rc<0) return rc;
-    if (e->is_dir) return -EISDIR;
-
-    // read full then copy slice
-    uint8_t *tmp = malloc(e->size);
-    if (!tmp) return -ENOMEM;
-    ssize_t rd = fs_read_file(fs, e->name, tmp, e->size);
-    if (rd < 0) { free(tmp); return rd; }
-    size_t to_copy = (offset + size <= (size_t)rd)
-                       ? size : (size_t)(rd - offset);
-    if ((off_t)to_copy < 0) to_copy = 0;
-    memcpy(buf, tmp + offset, to_copy);
-    free(tmp);
-    return to_copy;
+    (void)ino;
+    handle_free(fi);
+    fuse_reply_err(req, 0);
+}
+
+// Tras una lectura en [off, off+len): si continúa a la anterior, agranda la
+// ventana y carga por adelantado lo que falte de ella
+static void handle_readahead(BwfsHandle *h, off_t off, size_t len) {
+    off_t end = off + (off_t)len, from = 0;
+    size_t n = 0;
+    pthread_mutex_lock(&h->ra_lock);
+    if (off != h->next || len == 0) {
+        h->ra = 0;
+        h->ra_end = 0;
+    } else {
+        h->ra = h->ra ? h->ra * 2 : BWFS_RA_MIN;
+        if (h->ra > BWFS_RA_MAX) h->ra = BWFS_RA_MAX;
+        if (h->ra_end < end + (off_t)h->ra / 2) {
+            from = h->ra_end > end ? h->ra_end : end;
+            n    = (size_t)(end + (off_t)h->ra - from);
+            h->ra_end = end + (off_t)h->ra;
+        }
+    }
+    h->next = end;
+    pthread_mutex_unlock(&h->ra_lock);
+    // La carga, fuera del cerrojo: no frena otras lecturas del descriptor
+    if (n) fs_readahead(fs, h->idx, from, n);
 }
 
-// write
-static int bwfs_write(const char *path, const char *buf, size_t size,
+// Lectura copiando a un buffer (bloques sin alinear o caché llena)
+static ssize_t read_copy(fuse_req_t req, int idx, size_t size, off_t offset) {
+    char *buf = malloc(size ? size : 1);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return -1;
+    }
+    // Sólo se decodifican los bloques que cubren [offset, offset+size)
+    ssize_t rd = fs_pread_entry(fs, idx, buf, size, offset);
+    if (rd < 0) fuse_reply_err(req, EIO);
+    else        fuse_reply_buf(req, buf, (size_t)rd);
+    free(buf);
+    return rd;
+}
+
+// read: sin copia, los trozos de la respuesta apuntan a los bloques
+// fijados en la caché o a los bits del segmento, y writev los lleva al
+// kernel directamente (fuse_reply_data juntaría varios trozos en memoria)
+static void bwfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
-    (void)fi;
-    DirEntry *e;
-    int rc = resolve_path(path, &e);
-    if (rc == -ENOENT) {
-        // auto-create
-        char name[BWFS_FILENAME_MAXLEN+1];
-        strip_slash(path, name, sizeof(name));
-        rc = fs_create_file(fs, name);
-        if (rc<0) return rc;
-        resolve_path(path, &e);
+    BwfsHandle *h = handle_of(fi);
+    int idx = h ? h->idx : ino_idx(ino);
+    FSReadVec v;
+    memset(&v, 0, sizeof(v));
+    v.max_chunks = BWFS_READ_CHUNKS;
+    ssize_t rd = fs_pread_vec(fs, idx, size, offset, &v);
+    struct iovec *iov = rd >= 0 ? malloc(sizeof(*iov) * (v.count ? v.count : 1))
+                                : NULL;
+    if (iov) {
+        for (int i = 0; i < v.count; ++i) {
+            iov[i].iov_base = (void *)v.chunks[i].data;
+            iov[i].iov_len  = v.chunks[i].len;
+        }
+        fuse_reply_iov(req, iov, v.count);
+        free(iov);
+    }
+    fs_pread_vec_release(fs, &v);
+    if (!iov) rd = read_copy(req, idx, size, offset);
+    if (rd >= 0 && h) handle_readahead(h, offset, (size_t)rd);
+}
+
+// write_buf: los datos llegan en memoria o, con splice_read, en una tubería;
+// sólo en ese caso (o si vienen en varios trozos) se juntan en un buffer
+static void bwfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_bufvec *bufv, off_t offset,
+                           struct fuse_file_info *fi)
+{
+    BwfsHandle *h = handle_of(fi);
+    struct fuse_buf *b = &bufv->buf[bufv->idx];
+    size_t size = fuse_buf_size(bufv);
+    const char *src;
+    char *tmp = NULL;
+    if (bufv->count == 1 && bufv->idx == 0 && !(b->flags & FUSE_BUF_IS_FD)) {
+        src   = (const char *)b->mem + bufv->off;
+        size -= bufv->off;
+    } else {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        tmp = malloc(size ? size : 1);
+        if (!tmp) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        dst.buf[0].mem = tmp;
+        ssize_t got = fuse_buf_copy(&dst, bufv, 0);
+        if (got < 0) {
+            free(tmp);
+            fuse_reply_err(req, (int)-got);
+            return;
+        }
+        src  = tmp;
+        size = (size_t)got;
     }
-    if (e->is_dir) return -EISDIR;
-
-    size_t new_size = offset + size;
-    uint8_t *tmp = calloc(1, new_size);
-    if (!tmp) return -ENOMEM;
-    ssize_t rd = fs_read_file(fs, e->name, tmp, new_size);
-    if (rd < 0) rd = 0;
-    memcpy(tmp + offset, buf, size);
-    ssize_t wr = fs_write_file(fs, e->name, tmp, new_size);
+    // Sólo se reescriben los bloques de [offset, offset+size)
+    ssize_t wr = fs_pwrite_entry(fs, h ? h->idx : ino_idx(ino), src, size, offset);
     free(tmp);
-    return (wr<0) ? wr : (int)size;
+    if (wr >= 0)       fuse_reply_write(req, (size_t)wr);
+    else if (wr == -1) fuse_reply_err(req, EFBIG);
+    else if (wr == -3) fuse_reply_err(req, ENOSPC);
+    else               fuse_reply_err(req, EIO);
+}
+
+// fallocate: sólo reserva (con o sin FALLOC_FL_KEEP_SIZE)
+static void bwfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                           off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    BwfsHandle *h = handle_of(fi);
+    int rc = fs_fallocate_entry(fs, h ? h->idx : ino_idx(ino),
+                                (mode & FALLOC_FL_KEEP_SIZE) != 0, offset, length);
+    fuse_reply_err(req, -rc);
 }
 
 // mkdir
-static int bwfs_mkdir(const char *path, mode_t mode) {
+static void bwfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode)
+{
     (void)mode;
-    char name[BWFS_FILENAME_MAXLEN+1];
-    strip_slash(path, name, sizeof(name));
-    int rc = fs_mkdir(fs, name);
-    return rc;
+    char path[PATH_MAX];
+    int rc = child_path(parent, name, path, sizeof(path));
+    if (rc == 0) rc = fs_mkdir(fs, path);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else        reply_child(req, parent, name);
 }
 
-// unlink / rmdir
-static int bwfs_unlink(const char *path) {
-    char name[BWFS_FILENAME_MAXLEN+1];
-    strip_slash(path, name, sizeof(name));
-    // check if dir or file
-    DirEntry *e;
-    int rc = resolve_path(path, &e);
-    if (rc<0) return rc;
-    if (e->is_dir)
-        return fs_rmdir(fs, name);
-    else
-        return fs_remove_file(fs, name);
+// unlink
+static void bwfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char path[PATH_MAX];
+    int rc = child_path(parent, name, path, sizeof(path));
+    if (rc == 0) rc = fs_remove_file(fs, path);
+    fuse_reply_err(req, -rc);
+}
+
+// rmdir
+static void bwfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char path[PATH_MAX];
+    int rc = child_path(parent, name, path, sizeof(path));
+    if (rc == 0) rc = fs_rmdir(fs, path);
+    fuse_reply_err(req, -rc);
 }
 
 // rename
-static int bwfs_rename(const char *from, const char *to, unsigned int flags) {
-    (void)flags;
-    char oldn[BWFS_FILENAME_MAXLEN+1], newn[BWFS_FILENAME_MAXLEN+1];
-    strip_slash(from, oldn, sizeof(oldn));
-    strip_slash(to,   newn, sizeof(newn));
-    return fs_rename(fs, oldn, newn);
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+static void bwfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        fuse_ino_t newparent, const char *newname,
+                        unsigned int flags)
+{
+    // fs_rename nunca sustituye el destino (EEXIST), así que NOREPLACE ya se
+    // cumple; intercambiar o dejar whiteouts no está soportado
+    if (flags & ~RENAME_NOREPLACE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    char from[PATH_MAX], to[PATH_MAX];
+    int rc = child_path(parent, name, from, sizeof(from));
+    if (rc == 0) rc = child_path(newparent, newname, to, sizeof(to));
+    if (rc == 0) rc = fs_rename(fs, from, to);
+    fuse_reply_err(req, -rc);
 }
 
-// access
-static int bwfs_access(const char *path, int mask) {
-    (void)mask;
-    if (strcmp(path,"/")==0) return 0;
-    char name[BWFS_FILENAME_MAXLEN+1];
-    strip_slash(path, name, sizeof(name));
-    return fs_access(fs, name, mask);
+// access: el inodo ya existe y no hay permisos que comprobar
+static void bwfs_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    (void)ino; (void)mask;
+    fuse_reply_err(req, 0);
 }
 
 // flush / fsync
-static int bwfs_flush(const char *path, struct fuse_file_info *fi) {
-    (void)path; (void)fi;
-    return fs_save(fs, fs_folder)==0 ? 0 : -EIO;
+static void bwfs_flush(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    (void)ino; (void)fi;
+    fuse_reply_err(req, fs_save(fs, fs_folder) == 0 ? 0 : EIO);
 }
-static int bwfs_fsync(const char *path, int datasync,
-                      struct fuse_file_info *fi)
+
+static void bwfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                       struct fuse_file_info *fi)
 {
     (void)datasync;//De momento no se usa
-    return bwfs_flush(path, fi);
+    bwfs_flush(req, ino, fi);
 }
 
 // statfs
-static int bwfs_statfs(const char *path, struct statvfs *st) {
-    (void)path;
-    return fs_statfs(fs, st);
+static void bwfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+    (void)ino;
+    struct statvfs st;
+    memset(&st, 0, sizeof(st));
+    int rc = fs_statfs(fs, &st);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else        fuse_reply_statfs(req, &st);
 }
 
-// lseek
-static off_t bwfs_lseek(const char *path, off_t off, int whence,
-                        struct fuse_file_info *fi)
+// lseek: el kernel resuelve SEEK_SET/CUR/END; aquí sólo llegan SEEK_DATA y
+// SEEK_HOLE
+static void bwfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                       struct fuse_file_info *fi)
 {
-    DirEntry *e;
-    int rc = resolve_path(path, &e);
-    if (rc<0) return rc;
-    off_t newoff;
-    if (whence==SEEK_SET) newoff = off;
-    else if (whence==SEEK_CUR) newoff = fi->fh + off;
-    else if (whence==SEEK_END) newoff = e->size + off;
-    else return -EINVAL;
-    if (newoff < 0) return -EINVAL;
-    fi->fh = newoff;
-    return newoff;
-}
-
-static const struct fuse_operations bwfs_ops = {
-    .getattr = bwfs_getattr,
-    .readdir = bwfs_readdir,
-    .create  = bwfs_create,
-    .open     = bwfs_open,
-    .read     = bwfs_read,
-    .write    = bwfs_write,
-    .mkdir    = bwfs_mkdir,
-    .unlink   = bwfs_unlink,
-    .rename   = bwfs_rename,
-    .access   = bwfs_access,
-    .flush    = bwfs_flush,
-    .fsync    = bwfs_fsync,
-    .statfs   = bwfs_statfs,
-    .lseek    = bwfs_lseek,
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    BwfsHandle *h = handle_of(fi);
+    off_t r = fs_seek_data(fs, h ? h->idx : ino_idx(ino), off, whence == SEEK_HOLE);
+    if (r < 0) fuse_reply_err(req, (int)-r);
+    else       fuse_reply_lseek(req, r);
+}
+
+// init: valores por omisión pensados para E/S secuencial grande; las
+// opciones de conexión de la línea de órdenes los sustituyen
+static void bwfs_init(void *userdata, struct fuse_conn_info *conn) {
+    (void)userdata;
+    conn->max_write      = BWFS_MAX_WRITE;
+    conn->max_background = BWFS_MAX_BACKGROUND;
+    conn->congestion_threshold = BWFS_MAX_BACKGROUND * 3 / 4;
+    // Con caché de escritura diferida (-o writeback) el kernel agrupa las
+    // escrituras pequeñas en páginas y las manda en peticiones de max_write.
+    // Los manejadores no miran el modo de apertura ni O_APPEND (el kernel da
+    // el desplazamiento), así que leer páginas de un O_WRONLY ya funciona.
+    if (opts.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    else
+        opts.writeback = 0;
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    if (opts.auto_cache && (conn->capable & FUSE_CAP_AUTO_INVAL_DATA))
+        conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
+    // Lectura anticipada del kernel en bloques enteros de la imagen
+    unsigned block_bytes = fs->sb.block_size / 8;
+    unsigned ra = conn->max_readahead < BWFS_RA_MAX ? conn->max_readahead
+                                                    : BWFS_RA_MAX;
+    if (block_bytes > 0 && ra >= block_bytes) ra -= ra % block_bytes;
+    conn->max_readahead = ra;
+    if (conn_opts) fuse_apply_conn_info_opts(conn_opts, conn);
+}
+
+static const struct fuse_lowlevel_ops bwfs_ll_ops = {
+    .init         = bwfs_init,
+    .lookup       = bwfs_lookup,
+    .forget       = bwfs_forget,
+    .forget_multi = bwfs_forget_multi,
+    .getattr      = bwfs_getattr,
+    .setattr      = bwfs_setattr,
+    .opendir      = bwfs_opendir,
+    .readdir      = bwfs_readdir,
+    .readdirplus  = bwfs_readdirplus,
+    .releasedir   = bwfs_releasedir,
+    .create       = bwfs_create,
+    .open         = bwfs_open,
+    .read         = bwfs_read,
+    .write_buf    = bwfs_write_buf,
+    .fallocate    = bwfs_fallocate,
+    .mkdir        = bwfs_mkdir,
+    .unlink       = bwfs_unlink,
+    .rmdir        = bwfs_rmdir,
+    .rename       = bwfs_rename,
+    .access       = bwfs_access,
+    .release      = bwfs_release,
+    .flush        = bwfs_flush,
+    .fsync        = bwfs_fsync,
+    .statfs       = bwfs_statfs,
+    .lseek        = bwfs_lseek,
+};
+
+#define BWFS_OPT(t, field, v) { t, offsetof(BwfsOptions, field), v }
+
+static const struct fuse_opt bwfs_opt_spec[] = {
+    BWFS_OPT("-c %ld",              cache_mb,         0),
+    BWFS_OPT("cache_mb=%ld",        cache_mb,         0),
+    BWFS_OPT("entry_timeout=%lf",   entry_timeout,    0),
+    BWFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    BWFS_OPT("attr_timeout=%lf",    attr_timeout,     0),
+    BWFS_OPT("kernel_cache",        kernel_cache,     1),
+    BWFS_OPT("auto_cache",          auto_cache,       1),
+    BWFS_OPT("writeback",           writeback,        1),
+    FUSE_OPT_END
 };
 
+// El primer argumento suelto es la carpeta de la imagen; el resto (punto de
+// montaje y opciones de FUSE) sigue hacia libfuse
+static int bwfs_opt_proc(void *data, const char *arg, int key,
+                         struct fuse_args *outargs)
+{
+    (void)outargs;
+    BwfsOptions *o = data;
+    if (key == FUSE_OPT_KEY_NONOPT && !o->folder) {
+        o->folder = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c cache_mb] [options] <bwfs_folder> <mount_point>\n"
+            "    -o cache_mb=N           segment cache budget in MiB (0 = unlimited)\n"
+            "    -o entry_timeout=T      name cache timeout (default 10 s)\n"
+            "    -o negative_timeout=T   missing-name cache timeout (default 10 s)\n"
+            "    -o attr_timeout=T       attribute cache timeout (default 10 s)\n"
+            "    -o kernel_cache         keep page cache across opens\n"
+            "    -o auto_cache           same, invalidated on size/mtime changes\n"
+            "    -o writeback            kernel write-back cache (batches small writes)\n",
+            prog);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <bwfs_folder> <mount_point>\n", argv[0]);
-        return 1;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    int rc = 1;
+    if (fuse_opt_parse(&args, &opts, bwfs_opt_spec, bwfs_opt_proc) != 0 ||
+        fuse_parse_cmdline(&args, &cmd) != 0)
+        goto out;
+    if (cmd.show_help) {
+        usage(argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        rc = 0;
+        goto out;
     }
-    fs_folder = argv[1];
-    fs        = fs_load(fs_folder);
+    if (cmd.show_version) {
+        fuse_lowlevel_version();
+        rc = 0;
+        goto out;
+    }
+    if (!opts.folder || !cmd.mountpoint) {
+        usage(argv[0]);
+        goto out;
+    }
+    // max_write, max_readahead, writeback_cache... se aplican en init
+    conn_opts = fuse_parse_conn_info_opts(&args);
+    if (!conn_opts) goto out;
+
+    // Ruta absoluta: al pasar a segundo plano el directorio actual es "/"
+    fs_folder = realpath(opts.folder, NULL);
+    fs        = fs_folder ? fs_load(fs_folder) : NULL;
     if (!fs) {
-        fprintf(stderr, "Error loading BWFS from '%s'\n", fs_folder);
-        return 1;
+        fprintf(stderr, "Error loading BWFS from '%s'\n", opts.folder);
+        goto out;
     }
-    // Build minimal argv for fuse_main
-    char *fuse_argv[] = { argv[0], argv[2], NULL };
-    int fuse_argc = 2;
-    return fuse_main(fuse_argc, fuse_argv, &bwfs_ops, NULL);
-}
\ No newline at end of file
+    // Presupuesto de la caché de segmentos (0 = sin límite)
+    if (opts.cache_mb >= 0)
+        fs_set_cache_budget(fs, (size_t)opts.cache_mb << 20);
+
+    // Las demás opciones (allow_other, max_read, fsname, debug...) son de
+    // la sesión y del montaje
+    struct fuse_session *se = fuse_session_new(&args, &bwfs_ll_ops,
+                                               sizeof(bwfs_ll_ops), NULL);
+    if (se) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, cmd.mountpoint) == 0) {
+                fuse_daemonize(cmd.foreground);
+                rc = cmd.singlethread ? fuse_session_loop(se)
+                                      : fuse_session_loop_mt(se, cmd.clone_fd);
+                rc = rc ? 1 : 0;
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+    fs_destroy(fs);
+
+out:
+    free(conn_opts);
+    free(cmd.mountpoint);
+    free(opts.folder);
+    fuse_opt_free_args(&args);
+    return rc;
+}
@@ -1,21 +1,110 @@
+#define _XOPEN_SOURCE 700
 #include "pbm_manager.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int pbm_alloc_dirty(PBMImage *img) {
+    size_t payload = img->stride_bytes * img->height;
+    size_t chunks  = (payload + (1u << PBM_DIRTY_SHIFT) - 1) >> PBM_DIRTY_SHIFT;
+    img->dirty_words = (chunks + 63) / 64;
+    img->dirty = calloc(img->dirty_words, sizeof(uint64_t));
+    return img->dirty ? 0 : -1;
+}
+
+void pbm_mark_dirty(PBMImage *img, size_t byte_off, size_t len) {
+    if (!img || !img->dirty || len == 0) return;
+    size_t first = byte_off >> PBM_DIRTY_SHIFT;
+    size_t last  = (byte_off + len - 1) >> PBM_DIRTY_SHIFT;
+    if (last >= img->dirty_words * 64) last = img->dirty_words * 64 - 1;
+    for (size_t c = first; c <= last; ++c)
+        img->dirty[c / 64] |= (uint64_t)1 << (c % 64);
+}
+
+int pbm_is_dirty(const PBMImage *img) {
+    if (!img || !img->dirty) return 0;
+    for (size_t w = 0; w < img->dirty_words; ++w)
+        if (img->dirty[w]) return 1;
+    return 0;
+}
+
+void pbm_clear_dirty(PBMImage *img) {
+    if (img && img->dirty)
+        memset(img->dirty, 0, img->dirty_words * sizeof(uint64_t));
+}
+
+// Busca el siguiente tramo sucio desde *chunk; deja en [*chunk, *end) la
+// racha de tramos consecutivos. Retorna 0 si no queda ninguno.
+static int pbm_next_dirty_run(const PBMImage *img, size_t *chunk, size_t *end) {
+    size_t total = img->dirty_words * 64;
+    size_t c = *chunk;
+    while (c < total) {
+        uint64_t w = img->dirty[c / 64] >> (c % 64);
+        if (w) { c += __builtin_ctzll(w); break; }
+        c = (c / 64 + 1) * 64;
+    }
+    if (c >= total) return 0;
+    size_t e = c;
+    while (e < total && (img->dirty[e / 64] >> (e % 64)) & 1) ++e;
+    *chunk = c;
+    *end   = e;
+    return 1;
+}
 
 PBMImage *pbm_create(int width, int height) {
-    PBMImage *img = malloc(sizeof(PBMImage));
+    PBMImage *img = calloc(1, sizeof(PBMImage));
     if (!img) return NULL;
     img->width = width;
     img->height = height;
     img->stride_bytes = (width + 7) / 8;
+    img->header_len = (size_t)snprintf(NULL, 0, "P4\n%d %d\n", width, height);
     img->bits = calloc(img->stride_bytes * height, 1);
-    if (!img->bits) { free(img); return NULL; }
+    if (!img->bits || pbm_alloc_dirty(img) < 0) {
+        free(img->bits);
+        free(img);
+        return NULL;
+    }
+    // Nunca guardada: todo el contenido está pendiente
+    pbm_mark_dirty(img, 0, img->stride_bytes * height);
     return img;
 }
 
 void pbm_free(PBMImage *img) {
-    if (img) { free(img->bits); free(img); }
+    if (!img) return;
+    free(img->dirty);
+    if (img->map) munmap(img->map, img->map_len);
+    else          free(img->bits);
+    free(img);
+}
+
+// Mapea el payload de path sobre img (la cabecera ocupa header_len bytes)
+static int pbm_map_file(PBMImage *img, const char *path, size_t header_len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    size_t len = header_len + img->stride_bytes * img->height;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < len) {
+        close(fd);
+        return -1;
+    }
+    // Mapeo privado: las modificaciones no llegan al archivo hasta que se
+    // escriben explícitamente, así el disco sólo cambia al confirmar
+    void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+
+    img->map        = m;
+    img->map_len    = len;
+    img->header_len = header_len;
+    img->dev        = st.st_dev;
+    img->ino        = st.st_ino;
+    img->bits       = (uint8_t *)m + header_len;
+    return 0;
 }
 
 int pbm_get_pixel(const PBMImage *img, int x, int y) {
@@ -29,6 +118,7 @@ int pbm_set_pixel(PBMImage *img, int x, int y, int value) {
     if (!img || x < 0 || y < 0 || x >= img->width || y >= img->height) return -1;
     int byte_offset = y * img->stride_bytes + (x / 8);
     int bit_offset = 7 - (x % 8);
+    pbm_mark_dirty(img, byte_offset, 1);
     if (value)
         img->bits[byte_offset] |= (1 << bit_offset);
     else
@@ -36,6 +126,108 @@ int pbm_set_pixel(PBMImage *img, int x, int y, int value) {
     return 0;
 }
 
+// Lectura/escritura big-endian de 64 bits (el bit 7 del byte 0 es el primer píxel)
+static inline uint64_t load_be64(const uint8_t *p) {
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+           ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+           ((uint64_t)p[6] << 8)  |  (uint64_t)p[7];
+}
+
+static inline void store_be64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; --i) { p[i] = (uint8_t)v; v >>= 8; }
+}
+
+// Copia nbits desde src (a partir del bit src_bit) hacia dst, que inicia en
+// frontera de byte. Los bits sobrantes del último byte parcial se conservan.
+static void copy_bits_aligned_dst(uint8_t *dst, const uint8_t *src,
+                                  size_t src_bit, size_t nbits) {
+    src += src_bit / 8;
+    unsigned sh     = src_bit % 8;
+    size_t   nbytes = nbits / 8;
+    unsigned rem    = nbits % 8;
+
+    if (sh == 0) {
+        memcpy(dst, src, nbytes);
+    } else {
+        size_t i = 0;
+        for (; i + 8 <= nbytes; i += 8) {
+            uint64_t w = (load_be64(src + i) << sh) | (src[i + 8] >> (8 - sh));
+            store_be64(dst + i, w);
+        }
+        for (; i < nbytes; ++i)
+            dst[i] = (uint8_t)((src[i] << sh) | (src[i + 1] >> (8 - sh)));
+    }
+    if (rem) {
+        uint8_t v = (uint8_t)(src[nbytes] << sh);
+        if (sh + rem > 8) v |= (uint8_t)(src[nbytes + 1] >> (8 - sh));
+        uint8_t mask = (uint8_t)(0xFF << (8 - rem));
+        dst[nbytes] = (uint8_t)((dst[nbytes] & ~mask) | (v & mask));
+    }
+}
+
+// Copia nbits entre dos buffers direccionados por bit (MSB primero)
+static void copy_bits(uint8_t *dst, size_t dst_bit,
+                      const uint8_t *src, size_t src_bit, size_t nbits) {
+    dst += dst_bit / 8;
+    unsigned dsh = dst_bit % 8;
+    if (dsh && nbits) {
+        unsigned head = 8 - dsh;
+        if (head > nbits) head = (unsigned)nbits;
+        uint8_t v = 0;
+        copy_bits_aligned_dst(&v, src, src_bit, head);
+        uint8_t mask = (uint8_t)((uint8_t)(0xFF << (8 - head)) >> dsh);
+        *dst = (uint8_t)((*dst & ~mask) | ((v >> dsh) & mask));
+        dst++;
+        src_bit += head;
+        nbits   -= head;
+    }
+    if (nbits) copy_bits_aligned_dst(dst, src, src_bit, nbits);
+}
+
+// Recorre el rango lineal [bit_off, bit_off+nbits) de la imagen por tramos
+// contiguos en memoria (uno solo si las filas no tienen relleno).
+static int pbm_copy_run(PBMImage *img, size_t bit_off,
+                        uint8_t *buf, size_t nbits, int to_image) {
+    if (!img || (!buf && nbits)) return -1;
+    size_t width = (size_t)img->width;
+    if (bit_off + nbits > width * (size_t)img->height) return -1;
+    if (to_image && nbits) {
+        size_t first = (bit_off / width) * img->stride_bytes + (bit_off % width) / 8;
+        size_t end   = bit_off + nbits - 1;
+        size_t last  = (end / width) * img->stride_bytes + (end % width) / 8;
+        pbm_mark_dirty(img, first, last - first + 1);
+    }
+
+    if (width == img->stride_bytes * 8) {
+        if (to_image) copy_bits(img->bits, bit_off, buf, 0, nbits);
+        else          copy_bits(buf, 0, img->bits, bit_off, nbits);
+        return 0;
+    }
+
+    size_t done = 0;
+    while (done < nbits) {
+        size_t y   = bit_off / width;
+        size_t x   = bit_off % width;
+        size_t run = width - x;
+        if (run > nbits - done) run = nbits - done;
+        size_t img_bit = y * img->stride_bytes * 8 + x;
+        if (to_image) copy_bits(img->bits, img_bit, buf, done, run);
+        else          copy_bits(buf, done, img->bits, img_bit, run);
+        done    += run;
+        bit_off += run;
+    }
+    return 0;
+}
+
+int pbm_read_bits(const PBMImage *img, size_t bit_off, void *buf, size_t nbits) {
+    return pbm_copy_run((PBMImage *)img, bit_off, (uint8_t *)buf, nbits, 0);
+}
+
+int pbm_write_bits(PBMImage *img, size_t bit_off, const void *buf, size_t nbits) {
+    return pbm_copy_run(img, bit_off, (uint8_t *)buf, nbits, 1);
+}
+
 PBMImage *pbm_load(const char *filename) {
     FILE *f = fopen(filename, "rb");
     if (!f) return NULL;
@@ -58,7 +250,8 @@ PBMImage *pbm_load(const char *filename) {
     fgetc(f);
 
     size_t stride = (width + 7) / 8;
-    PBMImage *img = malloc(sizeof(PBMImage));
+    size_t header_len = (size_t)ftell(f);
+    PBMImage *img = calloc(1, sizeof(PBMImage));
     if (!img) {
         fclose(f);
         return NULL;
@@ -66,8 +259,22 @@ PBMImage *pbm_load(const char *filename) {
     img->width = width;
     img->height = height;
     img->stride_bytes = stride;
+    img->header_len = header_len;
+    if (pbm_alloc_dirty(img) < 0) {
+        free(img);
+        fclose(f);
+        return NULL;
+    }
+
+    // Carga sin copia: los píxeles se leen bajo demanda desde el page cache
+    if (pbm_map_file(img, filename, header_len) == 0) {
+        fclose(f);
+        return img;
+    }
+
     img->bits = malloc(stride * height);
     if (!img->bits) {
+        free(img->dirty);
         free(img);
         fclose(f);
         return NULL;
@@ -76,6 +283,7 @@ PBMImage *pbm_load(const char *filename) {
     size_t read = fread(img->bits, 1, stride * height, f);
     if (read != stride * height) {
         free(img->bits);
+        free(img->dirty);
         free(img);
         fclose(f);
         return NULL;
@@ -85,11 +293,119 @@ PBMImage *pbm_load(const char *filename) {
     return img;
 }
 
+// ¿path es el archivo que respalda el mapeo de img?
+static int pbm_is_backing(const PBMImage *img, const char *path) {
+    struct stat st;
+    return img->map && stat(path, &st) == 0 &&
+           st.st_dev == img->dev && st.st_ino == img->ino;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) return -1;
+        p   += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+// Escribe con pwrite sobre fd (archivo existente del tamaño correcto) los
+// tramos sucios de img, o todo el payload si all != 0. Nunca trunca: el
+// archivo puede estar respaldando el mapeo de la propia imagen.
+static int pbm_pwrite_payload(const PBMImage *img, int fd, int all) {
+    size_t payload = img->stride_bytes * img->height;
+    size_t chunk = 0, end;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != img->header_len + payload)
+        return -1;
+    if (all) {
+        return pwrite(fd, img->bits, payload, (off_t)img->header_len)
+                   == (ssize_t)payload ? 0 : -1;
+    }
+    while (pbm_next_dirty_run(img, &chunk, &end)) {
+        size_t lo = chunk << PBM_DIRTY_SHIFT;
+        size_t hi = end << PBM_DIRTY_SHIFT;
+        if (hi > payload) hi = payload;
+        if (pwrite(fd, img->bits + lo, hi - lo, (off_t)(img->header_len + lo))
+                != (ssize_t)(hi - lo))
+            return -1;
+        chunk = end;
+    }
+    return 0;
+}
+
 int pbm_save(const PBMImage *img, const char *path) {
+    if (!img) return -1;
+    // Sobre el archivo mapeado no se puede truncar: se reescribe en su lugar
+    if (pbm_is_backing(img, path)) {
+        int fd = open(path, O_WRONLY);
+        if (fd < 0) return -1;
+        int rc = pbm_pwrite_payload(img, fd, 1);
+        return (close(fd) == 0 && rc == 0) ? 0 : -1;
+    }
+
     FILE *f = fopen(path, "wb");
     if (!f) return -1;
     fprintf(f, "P4\n%d %d\n", img->width, img->height);
-    fwrite(img->bits, 1, img->stride_bytes * img->height, f);
-    fclose(f);
+    size_t len = img->stride_bytes * img->height;
+    size_t wr  = fwrite(img->bits, 1, len, f);
+    if (fclose(f) != 0 || wr != len) return -1;
+    return 0;
+}
+
+int pbm_save_atomic(const PBMImage *img, const char *path) {
+    if (!img) return -1;
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    char header[64];
+    int hlen = snprintf(header, sizeof(header), "P4\n%d %d\n", img->width, img->height);
+    if (write_all(fd, header, (size_t)hlen) < 0 ||
+        write_all(fd, img->bits, img->stride_bytes * img->height) < 0 ||
+        fsync(fd) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int pbm_sync(PBMImage *img, const char *path) {
+    if (!img) return -1;
+    if (!pbm_is_dirty(img)) return 0;
+
+    int rc = -1;
+    int fd = open(path, O_WRONLY);
+    if (fd >= 0) {
+        rc = pbm_pwrite_payload(img, fd, 0);
+        if (close(fd) < 0) rc = -1;
+    }
+    if (rc < 0 && pbm_save(img, path) < 0) return -1;
+    pbm_clear_dirty(img);
+    return 0;
+}
+
+int pbm_attach_file(PBMImage *img, const char *path) {
+    if (!img) return -1;
+    if (pbm_is_backing(img, path)) return 0;
+    // Con cambios pendientes el archivo no refleja el contenido en memoria
+    if (pbm_is_dirty(img)) return -1;
+
+    void    *old_map = img->map;
+    size_t   old_len = img->map_len;
+    uint8_t *heap    = img->bits;
+    int header_len = snprintf(NULL, 0, "P4\n%d %d\n", img->width, img->height);
+    if (pbm_map_file(img, path, (size_t)header_len) < 0) return -1;
+    if (old_map) munmap(old_map, old_len);
+    else         free(heap);
+    return 0;
+}
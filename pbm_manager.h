@@ -3,19 +3,62 @@
 
 #include <stddef.h>  // Para size_t
 #include <stdint.h>  // Para uint8_t
+#include <sys/types.h>  // Para dev_t, ino_t
+
+// Granularidad del seguimiento de cambios: tramos de 4 KB del payload
+#define PBM_DIRTY_SHIFT 12
 
 typedef struct {
     int width;
     int height;
     size_t stride_bytes;
-    uint8_t *bits;
+    uint8_t *bits;         // Píxeles (en el heap o dentro del mapeo)
+    // Respaldo mmap: bits apunta al payload P4 tras la cabecera.
+    // map == NULL si la imagen vive sólo en memoria.
+    void  *map;
+    size_t map_len;
+    size_t header_len;
+    dev_t  dev;            // Identidad del archivo mapeado
+    ino_t  ino;
+    // Un bit por tramo de 2^PBM_DIRTY_SHIFT bytes modificado desde el último
+    // pbm_sync (o pbm_save) exitoso
+    uint64_t *dirty;
+    size_t    dirty_words;
 } PBMImage;
 
 PBMImage *pbm_create(int width, int height);
 void pbm_free(PBMImage *img);
 int pbm_get_pixel(const PBMImage *img, int x, int y);
 int pbm_set_pixel(PBMImage *img, int x, int y, int value);
+
+// Copia de rangos de bits arbitrarios (no alineados) entre la imagen y un
+// buffer de bytes. bit_off es el índice lineal de píxel (y * width + x) y el
+// buffer se recorre MSB primero desde su bit 0. Retornan 0 o -1 si el rango
+// se sale de la imagen.
+int pbm_read_bits(const PBMImage *img, size_t bit_off, void *buf, size_t nbits);
+int pbm_write_bits(PBMImage *img, size_t bit_off, const void *buf, size_t nbits);
+
+// Carga mapeando el archivo (MAP_PRIVATE: el disco sólo cambia al guardar);
+// si mmap falla se lee a memoria
 PBMImage *pbm_load(const char *filename);
+// Guarda la imagen completa en path (en su lugar si path es el archivo mapeado)
 int pbm_save(const PBMImage *img, const char *path);
+// Guarda en path.tmp, hace fsync y lo renombra a path
+int pbm_save_atomic(const PBMImage *img, const char *path);
+// Escribe en path sólo los tramos modificados (pwrite si ya existe con el
+// mismo tamaño, guardado completo si no) y limpia el registro. Una imagen
+// limpia no toca el disco. fs_save no lo usa: escribir en su lugar no es
+// atómico, así que confirma cada segmento con cambios reescribiéndolo entero
+// con pbm_save_atomic; el registro sólo decide qué segmentos se reescriben.
+int pbm_sync(PBMImage *img, const char *path);
+
+// Registro de tramos modificados (byte_off/len relativos al payload)
+void pbm_mark_dirty(PBMImage *img, size_t byte_off, size_t len);
+int  pbm_is_dirty(const PBMImage *img);
+void pbm_clear_dirty(PBMImage *img);
+
+// Pasa a mapear path, que debe contener ya lo mismo que la imagen (recién
+// guardada y sin cambios pendientes); libera el buffer o mapeo anterior
+int pbm_attach_file(PBMImage *img, const char *path);
 
 #endif
\ No newline at end of file
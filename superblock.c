@@ -13,25 +13,49 @@ uint32_t sb_checksum(const Superblock *sb) {
     return sum;
 }
 
+static uint32_t gcd_u32(uint32_t a, uint32_t b) {
+    while (b) { uint32_t t = a % b; a = b; b = t; }
+    return a;
+}
+
+uint32_t sb_align_bits(uint32_t features, uint32_t width) {
+    if (features & BWFS_FEAT_ALIGN_ROW)
+        return 64 / gcd_u32(64, width) * width;  // mcm(64, width)
+    if (features & BWFS_FEAT_ALIGN64)
+        return 64;
+    return 1;
+}
+
+static size_t align_up(size_t v, size_t a) {
+    return (v + a - 1) / a * a;
+}
+
+void sb_compute_layout(Superblock *sb) {
+    size_t a      = sb_align_bits(sb->features, sb->width);
+    size_t s_bits = sizeof(Superblock) * 8;
+    size_t d_bits = (size_t)sb->max_files * sizeof(DirEntry) * 8;
+
+    sb->bitmap_offset = align_up(s_bits, a);
+    sb->dir_offset    = align_up(sb->bitmap_offset + sb->block_count, a);
+    sb->data_offset   = align_up(sb->dir_offset + d_bits, a);
+}
+
 void sb_init(Superblock *sb, int width, int height, int block_size,
              int block_count, int max_files, int max_blocks_per_file) {
     memset(sb, 0, sizeof(*sb));
     sb->magic               = BWFS_MAGIC;
+    sb->version             = BWFS_FORMAT_VERSION;
     sb->width               = width;
     sb->height              = height;
     sb->block_size          = block_size;
     sb->block_count         = block_count;
     sb->max_files           = max_files;
+    sb->dir_entries         = max_files;
     sb->max_blocks_per_file = max_blocks_per_file;
     sb->signature           = BWFS_SIGNATURE;
 
     // Calcular offsets
-    size_t s_bits = sizeof(Superblock) * 8;
-    size_t d_bits = max_files * sizeof(DirEntry) * 8;
-
-    sb->bitmap_offset = s_bits;
-    sb->dir_offset    = s_bits + block_count;
-    sb->data_offset   = s_bits + block_count + d_bits;
+    sb_compute_layout(sb);
 
     // Inicializar checksum del directorio
     sb->dir_checksum = 0;
@@ -43,33 +67,24 @@ void sb_init(Superblock *sb, int width, int height, int block_size,
 
 int sb_save(const Superblock *sb, PBMImage *img) {
     if (!sb || !img) return -1;
-    const uint8_t *bytes = (const uint8_t*)sb;
-    for (size_t b = 0; b < sizeof(Superblock); ++b) {
-        for (int bit = 0; bit < 8; ++bit) {
-            int value = (bytes[b] >> (7 - bit)) & 1;
-            pbm_set_pixel(img, (b*8 + bit) % img->width, (b*8 + bit) / img->width, value);
-        }
-    }
-    return 0;
+    return pbm_write_bits(img, 0, sb, sizeof(Superblock) * 8);
 }
 
 int sb_load(Superblock *sb, const PBMImage *img) {
     if (!sb || !img) return -1;
     
-    uint8_t *bytes = (uint8_t*)sb;
-    for (size_t b = 0; b < sizeof(Superblock); ++b) {
-        bytes[b] = 0;
-        for (int bit = 0; bit < 8; ++bit) {
-            int value = pbm_get_pixel(img, (b*8 + bit) % img->width, (b*8 + bit) / img->width);
-            if (value < 0) return -1;
-            bytes[b] |= (value << (7 - bit));
-        }
-    }
+    if (pbm_read_bits(img, 0, sb, sizeof(Superblock) * 8) < 0) return -1;
     
     // Verificar magic number primero
     if (sb->magic != BWFS_MAGIC) {
         return -2;
     }
+
+    // Sin migración: las entradas y el superbloque cambiaron de disposición
+    if (sb->version != BWFS_FORMAT_VERSION) {
+        if (sb->version == BWFS_SIGNATURE) sb->version = 1;
+        return -4;
+    }
     
     // Verificar checksum
     uint32_t stored_checksum = sb->checksum;
@@ -5,13 +5,23 @@
 #include <stdint.h>
 
 #define BWFS_MAGIC 0x42574653u  // 'BWFS'
-#define BWFS_MAX_FILES 128
-#define BWFS_MAX_BLOCKS_PER_FILE 32
+#define BWFS_MAX_FILES 128         // Entradas en image_0 por omisión
+#define BWFS_MAX_BLOCKS_PER_FILE (1 << 24)  // Además, size es de 32 bits
 #define BWFS_FILENAME_MAXLEN 32
 #define BWFS_SIGNATURE 0x12345678  // Nuevo valor para la firma de la imagen inicial
 
+// Versión del formato en disco (superbloque y entradas). Va justo después de
+// magic para poder leerla en cualquier versión; las imágenes anteriores a este
+// campo tienen ahí la firma y cuentan como versión 1.
+#define BWFS_FORMAT_VERSION 2
+
+// Banderas de disposición (Superblock.features)
+#define BWFS_FEAT_ALIGN64   0x1u  // Regiones y tamaño de bloque múltiplos de 64 bits
+#define BWFS_FEAT_ALIGN_ROW 0x2u  // Además, múltiplos de una fila de la imagen
+
 typedef struct {
     uint32_t magic;
+    uint32_t version;    // BWFS_FORMAT_VERSION
     uint32_t signature;  // Firma para identificar la imagen inicial
     uint32_t width;
     uint32_t height;
@@ -22,6 +32,13 @@ typedef struct {
     uint32_t bitmap_offset;
     uint32_t dir_offset;
     uint32_t data_offset;
+    uint32_t features;       // BWFS_FEAT_*
+    // Tabla de entradas: max_files viven en image_0 (dir_offset); el resto en
+    // trozos de bloques de cualquier segmento, listados en el mapa de trozos
+    uint32_t dir_entries;    // Capacidad total de la tabla
+    uint32_t dir_chunks;     // Trozos fuera de image_0
+    uint32_t dir_map_block;  // Primer bloque global del mapa de trozos
+    uint32_t dir_map_blocks; // Bloques reservados para el mapa (0 = sin mapa)
     uint32_t checksum;
     uint32_t dir_checksum;
 } Superblock;
@@ -29,7 +46,13 @@ typedef struct {
 uint32_t sb_checksum(const Superblock *sb);
 void sb_init(Superblock *sb, int width, int height, int block_size,
              int block_count, int max_files, int max_blocks_per_file);
+// Granularidad (en bits) a la que se alinean regiones y bloques
+uint32_t sb_align_bits(uint32_t features, uint32_t width);
+// Recalcula bitmap/dir/data_offset según features, block_count y max_files
+void sb_compute_layout(Superblock *sb);
 int sb_save(const Superblock *sb, PBMImage *img);
+// 0; -1 error de lectura, -2 magic, -3 checksum, -4 versión de formato no
+// soportada (sb->version queda con la de la imagen)
 int sb_load(Superblock *sb, const PBMImage *img);
 
 #endif
\ No newline at end of file
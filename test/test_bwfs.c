@@ -1,3 +1,4 @@
+#define _XOPEN_SOURCE 700   // pthread_rwlock_t (fs_image.h), rand_r
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,13 +13,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define TEST_WIDTH       1024
 #define TEST_HEIGHT      1024
 #define TEST_BLOCK_SIZE  1024    // en bits
 #define TEST_PBM_FILE    "test.pbm"
 #define TEST_PBM_DIR     "test_pbm"
-#define MAX_FILE_SIZE   (BWFS_MAX_BLOCKS_PER_FILE * (TEST_BLOCK_SIZE / 8))
+#define MAX_FILE_SIZE   (32 * (TEST_BLOCK_SIZE / 8))   // Archivo grande de las pruebas
 
 // Función para generar datos aleatorios
 void generate_random_data(uint8_t *data, size_t size) {
@@ -61,6 +65,115 @@ static void test_pbm_manager(void) {
     printf("✔ pbm_manager\n");
 }
 
+// 1b) Copia de rangos de bits (alineados y no alineados)
+static void test_pbm_bits(void) {
+    printf("\n=== test_pbm_bits ===\n");
+    // Un ancho múltiplo de 8 (sin relleno) y uno con relleno al final de cada fila
+    int widths[] = {TEST_WIDTH, 1001};
+    for (int w = 0; w < 2; w++) {
+        int width = widths[w], height = 64;
+        PBMImage *img = pbm_create(width, height);
+        assert(img);
+        size_t total = (size_t)width * height;
+        uint8_t src[600], dst[600];
+
+        for (int iter = 0; iter < 200; iter++) {
+            size_t nbits = rand() % (sizeof(src) * 8);
+            size_t off   = rand() % (total - nbits);
+            generate_random_data(src, sizeof(src));
+            assert(pbm_write_bits(img, off, src, nbits) == 0);
+
+            // Comparar contra el acceso píxel a píxel
+            for (size_t i = 0; i < nbits; i++) {
+                size_t bit = off + i;
+                int expected = (src[i / 8] >> (7 - i % 8)) & 1;
+                assert(pbm_get_pixel(img, bit % width, bit / width) == expected);
+            }
+
+            memset(dst, 0, sizeof(dst));
+            assert(pbm_read_bits(img, off, dst, nbits) == 0);
+            assert(memcmp(src, dst, nbits / 8) == 0);
+            if (nbits % 8) {
+                uint8_t mask = (uint8_t)(0xFF << (8 - nbits % 8));
+                assert((src[nbits / 8] & mask) == dst[nbits / 8]);
+            }
+        }
+
+        // Fuera de rango
+        assert(pbm_read_bits(img, total - 7, dst, 8) == -1);
+        assert(pbm_write_bits(img, total, src, 1) == -1);
+        pbm_free(img);
+    }
+    printf("✔ pbm_bits\n");
+}
+
+// 1c) Imágenes respaldadas por mmap
+static void test_pbm_mmap(void) {
+    printf("\n=== test_pbm_mmap ===\n");
+    PBMImage *img = pbm_create(TEST_WIDTH, 16);
+    assert(img && img->map == NULL);
+    assert(pbm_set_pixel(img, 3, 2, 1) == 0);
+    assert(pbm_sync(img, TEST_PBM_FILE) == 0);
+
+    // Tras adjuntar el archivo, bits apunta al mapeo
+    assert(pbm_attach_file(img, TEST_PBM_FILE) == 0);
+    assert(img->map != NULL);
+    assert(pbm_get_pixel(img, 3, 2) == 1);
+
+    // Los cambios se escriben en su lugar sobre el mismo archivo
+    assert(pbm_set_pixel(img, 10, 5, 1) == 0);
+    assert(pbm_save(img, TEST_PBM_FILE) == 0);
+
+    PBMImage *img2 = pbm_load(TEST_PBM_FILE);
+    assert(img2 && img2->map != NULL);
+    assert(pbm_get_pixel(img2, 3, 2) == 1);
+    assert(pbm_get_pixel(img2, 10, 5) == 1);
+    assert(pbm_get_pixel(img2, 11, 5) == 0);
+
+    pbm_free(img);
+    pbm_free(img2);
+    remove(TEST_PBM_FILE);
+    printf("✔ pbm_mmap\n");
+}
+
+// 1d) Seguimiento de tramos modificados
+static void test_pbm_dirty(void) {
+    printf("\n=== test_pbm_dirty ===\n");
+    PBMImage *img = pbm_create(TEST_WIDTH, TEST_HEIGHT);
+    assert(img && pbm_is_dirty(img));     // Nunca guardada
+    assert(pbm_sync(img, TEST_PBM_FILE) == 0);
+    assert(!pbm_is_dirty(img));
+
+    // Imagen en memoria sobre un archivo existente: pwrite parcial
+    uint8_t ones[16];
+    memset(ones, 0xFF, sizeof(ones));
+    assert(pbm_write_bits(img, 100000, ones, sizeof(ones) * 8) == 0);
+    assert(pbm_is_dirty(img));
+    assert(pbm_sync(img, TEST_PBM_FILE) == 0);
+    assert(!pbm_is_dirty(img));
+
+    // Imagen mapeada (privada): pwrite de los tramos sucios
+    PBMImage *m = pbm_load(TEST_PBM_FILE);
+    assert(m && !pbm_is_dirty(m));
+    assert(pbm_get_pixel(m, 100000 % TEST_WIDTH, 100000 / TEST_WIDTH) == 1);
+    assert(pbm_set_pixel(m, 7, 900, 1) == 0);
+    assert(pbm_is_dirty(m));
+    assert(pbm_sync(m, TEST_PBM_FILE) == 0);
+    assert(!pbm_is_dirty(m));
+    pbm_free(m);
+
+    PBMImage *r = pbm_load(TEST_PBM_FILE);
+    assert(r);
+    assert(pbm_get_pixel(r, 7, 900) == 1);
+    assert(pbm_get_pixel(r, (100000 + 127) % TEST_WIDTH, (100000 + 127) / TEST_WIDTH) == 1);
+    assert(pbm_get_pixel(r, (100000 + 128) % TEST_WIDTH, (100000 + 128) / TEST_WIDTH) == 0);
+
+    pbm_free(r);
+    pbm_free(img);
+    remove(TEST_PBM_FILE);
+    printf("✔ pbm_dirty\n");
+}
+
 // 2) block_manager
 static void test_block_manager(void) {
     printf("\n=== test_block_manager ===\n");
@@ -99,10 +212,102 @@ static void test_block_manager(void) {
         assert(bm_free(&bm, i) == 0);
     }
     
+    bm_destroy(&bm);
     pbm_free(img);
     printf("✔ block_manager\n");
 }
 
+// 2b) búsqueda con resumen de palabras llenas (offset no alineado y
+//     última palabra parcial)
+static void test_bm_summary(void) {
+    printf("\n=== test_bm_summary ===\n");
+    PBMImage *img = pbm_create(TEST_WIDTH, TEST_HEIGHT);
+    BlockManager bm;
+    int total = 64 * 200 + 37;
+    bm_init(&bm, img, 13, total);
+
+    for (int i = 0; i < total; i++) assert(bm_alloc_first(&bm) == i);
+    assert(bm_alloc_first(&bm) == -1);
+
+    // Liberar en orden arbitrario; siempre se reasigna el menor libre
+    int holes[] = { total - 1, 64 * 150, 64 * 7 + 63, 4100, 0, 64 * 200 };
+    int sorted[] = { 0, 64 * 7 + 63, 4100, 64 * 150, 64 * 200, total - 1 };
+    for (int i = 0; i < 6; i++) assert(bm_free(&bm, holes[i]) == 0);
+    for (int i = 0; i < 6; i++) assert(bm_alloc_first(&bm) == sorted[i]);
+    assert(bm_alloc_first(&bm) == -1);
+
+    // Un gestor nuevo reconstruye el resumen desde la imagen
+    bm_free(&bm, 9000);
+    BlockManager bm2;
+    bm_init(&bm2, img, 13, total);
+    assert(bm_alloc_first(&bm2) == 9000);
+    assert(bm_alloc_first(&bm2) == -1);
+
+    bm_destroy(&bm2);
+    bm_destroy(&bm);
+    pbm_free(img);
+    printf("✔ bm_summary\n");
+}
+
+// 2c) Reserva de tramos contiguos (best-fit)
+static void test_bm_range(void) {
+    printf("\n=== test_bm_range ===\n");
+    PBMImage *img = pbm_create(TEST_WIDTH, TEST_HEIGHT);
+    BlockManager bm;
+    int total = 64 * 40 + 5;
+    bm_init(&bm, img, 3, total);
+    int got = 0;
+
+    // Imagen vacía: el único tramo empieza en 0
+    assert(bm_alloc_range(&bm, total, &got) == 0 && got == total);
+    assert(bm.free_count == 0);
+    assert(bm_alloc_range(&bm, 1, &got) == -1);
+
+    // Huecos de 3, 10 (cruzando palabra), 5 y 70 bloques
+    int starts[] = { 10, 60, 200, 1000 };
+    int lens[]   = { 3, 10, 5, 70 };
+    for (int h = 0; h < 4; h++)
+        for (int i = 0; i < lens[h]; i++) bm_free(&bm, starts[h] + i);
+
+    assert(bm_alloc_range(&bm, 5, &got) == 200 && got == 5);     // Exacto
+    assert(bm_alloc_range(&bm, 4, &got) == 60 && got == 4);      // Menor que cabe
+    assert(bm_alloc_range(&bm, 100, &got) == 1000 && got == 70); // Mayor disponible
+    assert(bm_is_allocated(&bm, 1069) == 1);
+    assert(bm_alloc_range(&bm, 3, &got) == 10 && got == 3);
+    assert(bm_alloc_range(&bm, 8, &got) == 64 && got == 6);
+    assert(bm_alloc_range(&bm, 1, &got) == -1);
+    assert(bm.free_count == 0);
+    bm_destroy(&bm);
+
+    // fs_write_file coloca el archivo completo en un tramo
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    uint8_t *data = malloc(MAX_FILE_SIZE), *rdata = malloc(MAX_FILE_SIZE);
+    assert(data && rdata);
+    generate_random_data(data, MAX_FILE_SIZE);
+    assert(fs_create_file(fs, "a") >= 0 && fs_create_file(fs, "b") >= 0);
+    assert(fs_write_file(fs, "a", data, 10 * (TEST_BLOCK_SIZE / 8)) >= 0);
+    assert(fs_write_file(fs, "b", data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    const DirEntry *e = dir_entry(&fs->dir, dir_find(&fs->dir, "b"));
+    assert(e->ext_count == 1 && e->ext[0].len == e->block_count);
+    assert(fs_read_file(fs, "b", rdata, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    assert(memcmp(data, rdata, MAX_FILE_SIZE) == 0);
+
+    // Un hueco de 10 bloques se reutiliza para un archivo que cabe en él
+    assert(fs_remove_file(fs, "a") == 0);
+    assert(fs_create_file(fs, "c") >= 0);
+    assert(fs_write_file(fs, "c", data, 7 * (TEST_BLOCK_SIZE / 8)) >= 0);
+    e = dir_entry(&fs->dir, dir_find(&fs->dir, "c"));
+    assert(e->ext_count == 1 && e->ext[0].start == 0 && e->ext[0].len == 7);
+    assert(fs_check_integrity(fs) == 0);
+
+    free(data);
+    free(rdata);
+    fs_destroy(fs);
+    pbm_free(img);
+    printf("✔ bm_range\n");
+}
+
 // 3) superblock
 static void test_superblock(void) {
     printf("\n=== test_superblock ===\n");
@@ -142,6 +347,14 @@ static void test_superblock(void) {
     assert(sb2.dir_offset == sb.dir_offset);
     assert(sb2.data_offset == sb.data_offset);
     assert(sb2.checksum == sb.checksum);
+    assert(sb2.version == BWFS_FORMAT_VERSION);
+
+    // Imagen anterior al campo version: ahí estaba la firma
+    Superblock old = sb;
+    old.version = BWFS_SIGNATURE;
+    assert(sb_save(&old, img) == 0);
+    assert(sb_load(&sb2, img) == -4);
+    assert(sb2.version == 1);
     
     // Prueba de checksum inválido
     sb2.checksum = 0;
@@ -189,10 +402,65 @@ static void test_directory(void) {
     
     // Intentar eliminar archivo inexistente
     assert(dir_remove(&dir, "noexist.txt") == -1);
+    dir_destroy(&dir);
     
     printf("✔ directory\n");
 }
 
+// 4b) Índice de nombres y lista de entradas libres
+static void test_dir_index(void) {
+    printf("\n=== test_dir_index ===\n");
+    static Directory dir, copy;
+    dir_init(&dir);
+    char name[64];
+
+    for (int i = 0; i < BWFS_MAX_FILES; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        assert((i % 3 ? dir_create(&dir, name) : dir_mkdir(&dir, name)) == i);
+    }
+    assert(dir.free_entries == 0);
+    assert(dir_create(&dir, "n5") == -1);   // Duplicado
+
+    // Renombrar mueve la entrada de cubeta sin cambiar su índice
+    for (int i = 0; i < BWFS_MAX_FILES; i += 4) {
+        char to[32];
+        snprintf(name, sizeof(name), "n%d", i);
+        snprintf(to, sizeof(to), "renamed-%d", i);
+        assert(dir_rename(&dir, name, to) == i);
+        assert(dir_find(&dir, name) == -1);
+        assert(dir_find(&dir, to) == i);
+    }
+    assert(dir_rename(&dir, "n1", "n2") == -1);
+
+    // Los nombres se comparan por sus primeros BWFS_FILENAME_MAXLEN bytes
+    assert(dir_remove(&dir, "n1") == 0);
+    memset(name, 'z', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    assert(dir_create(&dir, name) == 1);
+    name[BWFS_FILENAME_MAXLEN - 1] = '\0';
+    assert(dir_find(&dir, name) == 1);
+
+    // Las libres se reutilizan de menor a mayor índice
+    assert(dir_remove(&dir, "n99") == 0);
+    assert(dir_remove(&dir, "n7") == 0);
+    assert(dir_create(&dir, "a") == 7);
+    assert(dir_create(&dir, "b") == 99);
+
+    // Reconstruir desde entries[] da el mismo resultado
+    dir_init(&copy);
+    for (int i = 0; i < BWFS_MAX_FILES; i++)
+        *dir_entry_mut(&copy, i) = *dir_entry(&dir, i);
+    dir_rebuild(&copy);
+    assert(copy.free_entries == dir.free_entries);
+    for (int i = 0; i < BWFS_MAX_FILES; i++)
+        assert(dir_find(&copy, dir_entry(&dir, i)->name) == i);
+    assert(dir_checksum(&copy) == dir_checksum(&dir));
+    dir_destroy(&copy);
+    dir_destroy(&dir);
+
+    printf("✔ dir_index\n");
+}
+
 // 5) Pruebas de archivos
 static void test_file_operations(FSImage *fs) {
     printf("\n=== test_file_operations ===\n");
@@ -403,11 +671,12 @@ static void test_boundaries(FSImage *fs) {
     assert(big_data);
     generate_random_data(big_data, MAX_FILE_SIZE + 1);
     
-    // Debería fallar
-    ssize_t result = fs_write_file(fs, full_file, big_data, MAX_FILE_SIZE + 1);
+    // El tamaño se guarda en 32 bits: más de 4 GiB debe fallar sin tocar datos
+    ssize_t result = fs_write_file(fs, full_file, big_data, (size_t)UINT32_MAX + 1);
     assert(result < 0);
     
-    // Escribir tamaño máximo
+    // Ya no hay tope de 32 bloques por archivo
+    assert(fs_write_file(fs, full_file, big_data, MAX_FILE_SIZE + 1) == (ssize_t)MAX_FILE_SIZE + 1);
     assert(fs_write_file(fs, full_file, big_data, MAX_FILE_SIZE) == (ssize_t)MAX_FILE_SIZE);
     
     free(big_data);
@@ -463,6 +732,25 @@ static void test_persistence(void) {
     // Leer archivo
     assert(fs_read_file(fs, filename, rdata, size) == (ssize_t)size);
     assert(memcmp(data, rdata, size) == 0);
+
+    // Guardar sin cambios no re-codifica metadatos ni toca imágenes
+    assert(fs_save(fs, fs_dir) == 0);
+    assert(!fs->meta_dirty);
+    for (int i = 0; i < fs->image_count; i++)
+        assert(!pbm_is_dirty(fs->images[i]));
+
+    // Un cambio marca sólo lo necesario y se persiste
+    generate_random_data(data, size);
+    assert(fs_write_file(fs, filename, data, size) == (ssize_t)size);
+    assert(fs->meta_dirty && fs->bcache.ndirty > 0);
+    assert(fs_flush(fs) == 0 && pbm_is_dirty(fs->images[0]));
+    assert(fs_save(fs, fs_dir) == 0);
+    fs_destroy(fs);
+    fs = fs_load(fs_dir);
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_read_file(fs, filename, rdata, size) == (ssize_t)size);
+    assert(memcmp(data, rdata, size) == 0);
     
     // Limpieza
     free(data);
@@ -505,7 +793,7 @@ static void test_fsck(void) {
     assert(e->block_count > 0);
     
     // Corromper un byte del archivo (cambiar 8 bits)
-    int block = e->blocks[0];
+    int block = e->ext[0].start;
     int offset = fs->sb.data_offset + block * fs->sb.block_size;
     for (int i = 0; i < 8; i++) {
         int x = (offset + i) % fs->images[0]->width;
@@ -707,14 +995,1401 @@ static void test_auto_expansion(void) {
     printf("✔ test_auto_expansion\n");
 }
 
+// 12) Caché de segmentos con presupuesto acotado
+static void fill_pattern(uint8_t *data, size_t size, int seed) {
+    for (size_t k = 0; k < size; k++) data[k] = (uint8_t)(seed * 31 + k * 7);
+}
+
+// Reescribe y relee sus archivos (seg<first>.bin, de step en step) mientras
+// otros hilos fuerzan expulsiones con escritura de otros segmentos
+typedef struct {
+    FSImage *fs;
+    int      first, step, count;
+} SegWorker;
+
+static void *seg_worker_run(void *arg) {
+    SegWorker *w = arg;
+    uint8_t data[4096], rdata[4096];
+    for (int round = 0; round < 3; round++) {
+        for (int i = w->first; i < w->count; i += w->step) {
+            char filename[32];
+            snprintf(filename, sizeof(filename), "seg%d.bin", i);
+            fill_pattern(data, sizeof(data), i + 1000 * (round + 1));
+            assert(fs_pwrite(w->fs, filename, data, sizeof(data), 0) == (ssize_t)sizeof(data));
+            assert(fs_pread(w->fs, filename, rdata, sizeof(rdata), 0) == (ssize_t)sizeof(rdata));
+            assert(memcmp(data, rdata, sizeof(data)) == 0);
+        }
+    }
+    return NULL;
+}
+
+static void test_segment_cache(void) {
+    printf("\n=== test_segment_cache ===\n");
+    const char *folder_path = "test_segment_cache";
+    __attribute__((unused)) int unused1 = system("rm -rf test_segment_cache");
+    assert(mkdir(folder_path, 0777) == 0);
+
+    FSImage *fs = fs_create(1000, 1000, TEST_BLOCK_SIZE);
+    assert(fs);
+    assert(fs_save(fs, folder_path) == 0);
+
+    // Presupuesto de dos segmentos: el resto se expulsa (y se escribe)
+    size_t seg = fs->images[0]->stride_bytes * fs->images[0]->height;
+    fs_set_cache_budget(fs, 2 * seg);
+
+    int file_count = 100;
+    size_t file_size = 4096;
+    uint8_t data[4096], rdata[4096];
+    for (int i = 0; i < file_count; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "seg%d.bin", i);
+        assert(fs_create_file(fs, filename) >= 0);
+        fill_pattern(data, file_size, i);
+        assert(fs_write_file(fs, filename, data, file_size) == (ssize_t)file_size);
+    }
+    assert(fs->image_count >= 4);
+
+    FSSegmentStats st;
+    fs_segment_stats(fs, &st);
+    printf("Segmentos %d, residentes %d, expulsiones %lu, escrituras %lu\n",
+           st.segments, st.resident, st.evictions, st.writebacks);
+    assert(st.evictions > 0 && st.writebacks > 0);
+    assert(st.resident <= 3);
+    assert(fs_save(fs, folder_path) == 0);
+    fs_destroy(fs);
+
+    // Al montar sólo se cargan image_0 y la última
+    fs = fs_load(folder_path);
+    assert(fs);
+    fs_segment_stats(fs, &st);
+    assert(st.resident == 2);
+    fs_set_cache_budget(fs, 2 * seg);
+
+    for (int i = 0; i < file_count; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "seg%d.bin", i);
+        fill_pattern(data, file_size, i);
+        assert(fs_read_file(fs, filename, rdata, file_size) == (ssize_t)file_size);
+        assert(memcmp(data, rdata, file_size) == 0);
+    }
+    fs_segment_stats(fs, &st);
+    assert(st.loads > 0 && st.resident <= 3);
+    assert(fs_check_integrity(fs) == 0);
+
+    // Expulsiones concurrentes: un segmento que se está escribiendo no se
+    // vuelve a leer del disco a medio escribir
+    SegWorker workers[4];
+    pthread_t th[4];
+    for (int t = 0; t < 4; t++) {
+        workers[t] = (SegWorker){ fs, t, 4, file_count };
+        assert(pthread_create(&th[t], NULL, seg_worker_run, &workers[t]) == 0);
+    }
+    for (int t = 0; t < 4; t++) assert(pthread_join(th[t], NULL) == 0);
+    assert(fs_save(fs, folder_path) == 0);
+    fs_destroy(fs);
+    fs = fs_load(folder_path);
+    assert(fs);
+    for (int i = 0; i < file_count; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "seg%d.bin", i);
+        fill_pattern(data, file_size, i + 3000);
+        assert(fs_read_file(fs, filename, rdata, file_size) == (ssize_t)file_size);
+        assert(memcmp(data, rdata, file_size) == 0);
+    }
+    assert(fs_check_integrity(fs) == 0);
+
+    fs_destroy(fs);
+    __attribute__((unused)) int unused2 = system("rm -rf test_segment_cache");
+    printf("✔ test_segment_cache\n");
+}
+
+// 13) Confirmación atómica de segmentos y recuperación tras una caída
+static void test_commit_recovery(void) {
+    printf("\n=== test_commit_recovery ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_commit test_commit_old test_commit_crash");
+    assert(mkdir("test_commit", 0777) == 0);
+
+    FSImage *fs = fs_create(1000, 1000, TEST_BLOCK_SIZE);
+    assert(fs);
+    uint8_t a[2048], b[2048], rd[2048];
+    fill_pattern(a, sizeof(a), 1);
+    fill_pattern(b, sizeof(b), 2);
+    assert(fs_create_file(fs, "data.bin") >= 0);
+    assert(fs_write_file(fs, "data.bin", a, sizeof(a)) == (ssize_t)sizeof(a));
+    assert(fs_save(fs, "test_commit") == 0);
+    r = system("cp -r test_commit test_commit_old");
+
+    assert(fs_write_file(fs, "data.bin", b, sizeof(b)) == (ssize_t)sizeof(b));
+    assert(fs_save(fs, "test_commit") == 0);
+    fs_destroy(fs);
+
+    // No quedan restos de la confirmación
+    assert(access("test_commit/" BWFS_COMMIT_MARKER, F_OK) != 0);
+    assert(access("test_commit/image_0.pbm" BWFS_STAGE_SUFFIX, F_OK) != 0);
+
+    // Caída antes del marcador: se descarta lo preparado
+    r = system("cp -r test_commit_old test_commit_crash && "
+               "cp test_commit/image_0.pbm test_commit_crash/image_0.pbm" BWFS_STAGE_SUFFIX);
+    fs = fs_load("test_commit_crash");
+    assert(fs);
+    assert(fs_read_file(fs, "data.bin", rd, sizeof(rd)) == (ssize_t)sizeof(rd));
+    assert(memcmp(rd, a, sizeof(a)) == 0);
+    assert(access("test_commit_crash/image_0.pbm" BWFS_STAGE_SUFFIX, F_OK) != 0);
+    fs_destroy(fs);
+
+    // Caída tras escribir el marcador: se completa la confirmación
+    r = system("cp test_commit/image_0.pbm test_commit_crash/image_0.pbm" BWFS_STAGE_SUFFIX
+               " && echo 0 > test_commit_crash/" BWFS_COMMIT_MARKER);
+    fs = fs_load("test_commit_crash");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_read_file(fs, "data.bin", rd, sizeof(rd)) == (ssize_t)sizeof(rd));
+    assert(memcmp(rd, b, sizeof(b)) == 0);
+    assert(access("test_commit_crash/" BWFS_COMMIT_MARKER, F_OK) != 0);
+    fs_destroy(fs);
+
+    // Marcador con más de 4096 segmentos: image_0 va al final de la lista
+    r = system("rm -rf test_commit_crash && cp -r test_commit_old test_commit_crash && "
+               "cp test_commit/image_0.pbm test_commit_crash/image_0.pbm" BWFS_STAGE_SUFFIX
+               " && (seq 1 5000; echo 0) > test_commit_crash/" BWFS_COMMIT_MARKER);
+    fs = fs_load("test_commit_crash");
+    assert(fs);
+    assert(fs_read_file(fs, "data.bin", rd, sizeof(rd)) == (ssize_t)sizeof(rd));
+    assert(memcmp(rd, b, sizeof(b)) == 0);
+    fs_destroy(fs);
+
+    // Si un renombrado falla, la carga falla y el marcador se conserva
+    r = system("mkdir test_commit_crash/image_0.pbm" BWFS_STAGE_SUFFIX
+               " && echo 0 > test_commit_crash/" BWFS_COMMIT_MARKER);
+    assert(fs_load("test_commit_crash") == NULL);
+    assert(access("test_commit_crash/" BWFS_COMMIT_MARKER, F_OK) == 0);
+    r = system("rmdir test_commit_crash/image_0.pbm" BWFS_STAGE_SUFFIX);
+    fs = fs_load("test_commit_crash");
+    assert(fs);
+    assert(access("test_commit_crash/" BWFS_COMMIT_MARKER, F_OK) != 0);
+    fs_destroy(fs);
+
+    r = system("rm -rf test_commit test_commit_old test_commit_crash");
+    printf("✔ test_commit_recovery\n");
+}
+
+// 14) Disposición alineada (camino rápido con memcpy)
+static void test_aligned_layout(void) {
+    printf("\n=== test_aligned_layout ===\n");
+    uint32_t modes[] = {BWFS_FEAT_ALIGN64, BWFS_FEAT_ALIGN_ROW};
+    for (int m = 0; m < 2; m++) {
+        __attribute__((unused)) int r = system("rm -rf test_aligned");
+        assert(mkdir("test_aligned", 0777) == 0);
+
+        FSCreateOptions opts = { .features = modes[m] };
+        FSImage *fs = fs_create_ex(TEST_WIDTH, TEST_HEIGHT, 1000, &opts);
+        assert(fs && fs->aligned);
+        assert(fs->sb.features & BWFS_FEAT_ALIGN64);
+        uint32_t a = (modes[m] & BWFS_FEAT_ALIGN_ROW) ? TEST_WIDTH : 64;
+        assert(fs->sb.block_size % a == 0 && fs->sb.block_size >= 1000);
+        assert(fs->sb.bitmap_offset % a == 0);
+        assert(fs->sb.dir_offset % a == 0);
+        assert(fs->sb.data_offset % a == 0);
+        assert(fs->sb.dir_offset >= fs->sb.bitmap_offset + fs->sb.block_count);
+        assert(fs->sb.data_offset + (size_t)fs->sb.block_count * fs->sb.block_size
+               <= (size_t)TEST_WIDTH * TEST_HEIGHT);
+
+        uint8_t data[3000], rdata[3000];
+        fill_pattern(data, sizeof(data), m);
+        assert(fs_create_file(fs, "aligned.bin") >= 0);
+        assert(fs_write_file(fs, "aligned.bin", data, sizeof(data)) == (ssize_t)sizeof(data));
+        assert(fs_save(fs, "test_aligned") == 0);
+        fs_destroy(fs);
+
+        fs = fs_load("test_aligned");
+        assert(fs && fs->aligned);
+        assert(fs_check_integrity(fs) == 0);
+        assert(fs_read_file(fs, "aligned.bin", rdata, sizeof(rdata)) == (ssize_t)sizeof(rdata));
+        assert(memcmp(data, rdata, sizeof(data)) == 0);
+        fs_destroy(fs);
+        r = system("rm -rf test_aligned");
+    }
+    printf("✔ test_aligned_layout\n");
+}
+
+// 15) Contadores de libres mantenidos (statfs en O(1))
+static void expect_counters(FSImage *fs) {
+    struct statvfs st;
+    assert(fs_statfs(fs, &st) == 0);
+    uint64_t freeb = 0;
+    for (int i = 0; i < fs->image_count; i++) {
+        BlockManager *bm = fs_bm(fs, i);
+        assert(bm);
+        for (uint32_t b = 0; b < fs->sb.block_count; b++)
+            if (bm_is_allocated(bm, b) == 0) freeb++;
+    }
+    uint32_t freee = 0;
+    for (uint32_t i = 0; i < fs->dir.max_entries; i++)
+        if (!dir_entry(&fs->dir, i)->used) freee++;
+    assert(freee == fs->dir.free_entries);
+    assert(st.f_bfree == freeb);
+    assert(st.f_blocks == (fsblkcnt_t)fs->image_count * fs->sb.block_count);
+    assert(st.f_ffree == freee + freeb * st.f_bsize / sizeof(DirEntry));
+}
+
+static void test_free_counters(void) {
+    printf("\n=== test_free_counters ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_counters");
+    assert(mkdir("test_counters", 0777) == 0);
+
+    FSImage *fs = fs_create(1000, 1000, TEST_BLOCK_SIZE);
+    assert(fs);
+    expect_counters(fs);
+
+    // Suficientes archivos llenos para forzar una segunda imagen
+    uint8_t *data = malloc(MAX_FILE_SIZE);
+    assert(data);
+    generate_random_data(data, MAX_FILE_SIZE);
+    int nfiles = (int)(fs->sb.block_count / (MAX_FILE_SIZE / (TEST_BLOCK_SIZE / 8))) + 2;
+    for (int i = 0; i < nfiles; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "c%d.bin", i);
+        assert(fs_create_file(fs, name) >= 0);
+        assert(fs_write_file(fs, name, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    }
+    assert(fs->image_count == 2);
+    expect_counters(fs);
+
+    // Borrar, reescribir más pequeño y crear directorios
+    assert(fs_remove_file(fs, "c0.bin") == 0);
+    assert(fs_write_file(fs, "c1.bin", data, 100) == 100);
+    assert(fs_mkdir(fs, "d") == 0);
+    expect_counters(fs);
+
+    assert(fs_save(fs, "test_counters") == 0);
+    fs_destroy(fs);
+
+    // Se reconstruyen al montar y fsck los contrasta
+    fs = fs_load("test_counters");
+    assert(fs);
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+    fs->free_blocks++;
+    assert(fs_check_integrity(fs) == -5);
+    fs->free_blocks--;
+    fs->dir.free_entries--;
+    assert(fs_check_integrity(fs) == -6);
+    fs->dir.free_entries++;
+
+    free(data);
+    fs_destroy(fs);
+    r = system("rm -rf test_counters");
+    printf("✔ test_free_counters\n");
+}
+
+// 16) Asignación entre segmentos: los huecos se reutilizan antes de crecer
+static void test_cross_segment_alloc(void) {
+    printf("\n=== test_cross_segment_alloc ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_cross_alloc");
+    assert(mkdir("test_cross_alloc", 0777) == 0);
+
+    FSImage *fs = fs_create(1000, 1000, TEST_BLOCK_SIZE);
+    assert(fs);
+    uint8_t *data = malloc(MAX_FILE_SIZE), *rdata = malloc(MAX_FILE_SIZE);
+    assert(data && rdata);
+
+    // Llenar tres segmentos
+    int nfiles = 0;
+    while (fs->image_count < 3) {
+        char name[32];
+        snprintf(name, sizeof(name), "x%d", nfiles);
+        assert(fs_create_file(fs, name) >= 0);
+        fill_pattern(data, MAX_FILE_SIZE, nfiles);
+        assert(fs_write_file(fs, name, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+        nfiles++;
+    }
+    assert(fs_save(fs, "test_cross_alloc") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_cross_alloc");
+    assert(fs);
+
+    // Sobrescrituras y reemplazos repetidos no deben añadir imágenes
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < nfiles; i += 2) {
+            char name[32];
+            snprintf(name, sizeof(name), "x%d", i);
+            fill_pattern(data, MAX_FILE_SIZE, i + round);
+            assert(fs_write_file(fs, name, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+        }
+        assert(fs_remove_file(fs, "x1") == 0);
+        assert(fs_create_file(fs, "x1") >= 0);
+        fill_pattern(data, MAX_FILE_SIZE, 1);
+        assert(fs_write_file(fs, "x1", data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    }
+    assert(fs->image_count == 3);
+
+    // Un hueco en image_0 se usa aunque la última tenga espacio
+    int first = dir_find(&fs->dir, "x0");
+    uint32_t hole = dir_entry(&fs->dir, first)->ext[0].start;
+    assert(fs_remove_file(fs, "x0") == 0);
+    assert(fs_create_file(fs, "y") >= 0);
+    assert(fs_write_file(fs, "y", data, 100) == 100);
+    assert(dir_entry(&fs->dir, dir_find(&fs->dir, "y"))->ext[0].start / fs->sb.block_count
+           == hole / fs->sb.block_count);
+
+    assert(fs_check_integrity(fs) == 0);
+    for (int i = 2; i < nfiles; i += 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "x%d", i);
+        fill_pattern(data, MAX_FILE_SIZE, i + 4);
+        assert(fs_read_file(fs, name, rdata, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+        assert(memcmp(data, rdata, MAX_FILE_SIZE) == 0);
+    }
+
+    free(data);
+    free(rdata);
+    fs_destroy(fs);
+    r = system("rm -rf test_cross_alloc");
+    printf("✔ test_cross_segment_alloc\n");
+}
+
+// 17) Directorios anidados y caché de rutas
+static void test_hierarchy(void) {
+    printf("\n=== test_hierarchy ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_hierarchy");
+    assert(mkdir("test_hierarchy", 0777) == 0);
+
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    Directory *dir = &fs->dir;
+    assert(fs_mkdir(fs, "/a") == 0);
+    assert(fs_mkdir(fs, "/a/b") == 0);
+    assert(fs_mkdir(fs, "a/b/c") == 0);
+    assert(fs_mkdir(fs, "/x/y") == -ENOENT);
+    assert(fs_mkdir(fs, "/a/b") == -EEXIST);
+    assert(fs_create_file(fs, "/a/b/c/f.txt") >= 0);
+    assert(fs_create_file(fs, "/a/f.txt") >= 0);
+    assert(fs_create_file(fs, "/f.txt") >= 0);
+    assert(fs_create_file(fs, "/f.txt/g") < 0);      // El padre no es directorio
+    assert(fs_mknod(fs, "/f.txt") == -EEXIST);
+    assert(fs_mknod(fs, "/x/f.txt") == -ENOENT);
+    assert(fs_mknod(fs, "/f.txt/g") == -ENOENT);
+
+    const char *msg = "profundo";
+    assert(fs_write_file(fs, "//a/b//c/f.txt/", msg, 8) == 8);
+    char rbuf[8];
+    assert(fs_read_file(fs, "a/b/c/f.txt", rbuf, 8) == 8);
+    assert(memcmp(rbuf, msg, 8) == 0);
+
+    // Mismo nombre en directorios distintos, hijos listados por padre
+    int fa = dir_find(dir, "/a/f.txt"), fr = dir_find(dir, "/f.txt");
+    assert(fa >= 0 && fr >= 0 && fa != fr);
+    int a = dir_find(dir, "/a");
+    int n = 0;
+    for (int i = dir_first_child(dir, a); i >= 0; i = dir_next_sibling(dir, i)) {
+        assert(dir_parent(dir, i) == a);
+        n++;
+    }
+    assert(n == 2);
+
+    // Una ruta repetida se resuelve desde la caché; las negativas también
+    unsigned long hits = dir->dc_hits;
+    int deep = dir_find(dir, "/a/b/c/f.txt");
+    assert(dir_find(dir, "/a/b/c/f.txt") == deep);
+    assert(dir_find(dir, "/a/b/nope") == -1);
+    assert(dir_find(dir, "/a/b/nope") == -1);
+    assert(dir->dc_hits >= hits + 2);
+    assert(fs_create_file(fs, "/a/b/nope") >= 0);   // Invalida la negativa
+    assert(dir_find(dir, "/a/b/nope") >= 0);
+
+    // Mover un directorio mueve su subárbol
+    assert(fs_rmdir(fs, "/a/b") == -ENOTEMPTY);
+    assert(fs_remove_file(fs, "/a/b") == -EISDIR);
+    assert(fs_remove_file(fs, "/a/b/missing") == -ENOENT);
+    assert(fs_rename(fs, "/a/b", "/a/b/c/b2") < 0);  // Dentro de sí mismo
+    assert(fs_rename(fs, "/a/b", "/moved") == 0);
+    assert(dir_find(dir, "/a/b/c/f.txt") == -1);
+    assert(dir_find(dir, "/moved/c/f.txt") == deep);
+
+    // Huecos reutilizados no deben resucitar rutas antiguas de la caché
+    assert(dir_find(dir, "/a/f.txt") == fa);
+    assert(fs_remove_file(fs, "/a/f.txt") == 0);
+    assert(fs_rmdir(fs, "/a") == 0);
+    assert(fs_mkdir(fs, "/z") == 0 && dir_find(dir, "/z") == a);
+    assert(fs_create_file(fs, "/z/f.txt") == fa);
+    assert(dir_find(dir, "/a/f.txt") == -1);
+
+    assert(fs_save(fs, "test_hierarchy") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_hierarchy");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_read_file(fs, "/moved/c/f.txt", rbuf, 8) == 8);
+    assert(memcmp(rbuf, msg, 8) == 0);
+    assert(dir_find(&fs->dir, "/z/f.txt") == fa);
+
+    fs_destroy(fs);
+    r = system("rm -rf test_hierarchy");
+    printf("✔ test_hierarchy\n");
+}
+
+// 18) Tabla de entradas que crece sobre bloques de datos
+static void test_dir_growth(void) {
+    printf("\n=== test_dir_growth ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_dir_growth");
+    assert(mkdir("test_dir_growth", 0777) == 0);
+
+    FSCreateOptions opts = { .dir_entries = 16 };
+    FSImage *fs = fs_create_ex(200, 200, TEST_BLOCK_SIZE, &opts);
+    assert(fs);
+    assert(fs->dir.max_entries == 16);
+
+    // Muchas más entradas que las que caben en image_0
+    const int nfiles = 150;
+    char name[32], rbuf[32];
+    assert(fs_mkdir(fs, "/d") == 0);
+    for (int i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof(name), "/d/f%d", i);
+        assert(fs_create_file(fs, name) >= 0);
+        assert(fs_write_file(fs, name, name, strlen(name)) == (ssize_t)strlen(name));
+    }
+    assert(fs->dir.max_entries > (uint32_t)nfiles);
+    assert(fs->sb.dir_chunks > 1);
+    assert(fs->image_count > 2);
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+
+    assert(fs_save(fs, "test_dir_growth") == 0);
+    assert(dir_dirty_count(&fs->dir) == 0);
+    uint32_t max_entries = fs->dir.max_entries;
+    fs_destroy(fs);
+
+    fs = fs_load("test_dir_growth");
+    assert(fs);
+    assert(fs->dir.max_entries == max_entries);
+    assert(fs_check_integrity(fs) == 0);
+    expect_counters(fs);
+    for (int i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof(name), "/d/f%d", i);
+        assert(fs_read_file(fs, name, rbuf, sizeof(rbuf)) == (ssize_t)strlen(name));
+        assert(memcmp(rbuf, name, strlen(name)) == 0);
+    }
+
+    // Un cambio pequeño sólo ensucia las entradas tocadas
+    assert(fs_remove_file(fs, "/d/f140") == 0);
+    assert(fs_rename(fs, "/d/f3", "/d/g3") == 0);
+    assert(dir_dirty_count(&fs->dir) <= 2);
+    assert(fs_save(fs, "test_dir_growth") == 0);
+    fs_destroy(fs);
+
+    fs = fs_load("test_dir_growth");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(dir_find(&fs->dir, "/d/f140") == -1);
+    assert(fs_read_file(fs, "/d/g3", rbuf, sizeof(rbuf)) == 5);
+    assert(memcmp(rbuf, "/d/f3", 5) == 0);
+
+    fs_destroy(fs);
+    r = system("rm -rf test_dir_growth");
+    printf("✔ test_dir_growth\n");
+}
+
+// 19) Archivos de muchos bloques: lista de tramos fuera de la entrada
+static void test_large_file(void) {
+    printf("\n=== test_large_file ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_large_file");
+    assert(mkdir("test_large_file", 0777) == 0);
+
+    FSCreateOptions opts = { .dir_entries = 16 };
+    FSImage *fs = fs_create_ex(320, 320, TEST_BLOCK_SIZE, &opts);
+    assert(fs);
+    size_t bb = TEST_BLOCK_SIZE / 8;
+
+    // Fragmentar image_0: archivos de un bloque, borrando uno de cada dos
+    char name[32];
+    int nsmall = 0;
+    while (fs->image_count == 1) {
+        snprintf(name, sizeof(name), "s%d", nsmall);
+        assert(fs_create_file(fs, name) >= 0);
+        assert(fs_write_file(fs, name, name, 4) == 4);
+        nsmall++;
+    }
+    for (int i = 0; i < nsmall; i += 2) {
+        snprintf(name, sizeof(name), "s%d", i);
+        assert(fs_remove_file(fs, name) == 0);
+    }
+
+    // Un archivo que ocupa los huecos y varios segmentos nuevos
+    size_t size = 400 * 1024 + 3;
+    uint8_t *data = malloc(size), *rdata = malloc(size);
+    assert(data && rdata);
+    fill_pattern(data, size, 7);
+    assert(fs_create_file(fs, "/big") >= 0);
+    assert(fs_write_file(fs, "/big", data, size) == (ssize_t)size);
+    int idx = dir_find(&fs->dir, "/big");
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    assert(e->block_count == (size + bb - 1) / bb);
+    assert(e->ext_count > BWFS_INLINE_EXTENTS);
+    assert(fs->image_count > 2);
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+
+    // Bloque lógico -> global por búsqueda binaria, igual que un recorrido lineal
+    FileMap fm;
+    fm_init(&fm);
+    assert(fm_push(&fm, 100, 3) == 0 && fm_push(&fm, 7, 1) == 0 &&
+           fm_push(&fm, 50, 10) == 0);
+    uint32_t run;
+    assert(fm_blocks(&fm) == 14);
+    assert(fm_lookup(&fm, 0, &run) == 100 && run == 3);
+    assert(fm_lookup(&fm, 3, &run) == 7 && run == 1);
+    assert(fm_lookup(&fm, 9, &run) == 55 && run == 5);
+    assert(fm_lookup(&fm, 14, &run) == -1);
+    fm_destroy(&fm);
+
+    assert(fs_save(fs, "test_large_file") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_large_file");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_read_file(fs, "/big", rdata, size) == (ssize_t)size);
+    assert(memcmp(data, rdata, size) == 0);
+
+    // Reescribir más pequeño libera los tramos y la lista extra
+    assert(fs_write_file(fs, "/big", data, 3 * bb) == (ssize_t)(3 * bb));
+    e = dir_entry(&fs->dir, dir_find(&fs->dir, "/big"));
+    assert(e->ext_count <= BWFS_INLINE_EXTENTS && e->block_count == 3);
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_remove_file(fs, "/big") == 0);
+    expect_counters(fs);
+
+    free(data);
+    free(rdata);
+    fs_destroy(fs);
+    r = system("rm -rf test_large_file");
+    printf("✔ test_large_file\n");
+}
+
+// 20) Lectura por offset
+static void test_pread(void) {
+    printf("\n=== test_pread ===\n");
+    // Bloques empaquetados (1024 bits) y no empaquetados (1001 bits)
+    int bsizes[] = {TEST_BLOCK_SIZE, 1001};
+    for (int m = 0; m < 2; m++) {
+        FSCreateOptions opts = { .dir_entries = 16 };
+        FSImage *fs = fs_create_ex(256, 256, bsizes[m], &opts);
+        assert(fs);
+
+        // Imágenes pequeñas: el archivo se reparte en tramos de varios segmentos
+        uint8_t *data = malloc(64 * 1024), *rdata = malloc(64 * 1024);
+        assert(data && rdata);
+        fill_pattern(data, 64 * 1024, m);
+        size_t size = 40 * 1024 + 17;
+        assert(fs_create_file(fs, "f") >= 0);
+        assert(fs_write_file(fs, "f", data, size) == (ssize_t)size);
+        assert(dir_entry(&fs->dir, dir_find(&fs->dir, "f"))->ext_count > 4);
+
+        // Trozos de 4 KB en secuencia reconstruyen el archivo
+        size_t got = 0;
+        for (;;) {
+            ssize_t n = fs_pread(fs, "f", rdata + got, 4096, (off_t)got);
+            assert(n >= 0);
+            if (n == 0) break;
+            got += (size_t)n;
+        }
+        assert(got == size && memcmp(data, rdata, size) == 0);
+
+        // Rebanadas arbitrarias, incluido el final del archivo
+        for (int k = 0; k < 200; k++) {
+            size_t off = (size_t)rand() % (size + 10);
+            size_t len = (size_t)rand() % 3000;
+            ssize_t n = fs_pread(fs, "f", rdata, len, (off_t)off);
+            size_t expect = off >= size ? 0 : (len < size - off ? len : size - off);
+            assert(n == (ssize_t)expect);
+            assert(memcmp(rdata, data + (off < size ? off : 0), expect) == 0);
+        }
+        assert(fs_pread(fs, "f", rdata, 10, -1) < 0);
+        assert(fs_pread(fs, "nope", rdata, 10, 0) < 0);
+
+        free(data);
+        free(rdata);
+        fs_destroy(fs);
+    }
+    printf("✔ test_pread\n");
+}
+
+// 21) Escritura parcial por offset
+static void test_pwrite(void) {
+    printf("\n=== test_pwrite ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_pwrite");
+    assert(mkdir("test_pwrite", 0777) == 0);
+
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    size_t cap = 256 * 1024;
+    uint8_t *model = calloc(1, cap), *rdata = malloc(cap), chunk[300];
+    assert(model && rdata);
+    assert(fs_create_file(fs, "log") >= 0);
+    assert(fs_create_file(fs, "other") >= 0);
+
+    // Anexos tipo log: el primer bloque no se mueve y los tramos se alargan
+    size_t size = 0;
+    for (int i = 0; i < 600; i++) {
+        size_t n = 1 + (size_t)rand() % sizeof(chunk);
+        fill_pattern(chunk, n, i);
+        assert(fs_pwrite(fs, "log", chunk, n, (off_t)size) == (ssize_t)n);
+        memcpy(model + size, chunk, n);
+        size += n;
+        if (i == 300) assert(fs_write_file(fs, "other", chunk, 10) == 10);
+    }
+    const DirEntry *e = dir_entry(&fs->dir, dir_find(&fs->dir, "log"));
+    assert(e->size == size);
+    assert(e->ext_count <= 2);
+    uint32_t first_block = e->ext[0].start;
+
+    // Sobrescritura en medio y escritura tras un hueco (que queda a ceros)
+    fill_pattern(chunk, sizeof(chunk), 99);
+    assert(fs_pwrite(fs, "log", chunk, sizeof(chunk), 1000) == (ssize_t)sizeof(chunk));
+    memcpy(model + 1000, chunk, sizeof(chunk));
+    size_t gap_at = size + 5000;
+    assert(fs_pwrite(fs, "log", chunk, 7, (off_t)gap_at) == 7);
+    memcpy(model + gap_at, chunk, 7);
+    size = gap_at + 7;
+    assert(fs_pwrite(fs, "log", chunk, 0, 0) == 0);
+    assert(fs_pwrite(fs, "log", chunk, 1, -1) < 0);
+    assert(fs_pwrite(fs, "nope", chunk, 1, 0) < 0);
+
+    e = dir_entry(&fs->dir, dir_find(&fs->dir, "log"));
+    assert(e->size == size && e->ext[0].start == first_block);
+    assert(fs_read_file(fs, "log", rdata, cap) == (ssize_t)size);
+    assert(memcmp(model, rdata, size) == 0);
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);   // El checksum incremental cuadra
+
+    assert(fs_save(fs, "test_pwrite") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_pwrite");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_read_file(fs, "log", rdata, cap) == (ssize_t)size);
+    assert(memcmp(model, rdata, size) == 0);
+
+    free(model);
+    free(rdata);
+    fs_destroy(fs);
+    r = system("rm -rf test_pwrite");
+    printf("✔ test_pwrite\n");
+}
+
+// 22) Caché de bloques decodificados con escritura diferida
+static void test_block_cache(void) {
+    printf("\n=== test_block_cache ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_block_cache");
+    assert(mkdir("test_block_cache", 0777) == 0);
+
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    size_t bb = TEST_BLOCK_SIZE / 8, size = 40 * bb;
+    uint8_t *data = malloc(size), *rdata = malloc(size), raw[8];
+    assert(data && rdata);
+    fill_pattern(data, size, 7);
+    assert(fs_create_file(fs, "f") >= 0);
+    assert(fs_write_file(fs, "f", data, size) == (ssize_t)size);
+
+    // Releer acierta en la caché
+    unsigned long misses = fs->bcache.misses;
+    assert(fs_read_file(fs, "f", rdata, size) == (ssize_t)size);
+    assert(memcmp(data, rdata, size) == 0);
+    assert(fs->bcache.misses == misses && fs->bcache.hits >= 40);
+
+    // Lo escrito queda en memoria hasta fs_flush
+    const DirEntry *e = dir_entry(&fs->dir, dir_find(&fs->dir, "f"));
+    size_t bit = fs->sb.data_offset + (size_t)e->ext[0].start * TEST_BLOCK_SIZE;
+    PBMImage *img = fs_segment(fs, 0);
+    assert(img && pbm_read_bits(img, bit, raw, 64) == 0);
+    assert(memcmp(raw, data, sizeof(raw)) != 0);
+    assert(fs->bcache.ndirty > 0);
+    assert(fs_flush(fs) == 0 && fs->bcache.ndirty == 0);
+    img = fs_segment(fs, 0);
+    assert(img && pbm_read_bits(img, bit, raw, 64) == 0);
+    assert(memcmp(raw, data, sizeof(raw)) == 0);
+
+    // Con 4 huecos las sobrescrituras expulsan (y escriben) los sucios
+    assert(fs_set_block_cache(fs, 4 * bb) == 0);
+    for (size_t off = 0; off < size; off += bb) data[off] ^= 0xFF;
+    for (size_t off = 0; off < size; off += bb)
+        assert(fs_pwrite(fs, "f", data + off, 1, (off_t)off) == 1);
+    assert(fs->bcache.writebacks >= 36);
+    assert(fs_read_file(fs, "f", rdata, size) == (ssize_t)size);
+    assert(memcmp(data, rdata, size) == 0);
+
+    // Sin caché se ve lo mismo
+    assert(fs_set_block_cache(fs, 0) == 0 && fs->bcache.nslots == 0);
+    assert(fs_read_file(fs, "f", rdata, size) == (ssize_t)size);
+    assert(memcmp(data, rdata, size) == 0);
+    assert(fs_check_integrity(fs) == 0);
+
+    // fs_save vuelca lo pendiente
+    assert(fs_set_block_cache(fs, BWFS_DEFAULT_BLOCK_CACHE_BYTES) == 0);
+    data[5] ^= 0x55;
+    assert(fs_pwrite(fs, "f", data + 5, 1, 5) == 1);
+    assert(fs_save(fs, "test_block_cache") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_block_cache");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_read_file(fs, "f", rdata, size) == (ssize_t)size);
+    assert(memcmp(data, rdata, size) == 0);
+
+    free(data);
+    free(rdata);
+    fs_destroy(fs);
+    r = system("rm -rf test_block_cache");
+    printf("✔ test_block_cache\n");
+}
+
+// 23) Descriptores: E/S por índice de entrada, sin resolver el nombre
+static void test_open_handles(void) {
+    printf("\n=== test_open_handles ===\n");
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    size_t bb = TEST_BLOCK_SIZE / 8, size = 20 * bb;
+    uint8_t *data = malloc(size), *rdata = malloc(size);
+    assert(data && rdata);
+    fill_pattern(data, size, 3);
+
+    assert(fs_mkdir(fs, "d") == 0);
+    assert(fs_open(fs, "nope") == -ENOENT);
+    assert(fs_open(fs, "d") == -EISDIR);
+    int created = fs_create_file(fs, "d/f");
+    assert(created >= 0);
+    int idx = fs_open(fs, "d/f");
+    assert(idx == created);
+
+    // Ninguna E/S del descriptor consulta la tabla de nombres
+    unsigned long lookups = fs->dir.dc_hits + fs->dir.dc_misses;
+    for (size_t off = 0; off < size; off += 100) {
+        size_t n = size - off < 100 ? size - off : 100;
+        assert(fs_pwrite_entry(fs, idx, data + off, n, (off_t)off) == (ssize_t)n);
+    }
+    assert(fs_pread_entry(fs, idx, rdata, size, 0) == (ssize_t)size);
+    assert(memcmp(data, rdata, size) == 0);
+    assert(fs_pread_entry(fs, idx, rdata, 10, (off_t)size) == 0);
+    assert(fs_pread_entry(fs, idx, rdata, 10, -1) < 0);
+
+    // La lectura anticipada deja los bloques en la caché
+    assert(fs_set_block_cache(fs, 0) == 0);
+    assert(fs_set_block_cache(fs, 64 * bb) == 0);
+    assert(fs_readahead(fs, idx, 0, size) == 20);
+    unsigned long misses = fs->bcache.misses;
+    assert(fs_pread_entry(fs, idx, rdata, size, 0) == (ssize_t)size);
+    assert(fs->bcache.misses == misses);
+    assert(memcmp(data, rdata, size) == 0);
+    assert(fs_readahead(fs, idx, (off_t)size, 100) == 0);
+    assert(fs->dir.dc_hits + fs->dir.dc_misses == lookups);
+
+    // Renombrar no invalida el índice; borrar sí
+    assert(fs_rename(fs, "d/f", "g") == 0);
+    assert(fs_pread_entry(fs, idx, rdata, size, 0) == (ssize_t)size);
+    assert(fs_remove_file(fs, "g") == 0);
+    assert(fs_pread_entry(fs, idx, rdata, size, 0) < 0);
+    assert(fs_pwrite_entry(fs, idx, data, 1, 0) < 0);
+    expect_counters(fs);
+
+    free(data);
+    free(rdata);
+    fs_destroy(fs);
+    printf("✔ test_open_handles\n");
+}
+
+// 24) truncate y fallocate
+static void test_truncate_fallocate(void) {
+    printf("\n=== test_truncate_fallocate ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_truncate");
+    assert(mkdir("test_truncate", 0777) == 0);
+
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    size_t bb = TEST_BLOCK_SIZE / 8, size = 30 * bb;
+    uint8_t *model = calloc(1, 2 * size), *rdata = malloc(2 * size), chunk[100];
+    assert(model && rdata);
+    assert(fs_create_file(fs, "db") >= 0);
+    assert(fs_mkdir(fs, "d") == 0);
+    int idx = dir_find(&fs->dir, "db");
+
+    // Preasignar sin cambiar el tamaño: un solo tramo
+    assert(fs_fallocate(fs, "db", 1, 0, (off_t)size) == 0);
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    assert(e->size == 0 && e->block_count == 30 && e->ext_count == 1);
+    uint32_t first = e->ext[0].start;
+
+    // Los anexos secuenciales ya no reservan nada
+    uint64_t free_before = fs->free_blocks;
+    for (size_t off = 0; off < size; off += sizeof(chunk)) {
+        size_t n = size - off < sizeof(chunk) ? size - off : sizeof(chunk);
+        fill_pattern(chunk, n, (int)off);
+        assert(fs_pwrite(fs, "db", chunk, n, (off_t)off) == (ssize_t)n);
+        memcpy(model + off, chunk, n);
+    }
+    e = dir_entry(&fs->dir, idx);
+    assert(fs->free_blocks == free_before);
+    assert(e->size == size && e->block_count == 30 && e->ext[0].start == first);
+    assert(fs_check_integrity(fs) == 0);
+
+    // Encoger a mitad de bloque libera lo que queda fuera
+    size_t cut = 10 * bb + 7;
+    assert(fs_truncate(fs, "db", (off_t)cut) == 0);
+    e = dir_entry(&fs->dir, idx);
+    assert(e->size == cut && e->block_count == 11);
+    assert(fs->free_blocks == free_before + 19);
+    assert(fs_check_integrity(fs) == 0);
+
+    // Crecer deja ceros (también tras la cola del último bloque) sin reservar
+    memset(model + cut, 0, 2 * size - cut);
+    assert(fs_truncate_entry(fs, idx, (off_t)(size + 5)) == 0);
+    assert(dir_entry(&fs->dir, idx)->block_count == 11);
+    assert(fs_read_file(fs, "db", rdata, 2 * size) == (ssize_t)(size + 5));
+    assert(memcmp(model, rdata, size + 5) == 0);
+    assert(fs_check_integrity(fs) == 0);
+
+    // fallocate sin keep_size alarga el archivo a ceros
+    assert(fs_fallocate_entry(fs, idx, 0, (off_t)size, (off_t)size) == 0);
+    e = dir_entry(&fs->dir, idx);
+    assert(e->size == 2 * size && e->block_count == 41);
+    assert(fs_read_file(fs, "db", rdata, 2 * size) == (ssize_t)(2 * size));
+    assert(memcmp(model, rdata, 2 * size) == 0);
+
+    // Preasignar rellena el hueco que dejó truncate
+    assert(fs_fallocate(fs, "db", 1, 0, (off_t)(2 * size)) == 0);
+    e = dir_entry(&fs->dir, idx);
+    assert(e->block_count == 60 && e->ext[0].start == first);
+    assert(fs_read_file(fs, "db", rdata, 2 * size) == (ssize_t)(2 * size));
+    assert(memcmp(model, rdata, 2 * size) == 0);
+
+    // fs_write_file reutiliza los bloques que ya tiene
+    fill_pattern(model, size, 42);
+    assert(fs_write_file(fs, "db", model, size) == (ssize_t)size);
+    e = dir_entry(&fs->dir, idx);
+    assert(e->ext[0].start == first && e->block_count == 30);
+
+    // Errores
+    assert(fs_truncate(fs, "nope", 0) == -ENOENT);
+    assert(fs_truncate(fs, "d", 0) == -EISDIR);
+    assert(fs_truncate(fs, "db", -1) == -EINVAL);
+    assert(fs_truncate(fs, "db", (off_t)UINT32_MAX + 1) == -EFBIG);
+    assert(fs_fallocate(fs, "db", 0, 0, 0) == -EINVAL);
+    assert(fs_fallocate(fs, "db", 0, -1, 10) == -EINVAL);
+    expect_counters(fs);
+
+    assert(fs_save(fs, "test_truncate") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_truncate");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_read_file(fs, "db", rdata, 2 * size) == (ssize_t)size);
+    assert(memcmp(model, rdata, size) == 0);
+    assert(fs_truncate(fs, "db", 0) == 0);
+    e = dir_entry(&fs->dir, dir_find(&fs->dir, "db"));
+    assert(e->size == 0 && e->block_count == 0 && e->ext_count == 0);
+    expect_counters(fs);
+
+    free(model);
+    free(rdata);
+    fs_destroy(fs);
+    r = system("rm -rf test_truncate");
+    printf("✔ test_truncate_fallocate\n");
+}
+
+// 25) Archivos dispersos: huecos sin bloque y SEEK_DATA / SEEK_HOLE
+static void test_sparse(void) {
+    printf("\n=== test_sparse ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_sparse");
+    assert(mkdir("test_sparse", 0777) == 0);
+
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    size_t bb = TEST_BLOCK_SIZE / 8, far = 1000 * bb, size = far + 1;
+    uint8_t *model = calloc(1, size), *rdata = malloc(size), chunk[16];
+    assert(model && rdata);
+    int idx = fs_create_file(fs, "vm");
+    assert(idx >= 0);
+
+    // Escribir lejos sólo reserva el bloque escrito
+    uint64_t free_before = fs->free_blocks;
+    model[far] = 0xAB;
+    assert(fs_pwrite(fs, "vm", model + far, 1, (off_t)far) == 1);
+    const DirEntry *e = dir_entry(&fs->dir, idx);
+    assert(e->size == size && e->block_count == 1 && e->ext_count == 2);
+    assert(fs->free_blocks == free_before - 1);
+    assert(fs_read_file(fs, "vm", rdata, size) == (ssize_t)size);
+    assert(memcmp(model, rdata, size) == 0);
+
+    assert(fs_seek_data(fs, idx, 0, 0) == (off_t)far);
+    assert(fs_seek_data(fs, idx, 0, 1) == 0);
+    assert(fs_seek_data(fs, idx, (off_t)far, 1) == (off_t)size);
+    assert(fs_seek_data(fs, idx, (off_t)size, 0) == -ENXIO);
+    assert(fs_seek_data(fs, idx, -1, 1) == -ENXIO);
+
+    // Rellenar un hueco por partes alarga el tramo en vez de fragmentar
+    for (int b = 500; b < 520; b++) {
+        fill_pattern(chunk, sizeof(chunk), b);
+        size_t off = (size_t)b * bb + (b == 500 ? 10 : 0);
+        assert(fs_pwrite(fs, "vm", chunk, sizeof(chunk), (off_t)off) == (ssize_t)sizeof(chunk));
+        memcpy(model + off, chunk, sizeof(chunk));
+    }
+    e = dir_entry(&fs->dir, idx);
+    assert(e->block_count == 21 && e->ext_count == 4);
+    assert(fs_seek_data(fs, idx, 0, 0) == (off_t)(500 * bb));
+    assert(fs_seek_data(fs, idx, (off_t)(500 * bb), 1) == (off_t)(520 * bb));
+    assert(fs_read_file(fs, "vm", rdata, size) == (ssize_t)size);
+    assert(memcmp(model, rdata, size) == 0);
+    assert(fs_check_integrity(fs) == 0);
+
+    // Muchos huecos: la lista de tramos desborda la entrada
+    for (int b = 0; b < 40; b++) {
+        size_t off = (size_t)b * 3 * bb + 1;
+        model[off] = (uint8_t)(b + 1);
+        assert(fs_pwrite(fs, "vm", model + off, 1, (off_t)off) == 1);
+    }
+    e = dir_entry(&fs->dir, idx);
+    assert(e->ext_count > BWFS_INLINE_EXTENTS && e->block_count == 61);
+    assert(fs_read_file(fs, "vm", rdata, size) == (ssize_t)size);
+    assert(memcmp(model, rdata, size) == 0);
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+
+    assert(fs_save(fs, "test_sparse") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_sparse");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    idx = dir_find(&fs->dir, "vm");
+    assert(fs_read_file(fs, "vm", rdata, size) == (ssize_t)size);
+    assert(memcmp(model, rdata, size) == 0);
+    assert(fs_seek_data(fs, idx, (off_t)(520 * bb), 0) == (off_t)far);
+
+    // Recortar dentro de un hueco libera los bloques de detrás
+    assert(fs_truncate(fs, "vm", (off_t)(700 * bb)) == 0);
+    e = dir_entry(&fs->dir, idx);
+    assert(e->block_count == 60);
+    assert(fs_seek_data(fs, idx, (off_t)(600 * bb), 0) == -ENXIO);
+    assert(fs_seek_data(fs, idx, (off_t)(600 * bb), 1) == (off_t)(600 * bb));
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+
+    free(model);
+    free(rdata);
+    fs_destroy(fs);
+    r = system("rm -rf test_sparse");
+    printf("✔ test_sparse\n");
+}
+
+// 26) Concurrencia: varios hilos con E/S sobre archivos distintos mientras
+// otro cambia el espacio de nombres (como un montaje FUSE multihilo)
+#define CONC_WRITERS 4
+#define CONC_BLOCKS  16
+
+typedef struct {
+    FSImage     *fs;
+    int          id;
+    int          idx;
+    unsigned int seed;
+    size_t       size;
+    uint8_t      model[CONC_BLOCKS * (TEST_BLOCK_SIZE / 8)];
+} ConcWriter;
+
+static void *conc_writer(void *arg) {
+    ConcWriter *w = arg;
+    size_t max = sizeof(w->model);
+    uint8_t chunk[300], rdata[sizeof(w->model)];
+    for (int it = 0; it < 300; it++) {
+        size_t off = rand_r(&w->seed) % max;
+        size_t len = 1 + rand_r(&w->seed) % sizeof(chunk);
+        if (len > max - off) len = max - off;
+        fill_pattern(chunk, len, w->id * 1000 + it);
+        assert(fs_pwrite_entry(w->fs, w->idx, chunk, len, (off_t)off) == (ssize_t)len);
+        if (off > w->size) memset(w->model + w->size, 0, off - w->size);
+        memcpy(w->model + off, chunk, len);
+        if (off + len > w->size) w->size = off + len;
+
+        if (it % 50 == 49) {
+            size_t cut = rand_r(&w->seed) % (w->size + 1);
+            assert(fs_truncate_entry(w->fs, w->idx, (off_t)cut) == 0);
+            w->size = cut;
+        }
+        if (it % 10 == 0) {
+            DirEntry e;
+            assert(fs_stat(w->fs, w->idx, &e) == 0 && e.size == w->size);
+            assert(fs_pread_entry(w->fs, w->idx, rdata, max, 0) == (ssize_t)w->size);
+            assert(memcmp(rdata, w->model, w->size) == 0);
+        }
+    }
+    return NULL;
+}
+
+static void *conc_namespace(void *arg) {
+    FSImage *fs = arg;
+    char name[32];
+    uint8_t data[200];
+    for (int i = 0; i < 60; i++) {
+        snprintf(name, sizeof(name), "d/n%d", i);
+        assert(fs_create_file(fs, name) >= 0);
+        fill_pattern(data, sizeof(data), i);
+        assert(fs_write_file(fs, name, data, sizeof(data)) == (ssize_t)sizeof(data));
+        if (i % 2) assert(fs_remove_file(fs, name) == 0);
+        assert(fs_lookup(fs, "d") >= 0);
+    }
+    return NULL;
+}
+
+static int conc_count(void *ctx, int idx, const DirEntry *e) {
+    (void)idx; (void)e;
+    (*(int *)ctx)++;
+    return 0;
+}
+
+static void test_concurrency(void) {
+    printf("\n=== test_concurrency ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_concurrency");
+    assert(mkdir("test_concurrency", 0777) == 0);
+
+    // Caché de bloques pequeña para que haya expulsiones con escritura
+    // diferida mientras otros hilos leen
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    assert(fs_set_block_cache(fs, 8 * (TEST_BLOCK_SIZE / 8)) == 0);
+    assert(fs_mkdir(fs, "d") == 0);
+
+    static ConcWriter w[CONC_WRITERS];
+    pthread_t th[CONC_WRITERS + 1];
+    for (int i = 0; i < CONC_WRITERS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "w%d", i);
+        w[i].fs   = fs;
+        w[i].id   = i;
+        w[i].idx  = fs_create_file(fs, name);
+        w[i].seed = (unsigned int)rand();
+        w[i].size = 0;
+        assert(w[i].idx >= 0);
+        assert(pthread_create(&th[i], NULL, conc_writer, &w[i]) == 0);
+    }
+    assert(pthread_create(&th[CONC_WRITERS], NULL, conc_namespace, fs) == 0);
+    for (int i = 0; i <= CONC_WRITERS; i++) assert(pthread_join(th[i], NULL) == 0);
+
+    int children = 0;
+    assert(fs_list_dir(fs, fs_lookup(fs, "d"), conc_count, &children) == 0);
+    assert(children == 30);
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+
+    assert(fs_save(fs, "test_concurrency") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_concurrency");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    uint8_t rdata[sizeof(w[0].model)];
+    for (int i = 0; i < CONC_WRITERS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "w%d", i);
+        assert(fs_pread(fs, name, rdata, sizeof(rdata), 0) == (ssize_t)w[i].size);
+        assert(memcmp(rdata, w[i].model, w[i].size) == 0);
+    }
+
+    fs_destroy(fs);
+    r = system("rm -rf test_concurrency");
+    printf("✔ test_concurrency\n");
+}
+
+// 27) Lecturas sin cerrojo (fs_lookup, fs_stat, fs_list_dir) mientras la
+// tabla crece y otro hilo cambia el tamaño de un archivo
+#define SEQ_SIZE_A  100
+#define SEQ_SIZE_B  (5 * (TEST_BLOCK_SIZE / 8) + 7)
+
+typedef struct {
+    FSImage    *fs;
+    int         fixed, target, sized;
+    atomic_int  done;
+    atomic_long reads;
+} SeqCtx;
+
+static void *seq_reader(void *arg) {
+    SeqCtx *c = arg;
+    long n = 0;
+    while (!atomic_load(&c->done) || n < 1000) {
+        DirEntry e;
+        assert(fs_lookup(c->fs, "fixed/f3") == c->target);
+        assert(fs_stat(c->fs, c->sized, &e) == 0);
+        assert(strcmp(e.name, "sized") == 0);
+        assert(e.size == SEQ_SIZE_A || e.size == SEQ_SIZE_B);
+        int children = 0;
+        assert(fs_list_dir(c->fs, c->fixed, conc_count, &children) == 0);
+        assert(children == 5);
+        n++;
+    }
+    atomic_fetch_add(&c->reads, n);
+    return NULL;
+}
+
+static void *seq_resizer(void *arg) {
+    SeqCtx *c = arg;
+    for (int i = 0; i < 400; i++)
+        assert(fs_truncate_entry(c->fs, c->sized, i % 2 ? SEQ_SIZE_B : SEQ_SIZE_A) == 0);
+    return NULL;
+}
+
+static void test_lockless_reads(void) {
+    printf("\n=== test_lockless_reads ===\n");
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    static SeqCtx c;
+    c.fs = fs;
+    atomic_init(&c.done, 0);
+    atomic_init(&c.reads, 0);
+    assert(fs_mkdir(fs, "fixed") == 0 && fs_mkdir(fs, "g") == 0);
+    c.fixed = fs_lookup(fs, "fixed");
+    for (int i = 0; i < 5; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "fixed/f%d", i);
+        int idx = fs_create_file(fs, name);
+        assert(idx >= 0);
+        if (i == 3) c.target = idx;
+    }
+    c.sized = fs_create_file(fs, "sized");
+    assert(c.sized >= 0 && fs_truncate_entry(fs, c.sized, SEQ_SIZE_A) == 0);
+
+    pthread_t readers[2], resizer;
+    for (int i = 0; i < 2; i++)
+        assert(pthread_create(&readers[i], NULL, seq_reader, &c) == 0);
+    assert(pthread_create(&resizer, NULL, seq_resizer, &c) == 0);
+
+    // Los lectores no deben ver la tabla a medio crecer
+    uint32_t before = fs->dir.max_entries;
+    for (int i = 0; i < 3 * BWFS_MAX_FILES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "g/x%d", i);
+        assert(fs_create_file(fs, name) >= 0);
+    }
+    assert(pthread_join(resizer, NULL) == 0);
+    atomic_store(&c.done, 1);
+    for (int i = 0; i < 2; i++) assert(pthread_join(readers[i], NULL) == 0);
+    assert(fs->dir.max_entries > before);
+    printf("Lecturas: %ld, entradas %u -> %u\n", atomic_load(&c.reads), before,
+           fs->dir.max_entries);
+
+    expect_counters(fs);
+    assert(fs_check_integrity(fs) == 0);
+    fs_destroy(fs);
+    printf("✔ test_lockless_reads\n");
+}
+
+// 28) Inodos para FUSE de bajo nivel: búsqueda por (padre, nombre), ruta de
+// una entrada y generación que cambia al reutilizarla
+static int list_idx(void *ctx, int idx, const DirEntry *e) {
+    int *found = ctx;
+    if (strcmp(e->name, "b") == 0) *found = idx;
+    return 0;
+}
+
+static void test_inodes(void) {
+    printf("\n=== test_inodes ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_inodes");
+    assert(mkdir("test_inodes", 0777) == 0);
+
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    assert(fs_mkdir(fs, "a") == 0);
+    int a = fs_lookup(fs, "a");
+    int b = fs_create_file(fs, "a/b");
+    assert(a >= 0 && b >= 0);
+    assert(fs_lookup_at(fs, BWFS_DIR_ROOT, "a") == a);
+    assert(fs_lookup_at(fs, a, "b") == b);
+    assert(fs_lookup_at(fs, a, "zz") == -ENOENT);
+    assert(fs_lookup_at(fs, BWFS_DIR_ROOT, "b") == -ENOENT);
+    int found = -1;
+    assert(fs_list_dir(fs, a, list_idx, &found) == 0 && found == b);
+
+    char path[64];
+    assert(fs_path(fs, b, path, sizeof(path)) == 0 && strcmp(path, "a/b") == 0);
+    assert(fs_path(fs, BWFS_DIR_ROOT, path, sizeof(path)) == 0 && path[0] == '\0');
+    assert(fs_path(fs, b, path, 3) == -ENAMETOOLONG);
+
+    // La entrada liberada se reutiliza con otra generación
+    DirEntry e;
+    assert(fs_stat(fs, b, &e) == 0);
+    uint16_t gen = e.generation;
+    assert(fs_remove_file(fs, "a/b") == 0);
+    assert(fs_stat(fs, b, &e) == -ENOENT);
+    assert(fs_path(fs, b, path, sizeof(path)) == -ENOENT);
+    assert(fs_create_file(fs, "a/c") == b);
+    assert(fs_stat(fs, b, &e) == 0 && e.generation != gen);
+    gen = e.generation;
+    assert(fs_check_integrity(fs) == 0);
+
+    // La generación se guarda con la entrada
+    assert(fs_save(fs, "test_inodes") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_inodes");
+    assert(fs);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_stat(fs, b, &e) == 0 && e.generation == gen);
+    fs_destroy(fs);
+    r = system("rm -rf test_inodes");
+    printf("✔ test_inodes\n");
+}
+
+// 29) Lectura sin copia: trozos en la caché de bloques o en los bits del
+// segmento, iguales a lo que copia fs_pread_entry
+static size_t vec_gather(const FSReadVec *v, uint8_t *out) {
+    size_t n = 0;
+    for (int i = 0; i < v->count; ++i) {
+        memcpy(out + n, v->chunks[i].data, v->chunks[i].len);
+        n += v->chunks[i].len;
+    }
+    return n;
+}
+
+static void test_zero_copy_reads(void) {
+    printf("\n=== test_zero_copy_reads ===\n");
+    FSCreateOptions opts = { .features = BWFS_FEAT_ALIGN64 };
+    FSImage *fs = fs_create_ex(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE, &opts);
+    assert(fs && fs->aligned);
+    size_t bb = fs->sb.block_size / 8, size = 12 * bb;
+    uint8_t *data = calloc(1, size), *rdata = malloc(size), *vdata = malloc(size);
+    assert(data && rdata && vdata);
+    // Bloques 0-3 con datos, 4-7 hueco, 8-11 con datos
+    fill_pattern(data, 4 * bb, 3);
+    fill_pattern(data + 8 * bb, 4 * bb, 4);
+    int idx = fs_create_file(fs, "z");
+    assert(idx >= 0);
+    assert(fs_pwrite(fs, "z", data, 4 * bb, 0) == (ssize_t)(4 * bb));
+    assert(fs_pwrite(fs, "z", data + 8 * bb, 4 * bb, (off_t)(8 * bb)) == (ssize_t)(4 * bb));
+
+    // Con caché: los bloques quedan fijados hasta soltar el vector
+    FSReadVec v;
+    memset(&v, 0, sizeof(v));
+    off_t off = 3;
+    ssize_t n = fs_pread_vec(fs, idx, size, off, &v);
+    assert(n == (ssize_t)(size - 3) && v.len == (size_t)n);
+    assert(fs->bcache.npinned == 8);
+    assert(vec_gather(&v, vdata) == (size_t)n);
+    assert(memcmp(vdata, data + 3, (size_t)n) == 0);
+    fs_pread_vec_release(fs, &v);
+    assert(fs->bcache.npinned == 0 && v.count == 0);
+
+    // Más allá del final no hay trozos; con max_chunks se pide copiar
+    assert(fs_pread_vec(fs, idx, 10, (off_t)size, &v) == 0 && v.count == 0);
+    fs_pread_vec_release(fs, &v);
+    v.max_chunks = 2;
+    assert(fs_pread_vec(fs, idx, size, 0, &v) < 0 && fs->bcache.npinned == 0);
+    v.max_chunks = 0;
+
+    // Una caché pequeña no admite fijar más de la mitad
+    assert(fs_set_block_cache(fs, 4 * bb) == 0);
+    assert(fs_pread_vec(fs, idx, size, 0, &v) < 0 && fs->bcache.npinned == 0);
+    assert(fs_pread_vec(fs, idx, 2 * bb, 0, &v) == (ssize_t)(2 * bb));
+    assert(fs->bcache.npinned == 2);
+    fs_pread_vec_release(fs, &v);
+    assert(fs_pread_entry(fs, idx, rdata, size, 0) == (ssize_t)size);
+    assert(memcmp(rdata, data, size) == 0);
+
+    // Sin caché y con formato alineado, los trozos son los bits del segmento
+    assert(fs_set_block_cache(fs, 0) == 0);
+    assert(fs_pread_vec(fs, idx, size, 0, &v) == (ssize_t)size);
+    uint32_t refs = 0;
+    for (int i = 0; i < fs->image_count; ++i) refs += fs->seg_refs[i];
+    assert(refs > 0);
+    assert(vec_gather(&v, vdata) == size && memcmp(vdata, data, size) == 0);
+    fs_pread_vec_release(fs, &v);
+    for (int i = 0; i < fs->image_count; ++i) assert(fs->seg_refs[i] == 0);
+
+    free(data);
+    free(rdata);
+    free(vdata);
+    fs_destroy(fs);
+    printf("✔ test_zero_copy_reads\n");
+}
+
+// 30) Entradas referenciadas: borrarlas las deja huérfanas hasta soltar la
+// última referencia, y su posición no se reutiliza mientras tanto
+static void test_orphans(void) {
+    printf("\n=== test_orphans ===\n");
+    __attribute__((unused)) int r = system("rm -rf test_orphans");
+    assert(mkdir("test_orphans", 0777) == 0);
+
+    FSImage *fs = fs_create(TEST_WIDTH, TEST_HEIGHT, TEST_BLOCK_SIZE);
+    assert(fs);
+    struct statvfs before, st;
+    assert(fs_statfs(fs, &before) == 0);
+    uint8_t a[3000], b[3000], rdata[3000];
+    fill_pattern(a, sizeof(a), 1);
+    fill_pattern(b, sizeof(b), 2);
+
+    // Abrir (referencia), borrar, crear otro y escribir por el descriptor viejo
+    assert(fs_create_file(fs, "a") >= 0);
+    assert(fs_write_file(fs, "a", a, sizeof(a)) == (ssize_t)sizeof(a));
+    int old = fs_open(fs, "a");
+    DirEntry e;
+    assert(old >= 0 && fs_stat(fs, old, &e) == 0);
+    assert(fs_ref(fs, old, (uint16_t)(e.generation + 1)) == -ENOENT);
+    assert(fs_ref(fs, old, e.generation) == 0);
+    assert(fs_remove_file(fs, "a") == 0);
+    assert(fs_lookup(fs, "a") == -ENOENT);
+    int idx = fs_create_file(fs, "b");
+    assert(idx >= 0 && idx != old);
+    assert(fs_pwrite_entry(fs, old, b, 100, 0) == 100);
+    assert(fs_pread_entry(fs, idx, rdata, sizeof(rdata), 0) == 0);
+    assert(fs_pread_entry(fs, old, rdata, sizeof(rdata), 0) == (ssize_t)sizeof(rdata));
+    assert(memcmp(rdata, b, 100) == 0 && memcmp(rdata + 100, a + 100, 2900) == 0);
+    assert(fs_stat(fs, old, &e) == 0 && e.size == sizeof(a));
+    assert(fs_check_integrity(fs) == 0);
+
+    // La última referencia libera la entrada y sus bloques
+    assert(fs_unref(fs, old, 2) == -1);
+    assert(fs_unref(fs, old, 1) == 0);
+    assert(fs_stat(fs, old, &e) == -ENOENT);
+    assert(fs_remove_file(fs, "b") == 0);
+    assert(fs_statfs(fs, &st) == 0);
+    assert(st.f_bfree == before.f_bfree && st.f_ffree == before.f_ffree);
+    assert(fs_check_integrity(fs) == 0);
+
+    // Un directorio vacío también puede quedar huérfano
+    assert(fs_mkdir(fs, "d") == 0);
+    int d = fs_lookup(fs, "d");
+    assert(d >= 0 && fs_stat(fs, d, &e) == 0 && fs_ref(fs, d, e.generation) == 0);
+    assert(fs_rmdir(fs, "d") == 0 && fs_lookup(fs, "d") == -ENOENT);
+    assert(fs_mkdir(fs, "d") == 0 && fs_lookup(fs, "d") != d);
+    assert(fs_unref(fs, d, 1) == 0 && fs_stat(fs, d, &e) == -ENOENT);
+
+    // Una huérfana guardada (montaje interrumpido) se libera al cargar
+    assert(fs_create_file(fs, "c") >= 0);
+    assert(fs_write_file(fs, "c", a, sizeof(a)) == (ssize_t)sizeof(a));
+    old = fs_lookup(fs, "c");
+    assert(fs_stat(fs, old, &e) == 0 && fs_ref(fs, old, e.generation) == 0);
+    assert(fs_remove_file(fs, "c") == 0);
+    assert(fs_save(fs, "test_orphans") == 0);
+    fs_destroy(fs);
+    fs = fs_load("test_orphans");
+    assert(fs);
+    assert(fs_stat(fs, old, &e) == -ENOENT);
+    assert(fs_check_integrity(fs) == 0);
+    assert(fs_rmdir(fs, "d") == 0);
+    assert(fs_statfs(fs, &st) == 0 && st.f_bfree == before.f_bfree);
+
+    fs_destroy(fs);
+    r = system("rm -rf test_orphans");
+    printf("✔ test_orphans\n");
+}
+
 int main(void) {
     srand(time(NULL)); // Inicializar semilla aleatoria
     
     // Pruebas básicas
     test_pbm_manager();
+    test_pbm_bits();
+    test_pbm_mmap();
+    test_pbm_dirty();
     test_block_manager();
+    test_bm_summary();
+    test_bm_range();
     test_superblock();
     test_directory();
+    test_dir_index();
     
     // Pruebas con sistema de archivos
     printf("\n--- test_file_operations ---\n");
@@ -742,6 +2417,25 @@ int main(void) {
     // Pruebas de nuevas funcionalidades
     test_multiple_images();
     test_auto_expansion();
+    test_segment_cache();
+    test_commit_recovery();
+    test_aligned_layout();
+    test_free_counters();
+    test_cross_segment_alloc();
+    test_hierarchy();
+    test_dir_growth();
+    test_large_file();
+    test_pread();
+    test_pwrite();
+    test_block_cache();
+    test_open_handles();
+    test_truncate_fallocate();
+    test_sparse();
+    test_concurrency();
+    test_lockless_reads();
+    test_inodes();
+    test_zero_copy_reads();
+    test_orphans();
     
     printf("\n🎉 ¡Todas las pruebas pasaron!\n");
     return 0;